@@ -1,7 +1,7 @@
 //
 //  ZEPTO-8 — Fantasy console emulator
 //
-//  Copyright © 2016—2017 Sam Hocevar <sam@hocevar.net>
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
 //
 //  This program is free software. It comes without any warranty, to
 //  the extent permitted by applicable law. You can redistribute it
@@ -18,6 +18,7 @@
 
 #include <string>
 #include <regex>
+#include <cctype>
 
 #include <tao/pegtl.hpp>
 
@@ -88,14 +89,277 @@ struct query_at_sol
 namespace z8
 {
 
-std::string analyzer::fix(std::string const &code)
+namespace
+{
+
+// Edits that close a construct are ordered by decreasing start position,
+// so that nested constructs ending at the same place are closed first.
+// Insertions happen before replacements at the same position.
+ptrdiff_t closing(size_t start) { return -(ptrdiff_t)start - 1; }
+ptrdiff_t const opening = 0;
+ptrdiff_t const replacing = 1;
+
+template<typename R>
+struct action : pegtl::nothing<R> {};
+
+// Comments are remembered so that trailing comments can be excluded
+// from the end of statements. PICO-8 does not know long brackets of
+// level > 0 and allows nested long comments, so “--[=[” starts a short
+// comment and nested comments get a long bracket level that is not
+// found in the comment.
+struct comment_action
+{
+    template<typename Input>
+    static void apply(Input const &in, z8::analyzer &f)
+    {
+        std::string const text = in.string();
+        size_t const pos = in.position().byte;
+        f.m_comments[pos + text.length()] = pos;
+
+        if (text.compare(0, 2, "//") == 0)
+        {
+            f.edit(pos, 2, text[2] == '[' ? "-- " : "--", replacing);
+            return;
+        }
+
+        if (text.compare(0, 3, "--[") != 0)
+            return;
+
+        // Check whether this is a long comment with nested brackets
+        int depth = 0, max_depth = 0;
+        size_t i = 2;
+        for (; i + 1 < text.length(); ++i)
+        {
+            if (text[i] == '[' && text[i + 1] == '[')
+                max_depth = lol::max(max_depth, ++depth), ++i;
+            else if (text[i] == ']' && text[i + 1] == ']' && depth > 0)
+                if (--depth == 0)
+                    break;
+        }
+
+        if (depth > 0 || i + 2 != text.length())
+            f.edit(pos + 2, 0, " ", replacing);
+        else if (max_depth > 1)
+        {
+            std::string level;
+            while (text.find("]" + level + "]") != std::string::npos)
+                level += '=';
+            f.edit(pos + 2, 2, "[" + level + "[", replacing);
+            f.edit(pos + text.length() - 2, 2, "]" + level + "]", replacing);
+        }
+    }
+};
+
+template<> struct action<lua53::comment> : comment_action {};
+template<> struct action<lua53::cpp_comment> : comment_action {};
+template<> struct action<lua53::header_comment> : comment_action {};
+
+template<>
+struct action<lua53::operator_notequal>
+{
+    template<typename Input>
+    static void apply(Input const &in, z8::analyzer &f)
+    {
+        f.edit(in.position().byte, 2, "~=", replacing);
+    }
+};
+
+// Lua has no binary literals; convert them to hexadecimal, which is
+// exact for fractional parts, too.
+template<>
+struct action<lua53::binary>
+{
+    template<typename Input>
+    static void apply(Input const &in, z8::analyzer &f)
+    {
+        std::string const text = in.string();
+        size_t const dot = lol::min(text.find('.'), text.length());
+        std::string digits = text.substr(2, dot - 2);
+        std::string frac = dot < text.length() ? text.substr(dot + 1) : "";
+
+        digits.insert(0, (4 - digits.length() % 4) % 4, '0');
+        frac.append((4 - frac.length() % 4) % 4, '0');
+
+        auto to_hex = [](std::string const &bits)
+        {
+            std::string ret;
+            for (size_t i = 0; i < bits.length(); i += 4)
+                ret += "0123456789abcdef"[std::stoi(bits.substr(i, 4), nullptr, 2)];
+            return ret;
+        };
+
+        std::string hex = "0x" + (digits.length() ? to_hex(digits) : "0");
+        if (frac.length())
+            hex += "." + to_hex(frac);
+        f.edit(in.position().byte, text.length(), hex, replacing);
+    }
+};
+
+// The following rules may be matched several times because of
+// backtracking, so they only record positions; the edits are done by
+// the enclosing statements.
+template<>
+struct action<lua53::short_if_cond>
+{
+    template<typename Input>
+    static void apply(Input const &in, z8::analyzer &f)
+    {
+        f.m_conds[in.position().byte] = in.position().byte + in.size();
+    }
+};
+
+template<>
+struct action<lua53::reassign_var>
+{
+    template<typename Input>
+    static void apply(Input const &in, z8::analyzer &f)
+    {
+        f.m_vars[in.position().byte] = f.trim(in.position().byte,
+                                              in.position().byte + in.size());
+    }
+};
+
+template<>
+struct action<lua53::reassign_op>
+{
+    template<typename Input>
+    static void apply(Input const &in, z8::analyzer &f)
+    {
+        f.m_ops.insert(in.position().byte);
+    }
+};
+
+// “if (a) b” becomes “if (a) then b end”
+template<>
+struct action<lua53::short_if_statement>
+{
+    template<typename Input>
+    static void apply(Input const &in, z8::analyzer &f)
+    {
+        size_t const start = in.position().byte;
+        auto cond = f.m_conds.lower_bound(start);
+        f.edit(cond->second, 0, " then ", opening);
+        f.edit(f.trim(start, start + in.size()), 0, " end", closing(start));
+    }
+};
+
+// “if (a) do” becomes “if (a) then”
+template<>
+struct action<lua53::if_do_trail>
+{
+    template<typename Input>
+    static void apply(Input const &in, z8::analyzer &f)
+    {
+        f.edit(in.position().byte, in.size(), "then", replacing);
+    }
+};
+
+// “?a,b” becomes “print(a,b)”
+template<>
+struct action<lua53::short_print>
+{
+    template<typename Input>
+    static void apply(Input const &in, z8::analyzer &f)
+    {
+        size_t const start = in.position().byte;
+        f.edit(start, 1, "print(", replacing);
+        f.edit(f.trim(start, start + in.size()), 0, ")", closing(start));
+    }
+};
+
+// “a += b” becomes “a = a + (b)”; PICO-8 also accepts a trailing comma,
+// which is replaced with a space.
+template<>
+struct action<lua53::reassignment>
+{
+    template<typename Input>
+    static void apply(Input const &in, z8::analyzer &f)
+    {
+        std::string const &code = *f.m_code;
+        size_t const start = in.position().byte;
+        size_t end = f.trim(start, start + in.size());
+        if (code[end - 1] == ',')
+        {
+            f.edit(end - 1, 1, " ", replacing);
+            end = f.trim(start, end - 1);
+        }
+
+        auto var = f.m_vars.lower_bound(start);
+        size_t const op = *f.m_ops.lower_bound(var->second);
+        std::string const name = code.substr(var->first, var->second - var->first);
+        f.edit(op, 2, "= " + name + " " + code[op] + " (", replacing);
+        f.edit(end, 0, ")", closing(start));
+    }
+};
+
+} // anonymous namespace
+
+void analyzer::edit(size_t pos, size_t len, std::string const &text,
+                    ptrdiff_t order)
+{
+    m_edits[std::make_tuple(pos, order)] = std::make_tuple(len, text);
+}
+
+size_t analyzer::trim(size_t start, size_t end) const
+{
+    while (end > start)
+    {
+        auto comment = m_comments.find(end);
+        if (comment != m_comments.end())
+            end = comment->second;
+        else if (isspace((uint8_t)(*m_code)[end - 1]))
+            --end;
+        else
+            break;
+    }
+    return end;
+}
+
+std::string analyzer::fix(std::string const &str)
 {
     /* PNG carts have a “if(_update60)_update…” code snippet added by PICO-8
      * for backwards compatibility. But some buggy versions apparently miss
      * a carriage return or space, leading to syntax errors or maybe this
      * code being lost in a comment. */
     static std::regex pattern("if(_update60)_update=function()_update60()_update_buttons()_update60()end");
-    return std::regex_replace(code, pattern, "");
+    std::string const code = std::regex_replace(str, pattern, "");
+
+    m_code = &code;
+    m_disable_crlf = 0;
+    m_comments.clear();
+    m_conds.clear();
+    m_vars.clear();
+    m_ops.clear();
+    m_edits.clear();
+
+    try
+    {
+        pegtl::memory_input<> in(code.data(), code.size(), "code");
+        pegtl::parse<lua53::grammar, action>(in, *this);
+    }
+    catch (pegtl::parse_error const &e)
+    {
+        // Let the VM report the error with its own parser
+        msg::warn("cannot translate code: %s\n", e.what());
+        return code;
+    }
+
+    std::string ret;
+    ret.reserve(code.length() + code.length() / 8);
+    size_t pos = 0;
+    for (auto const &e : m_edits)
+    {
+        size_t const start = std::get<0>(e.first);
+        if (start < pos)
+            continue;
+        ret.append(code, pos, start - pos);
+        ret += std::get<1>(e.second);
+        pos = start + std::get<0>(e.second);
+    }
+    ret.append(code, pos, std::string::npos);
+
+    m_code = nullptr;
+    return ret;
 }
 
 } // namespace z8
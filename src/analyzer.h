@@ -1,7 +1,7 @@
 //
 //  ZEPTO-8 — Fantasy console emulator
 //
-//  Copyright © 2016—2018 Sam Hocevar <sam@hocevar.net>
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
 //
 //  This program is free software. It comes without any warranty, to
 //  the extent permitted by applicable law. You can redistribute it
@@ -14,14 +14,20 @@
 
 #include <lol/engine.h>
 
+#include <cstddef>
+#include <map>
+#include <set>
 #include <string>
+#include <tuple>
 
 // The analyzer class
 // ——————————————————
-// This class used to parse and rewrite the PICO-8 code and transcribe it to
-// regular Lua code. Now that we use z8lua instead of Lua, this is no longer
-// required, and the fix() function just adds some backwards compatibility
-// glue code to the source.
+// This class parses PICO-8 code and transcribes it to standard Lua 5.3:
+// compound assignments, “!=”, one-line “if ()” statements, “if () do”,
+// short print, binary literals and “//” comments are rewritten, and the
+// backwards compatibility glue that PICO-8 appends to PNG carts is
+// removed. Parser actions only record edits to the source, which are
+// then applied in a single pass.
 
 namespace z8
 {
@@ -29,9 +35,34 @@ namespace z8
 class analyzer
 {
 public:
+    // Bump this whenever the output of fix() changes, so that cached
+    // translations are invalidated
+    enum : int { version = 1 };
+
+    // Return the translated code, or the original code if it could
+    // not be parsed
     std::string fix(std::string const &str);
 
+    // Replace “len” characters at “pos” with “text”. Edits at the same
+    // position are applied in increasing “order”, and recording the
+    // same edit twice, which happens when the parser backtracks, is
+    // harmless.
+    void edit(size_t pos, size_t len, std::string const &text,
+              ptrdiff_t order = 0);
+
+    // Trim trailing whitespace and comments from the [start, end) range
+    size_t trim(size_t start, size_t end) const;
+
+    std::string const *m_code = nullptr;
     int m_disable_crlf = 0;
+
+    // Positions gathered by the parser actions; comments are indexed by
+    // their end, everything else by its start
+    std::map<size_t, size_t> m_comments, m_conds, m_vars;
+    std::set<size_t> m_ops;
+
+private:
+    std::map<std::tuple<size_t, ptrdiff_t>, std::tuple<size_t, std::string>> m_edits;
 };
 
 }
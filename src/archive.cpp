@@ -0,0 +1,374 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#if defined _WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#else
+#   include <dirent.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include "zepto8.h"
+#include "archive.h"
+#include "cache.h"
+#include "cart.h"
+
+namespace z8
+{
+
+using lol::msg;
+
+enum
+{
+    ARCHIVE_VERSION = 1,
+    ARCHIVE_ALIGN = 4096,
+    ROM_SIZE = sizeof(memory),
+    LABEL_SIZE = LABEL_WIDTH * LABEL_HEIGHT / 2,
+    THUMB_SIZE = cart_archive::THUMB_WIDTH * cart_archive::THUMB_HEIGHT / 2,
+};
+
+// The file starts with this header, padded to a page. Cart data follows,
+// then the index entries, then the names, which are not zero terminated.
+// Everything is in native byte order.
+struct cart_archive::header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t names_size;
+    uint64_t index_offset;
+};
+
+struct cart_archive::entry
+{
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t name_offset;
+    uint32_t name_size;
+    uint32_t has_label;
+    uint32_t reserved;
+    uint8_t thumb[THUMB_SIZE];
+};
+
+std::vector<std::string> list_carts(char const *dir)
+{
+    std::vector<std::string> ret;
+
+    auto is_cart = [](std::string const &name)
+    {
+        for (char const *ext : { ".p8", ".png", ".rom" })
+        {
+            size_t const len = strlen(ext);
+            if (name.length() > len && name.compare(name.length() - len, len, ext) == 0)
+                return true;
+        }
+        return false;
+    };
+
+#if defined _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE h = FindFirstFileA((std::string(dir) + "\\*").c_str(), &data);
+    if (h != INVALID_HANDLE_VALUE)
+    {
+        do
+            if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && is_cart(data.cFileName))
+                ret.push_back(data.cFileName);
+        while (FindNextFileA(h, &data));
+        FindClose(h);
+    }
+#else
+    if (DIR *d = opendir(dir))
+    {
+        while (dirent *e = readdir(d))
+            if (e->d_name[0] != '.' && is_cart(e->d_name))
+                ret.push_back(e->d_name);
+        closedir(d);
+    }
+#endif
+
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+bool cart_archive::open(char const *filename)
+{
+    close();
+
+    if (!m_file.open(filename) || m_file.size() < sizeof(header))
+        return false;
+
+    header const *h = (header const *)m_file.data();
+    uint64_t const index_size = (uint64_t)h->count * sizeof(entry) + h->names_size;
+    if (memcmp(h->magic, "z8a", 4) != 0 || h->version != ARCHIVE_VERSION
+         || h->index_offset > m_file.size()
+         || index_size > m_file.size() - h->index_offset)
+    {
+        msg::error("invalid cart archive %s\n", filename);
+        m_file.close();
+        return false;
+    }
+
+    m_count = h->count;
+    return true;
+}
+
+void cart_archive::close()
+{
+    m_file.close();
+    m_count = 0;
+}
+
+inline cart_archive::entry const *cart_archive::get_entry(size_t n) const
+{
+    header const *h = (header const *)m_file.data();
+    return (entry const *)(m_file.data() + h->index_offset) + n;
+}
+
+std::string cart_archive::name(size_t n) const
+{
+    header const *h = (header const *)m_file.data();
+    entry const *e = get_entry(n);
+    if ((uint64_t)e->name_offset + e->name_size > h->names_size)
+        return std::string();
+    char const *names = (char const *)(get_entry(m_count));
+    return std::string(names + e->name_offset, e->name_size);
+}
+
+uint64_t cart_archive::hash(size_t n) const
+{
+    return get_entry(n)->hash;
+}
+
+uint8_t const *cart_archive::thumbnail(size_t n) const
+{
+    entry const *e = get_entry(n);
+    return e->has_label ? e->thumb : nullptr;
+}
+
+int cart_archive::find(std::string const &name) const
+{
+    header const *h = (header const *)m_file.data();
+    char const *names = (char const *)(get_entry(m_count));
+
+    // Binary search, using the same order as std::string comparison
+    size_t lo = 0, hi = m_count;
+    while (lo < hi)
+    {
+        size_t const mid = (lo + hi) / 2;
+        entry const *e = get_entry(mid);
+        if ((uint64_t)e->name_offset + e->name_size > h->names_size)
+            return -1;
+
+        size_t const len = e->name_size;
+        int cmp = memcmp(names + e->name_offset, name.data(), std::min(len, name.length()));
+        if (cmp == 0)
+            cmp = len < name.length() ? -1 : len > name.length() ? 1 : 0;
+
+        if (cmp == 0)
+            return (int)mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return -1;
+}
+
+bool cart_archive::load(size_t n, cart &c) const
+{
+    if (n >= m_count)
+        return false;
+
+    entry const *e = get_entry(n);
+    uint64_t const size = ROM_SIZE + (e->has_label ? LABEL_SIZE : 0);
+    if (e->offset > m_file.size() || size > m_file.size() - e->offset)
+        return false;
+
+    uint8_t const *p = m_file.data() + e->offset;
+    memcpy(&c.m_rom, p, ROM_SIZE);
+    if (e->has_label)
+        c.m_label.assign(p + ROM_SIZE, p + ROM_SIZE + LABEL_SIZE);
+    else
+        c.m_label.clear();
+    c.load_code(PICO8_VERSION);
+
+    return true;
+}
+
+bool cart_archive::build(char const *dir, char const *filename)
+{
+    struct job
+    {
+        std::string name;
+        std::vector<uint8_t> rom, label;
+        bool done = false;
+    };
+
+    std::vector<std::string> const names = list_carts(dir);
+    std::vector<job> jobs(names.size());
+    for (size_t n = 0; n < names.size(); ++n)
+        jobs[n].name = names[n];
+
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+    {
+        msg::error("cannot open %s for writing\n", filename);
+        return false;
+    }
+
+    // Cart data starts after the header page; the header is written last
+    std::vector<uint8_t> page(ARCHIVE_ALIGN, 0);
+    fwrite(page.data(), 1, page.size(), f);
+
+    int const thread_count = lol::clamp((int)std::thread::hardware_concurrency(),
+                                        1, lol::max(1, (int)jobs.size()));
+
+    std::atomic<int> next(0);
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t written = 0;
+
+    auto worker = [&]()
+    {
+        for (;;)
+        {
+            int n = next++;
+            if (n >= (int)jobs.size())
+                break;
+
+            // Do not convert too far ahead of the writer
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return n < (int)written + 4 * thread_count; });
+            }
+
+            cart c;
+            if (c.load((std::string(dir) + "/" + jobs[n].name).c_str()))
+            {
+                jobs[n].rom = c.get_p8_rom(cart::code_format::pxa);
+                if (c.get_label().size() == LABEL_SIZE)
+                    jobs[n].label = c.get_label();
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                jobs[n].done = true;
+            }
+            cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; ++i)
+        threads.push_back(std::thread(worker));
+
+    // Write cart data in order, and build the index as we go
+    std::vector<entry> index;
+    std::string name_data;
+    uint64_t offset = ARCHIVE_ALIGN;
+    for (size_t n = 0; n < jobs.size(); ++n)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return jobs[n].done; });
+        }
+
+        job &j = jobs[n];
+        if (j.rom.size() == ROM_SIZE)
+        {
+            entry e;
+            memset(&e, 0, sizeof(e));
+            e.hash = cart_cache::hash(j.rom.data(), j.rom.size());
+            e.offset = offset;
+            e.name_offset = (uint32_t)name_data.length();
+            e.name_size = (uint32_t)j.name.length();
+            e.has_label = !j.label.empty();
+
+            // Nearest neighbour downscale of the label
+            int const step = LABEL_WIDTH / THUMB_WIDTH;
+            for (int y = 0; y < THUMB_HEIGHT && e.has_label; ++y)
+            for (int x = 0; x < THUMB_WIDTH; ++x)
+            {
+                int const src = (y * step * LABEL_WIDTH + x * step) / 2;
+                uint8_t const c = j.label[src] & 0xf;
+                e.thumb[(y * THUMB_WIDTH + x) / 2] |= (x & 1) ? c << 4 : c;
+            }
+
+            // Pad cart data to a page boundary
+            j.rom.insert(j.rom.end(), j.label.begin(), j.label.end());
+            j.rom.resize((j.rom.size() + ARCHIVE_ALIGN - 1) / ARCHIVE_ALIGN * ARCHIVE_ALIGN, 0);
+            fwrite(j.rom.data(), 1, j.rom.size(), f);
+            offset += j.rom.size();
+
+            index.push_back(e);
+            name_data += j.name;
+            msg::info("archived %s\n", j.name.c_str());
+        }
+        else
+        {
+            msg::error("cannot archive %s\n", j.name.c_str());
+        }
+
+        std::vector<uint8_t>().swap(j.rom);
+        std::vector<uint8_t>().swap(j.label);
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            written = n + 1;
+        }
+        cv.notify_all();
+    }
+
+    for (auto &th : threads)
+        th.join();
+
+    fwrite(index.data(), sizeof(entry), index.size(), f);
+    fwrite(name_data.data(), 1, name_data.length(), f);
+
+    header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "z8a", 4);
+    h.version = ARCHIVE_VERSION;
+    h.count = (uint32_t)index.size();
+    h.names_size = (uint32_t)name_data.length();
+    h.index_offset = offset;
+    fseek(f, 0, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, f);
+
+    bool const ok = !ferror(f);
+    if (fclose(f) != 0 || !ok)
+    {
+        msg::error("cannot write %s\n", filename);
+        return false;
+    }
+
+    msg::info("archived %d of %d carts\n", (int)index.size(), (int)jobs.size());
+    return true;
+}
+
+} // namespace z8
+
@@ -0,0 +1,73 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "mapped_file.h"
+
+// The cart_archive class
+// ——————————————————————
+// A read-only .z8a archive of many carts, memory mapped for random access.
+// The index holds the name, hash and label thumbnail of each cart, sorted
+// by name. Each cart is stored as a 32 KiB .p8.rom image, optionally
+// followed by its label, aligned on a page boundary.
+
+namespace z8
+{
+
+class cart;
+
+class cart_archive
+{
+public:
+    enum
+    {
+        THUMB_WIDTH = 32,
+        THUMB_HEIGHT = 32,
+    };
+
+    bool open(char const *filename);
+    void close();
+
+    size_t size() const { return m_count; }
+    std::string name(size_t n) const;
+    uint64_t hash(size_t n) const;
+    // THUMB_WIDTH × THUMB_HEIGHT pixels, two per byte, low nybble first;
+    // null if the cart has no label
+    uint8_t const *thumbnail(size_t n) const;
+
+    // Index of the cart called “name”, or -1 if there is none
+    int find(std::string const &name) const;
+    bool load(size_t n, cart &c) const;
+
+    // Archive all carts found in “dir” to “filename”, using all cores
+    static bool build(char const *dir, char const *filename);
+
+private:
+    struct header;
+    struct entry;
+
+    inline entry const *get_entry(size_t n) const;
+
+    mapped_file m_file;
+    size_t m_count = 0;
+};
+
+// List the files in “dir” that look like carts, sorted by name
+std::vector<std::string> list_carts(char const *dir);
+
+} // namespace z8
+
@@ -0,0 +1,286 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#if defined _WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#else
+#   include <glob.h>
+#endif
+#include <sys/stat.h>
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batch.h"
+#include "archive.h"
+
+namespace z8
+{
+
+using lol::msg;
+
+namespace
+{
+
+bool is_directory(std::string const &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+#if defined _MSC_VER
+    return (st.st_mode & _S_IFMT) == _S_IFDIR;
+#else
+    return S_ISDIR(st.st_mode);
+#endif
+}
+
+// Expand a wildcard pattern, for shells that do not do it for us
+void expand_pattern(std::string const &pattern, std::vector<std::string> &out)
+{
+#if defined _WIN32
+    size_t const slash = pattern.find_last_of("/\\");
+    std::string const dir = slash == std::string::npos ? "" : pattern.substr(0, slash + 1);
+    WIN32_FIND_DATAA data;
+    HANDLE h = FindFirstFileA(pattern.c_str(), &data);
+    if (h != INVALID_HANDLE_VALUE)
+    {
+        do
+            if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+                out.push_back(dir + data.cFileName);
+        while (FindNextFileA(h, &data));
+        FindClose(h);
+    }
+#else
+    glob_t g;
+    if (glob(pattern.c_str(), 0, nullptr, &g) == 0)
+    {
+        for (size_t i = 0; i < g.gl_pathc; ++i)
+            out.push_back(g.gl_pathv[i]);
+    }
+    globfree(&g);
+#endif
+}
+
+std::vector<std::string> expand_inputs(std::vector<char const *> const &inputs)
+{
+    std::vector<std::string> ret;
+
+    for (char const *arg : inputs)
+    {
+        std::string const s(arg);
+        if (s[0] == '@')
+        {
+            std::ifstream f(s.substr(1));
+            if (!f)
+                msg::error("cannot read list file %s\n", s.c_str() + 1);
+            for (std::string line; std::getline(f, line); )
+            {
+                while (line.length() && (line.back() == '\r' || line.back() == ' '))
+                    line.pop_back();
+                if (line.length())
+                    ret.push_back(line);
+            }
+        }
+        else if (is_directory(s))
+        {
+            for (auto const &name : list_carts(arg))
+                ret.push_back(s + "/" + name);
+        }
+        else if (s.find_first_of("*?[") != std::string::npos)
+            expand_pattern(s, ret);
+        else
+            ret.push_back(s);
+    }
+
+    return ret;
+}
+
+// The output file name: the input file name, without its directory and
+// cart extension, in the output directory.
+std::string output_name(std::string const &input, char const *outdir,
+                        batch_format to)
+{
+    size_t const slash = input.find_last_of("/\\:");
+    std::string name = slash == std::string::npos ? input : input.substr(slash + 1);
+
+    for (char const *ext : { ".png", ".rom", ".p8" })
+    {
+        size_t const len = strlen(ext);
+        if (name.length() > len && name.compare(name.length() - len, len, ext) == 0)
+            name.resize(name.length() - len);
+    }
+
+    static char const *exts[] = { ".lua", ".p8.png", ".p8", ".p8.rom", ".bin", ".dat" };
+    return std::string(outdir) + "/" + name + exts[(int)to];
+}
+
+bool write_file(std::string const &path, void const *data, size_t size)
+{
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool const ok = fwrite(data, 1, size, f) == size;
+    return fclose(f) == 0 && ok;
+}
+
+// Convert one cart; returns an error message, or an empty string
+std::string convert(cart &c, std::string const &input, std::string const &output,
+                    batch_format to, cart::code_format format, int effort)
+{
+    if (!c.load(input.c_str()))
+        return "cannot load cart";
+
+    bool ok = false;
+    switch (to)
+    {
+    case batch_format::lua:
+    {
+        auto const &lua = c.get_lua();
+        ok = write_file(output, lua.c_str(), lua.length());
+        break;
+    }
+    case batch_format::png:
+        ok = c.get_png(format, effort).save(output.c_str());
+        break;
+    case batch_format::p8:
+    {
+        FILE *f = fopen(output.c_str(), "wb");
+        ok = f && c.write_p8(f);
+        ok = f && fclose(f) == 0 && ok;
+        break;
+    }
+    case batch_format::rom:
+    case batch_format::bin:
+    {
+        auto const &bin = to == batch_format::rom ? c.get_p8_rom(format, effort)
+                                                  : c.get_bin(format, effort);
+        if (bin.empty())
+            return "code too large";
+        ok = write_file(output, bin.data(), bin.size());
+        break;
+    }
+    case batch_format::data:
+        ok = write_file(output, &c.get_rom(), offsetof(memory, code));
+        break;
+    }
+
+    return ok ? "" : "cannot write output";
+}
+
+std::string json_string(std::string const &s)
+{
+    std::string ret = "\"";
+    for (uint8_t ch : s)
+    {
+        if (ch == '"' || ch == '\\')
+            ret += '\\', ret += ch;
+        else if (ch < 0x20)
+            ret += lol::format("\\u%04x", ch);
+        else
+            ret += ch;
+    }
+    return ret + "\"";
+}
+
+} // anonymous namespace
+
+int batch(std::vector<char const *> const &inputs, char const *outdir,
+          batch_format to, cart::code_format format, int effort)
+{
+    std::vector<std::string> const files = expand_inputs(inputs);
+
+    if (!is_directory(outdir))
+    {
+        msg::error("output directory %s does not exist\n", outdir);
+        return -1;
+    }
+
+    // Output names only depend on the input basename, so inputs from
+    // different directories, or with different extensions, may collide;
+    // only the first one is converted, and the others are reported
+    std::vector<std::string> outputs(files.size()), errors(files.size());
+    std::map<std::string, size_t> owners;
+    for (size_t n = 0; n < files.size(); ++n)
+    {
+        outputs[n] = output_name(files[n], outdir, to);
+        auto const owner = owners.emplace(outputs[n], n);
+        if (!owner.second)
+            errors[n] = "output " + outputs[n] + " is also the output of "
+                      + files[owner.first->second];
+    }
+
+    int const thread_count = lol::clamp((int)std::thread::hardware_concurrency(),
+                                        1, lol::max(1, (int)files.size()));
+
+    std::atomic<int> next(0), failed(0), done(0);
+    std::mutex mutex;
+    lol::timer total;
+
+    auto worker = [&]()
+    {
+        // Each worker reuses one cart, so that buffers are only allocated once
+        cart c;
+        for (;;)
+        {
+            int n = next++;
+            if (n >= (int)files.size())
+                break;
+
+            std::string const &output = outputs[n];
+            lol::timer t;
+            std::string const error = errors[n].length() ? errors[n]
+                                    : convert(c, files[n], output, to, format, effort);
+            float const ms = 1000.f * t.get();
+
+            if (error.length())
+                ++failed;
+            int const count = ++done;
+
+            std::unique_lock<std::mutex> lock(mutex);
+            if (error.length())
+                printf("{\"input\":%s,\"status\":\"error\",\"error\":%s,\"done\":%d,\"total\":%d}\n",
+                       json_string(files[n]).c_str(), json_string(error).c_str(),
+                       count, (int)files.size());
+            else
+                printf("{\"input\":%s,\"output\":%s,\"status\":\"ok\",\"ms\":%.2f,\"done\":%d,\"total\":%d}\n",
+                       json_string(files[n]).c_str(), json_string(output).c_str(),
+                       ms, count, (int)files.size());
+            fflush(stdout);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; ++i)
+        threads.push_back(std::thread(worker));
+    for (auto &th : threads)
+        th.join();
+
+    printf("{\"status\":\"finished\",\"total\":%d,\"failed\":%d,\"threads\":%d,\"seconds\":%.3f}\n",
+           (int)files.size(), (int)failed, thread_count, total.get());
+    return failed;
+}
+
+} // namespace z8
+
@@ -0,0 +1,46 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include <vector>
+
+#include "cart.h"
+
+// The batch converter
+// ———————————————————
+// Converts many carts at once on a thread pool, reporting progress and
+// errors on stdout as JSON lines.
+
+namespace z8
+{
+
+enum class batch_format
+{
+    lua,
+    png,
+    p8,
+    rom,
+    bin,
+    data,
+};
+
+// Convert every cart in “inputs” to “outdir”. Each input is a cart, a
+// directory of carts, a wildcard pattern, or “@file” for a file listing
+// one cart per line. Returns the number of carts that failed.
+int batch(std::vector<char const *> const &inputs, char const *outdir,
+          batch_format to, cart::code_format format, int effort);
+
+} // namespace z8
+
@@ -0,0 +1,49 @@
+--
+--  ZEPTO-8 — Fantasy console emulator
+--
+--  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+--
+--  This program is free software. It comes without any warranty, to
+--  the extent permitted by applicable law. You can redistribute it
+--  and/or modify it under the terms of the Do What the Fuck You Want
+--  to Public License, Version 2, as published by the WTFPL Task Force.
+--  See http://www.wtfpl.net/ for more details.
+--
+
+-- Compile the code of bios.p8 with z8lua and print a C++ header with
+-- both the source and the bytecode, so that the VM can check that the
+-- bytecode matches the BIOS it loaded. Usage:
+--   z8lua bios-bytecode.lua bios.p8 > bios-bytecode.h
+
+local f = assert(io.open(arg[1], "rb"))
+local p8 = f:read("*a")
+f:close()
+
+local code = assert(p8:match("\n__lua__\r?\n(.-\n)__%a%a%a__\r?\n"),
+                    "no code section in "..arg[1])
+
+-- Transcode glyphs like cart::load_p8() does
+local glyphs =
+{
+    "█", "▒", "🐱", "⬇️", "░", "✽", "●", "♥",
+    "☉", "웃", "⌂", "⬅️", "😐", "♪", "🅾️", "◆",
+    "…", "➡️", "★", "⧗", "⬆️", "ˇ", "∧", "❎",
+    "▤", "▥",
+}
+for i = 1, #glyphs do
+    code = code:gsub(glyphs[i], string.char(0x7f + i))
+end
+
+-- Name the chunk after its code, like luaL_loadstring() does
+local bytecode = string.dump(assert(load(code, code)))
+
+local function array(name, data)
+    -- Avoid numeric indices, which overflow in fixed point arithmetic
+    local bytes = data:gsub(".", function(c) return c:byte().."," end)
+    bytes = bytes:gsub(string.rep("%d+,", 16), "%0\n    ")
+    return "static uint8_t const "..name.."[] =\n{\n    "..bytes.."\n};\n"
+end
+
+io.write("// Generated from bios.p8 by bios-bytecode.lua; do not edit\n\n")
+io.write(array("bios_source", code), "\n")
+io.write(array("bios_bytecode", bytecode))
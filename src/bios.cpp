@@ -16,8 +16,14 @@
 
 #include <lol/engine.h>
 
+#include <cstring>
+
 #include "bios.h"
 
+#if HAVE_BIOS_BYTECODE
+#   include "bios-bytecode.h"
+#endif
+
 namespace z8
 {
 
@@ -36,5 +42,24 @@ bios::bios()
     }
 }
 
+uint8_t const *bios::get_bytecode(size_t &size) const
+{
+#if HAVE_BIOS_BYTECODE
+    std::string const &code = get_code();
+    if (code.length() == sizeof(bios_source)
+         && memcmp(code.data(), bios_source, sizeof(bios_source)) == 0)
+    {
+        size = sizeof(bios_bytecode);
+        return bios_bytecode;
+    }
+
+    // This happens if bios-bytecode.lua does not transcode the code
+    // exactly like the cart loader does
+    lol::msg::debug("embedded BIOS bytecode does not match the BIOS code\n");
+#endif
+    size = 0;
+    return nullptr;
+}
+
 } // namespace z8
 
@@ -19,7 +19,9 @@
 // The bios class
 // ——————————————
 // The actual ZEPTO-8 BIOS: contains the font and the startup code, loaded
-// from a regular .p8 cartridge file.
+// from a regular .p8 cartridge file. The build system also embeds the
+// BIOS code as Lua bytecode, so that it does not have to be compiled
+// every time a VM is created.
 
 namespace z8
 {
@@ -34,6 +36,10 @@ public:
         return m_cart.get_code();
     }
 
+    // The BIOS code compiled at build time, or null if it was not built
+    // or if it was built from another version of the BIOS
+    uint8_t const *get_bytecode(size_t &size) const;
+
     uint8_t get_spixel(int16_t x, int16_t y) const
     {
         if (x < 0 || x >= 128 || y < 0 || y >= 128)
@@ -0,0 +1,224 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "budget.h"
+#include "cart.h"
+#include "tokenizer.h"
+
+namespace z8
+{
+
+namespace
+{
+
+inline bool ends_operand(token const &t)
+{
+    return t.kind == token_kind::name || t.kind == token_kind::number
+            || t.kind == token_kind::string || t.is(token_kind::symbol, ")")
+            || t.is(token_kind::symbol, "]") || t.is(token_kind::symbol, "}");
+}
+
+// PICO-8 counts one token per word, literal, operator or pair of
+// brackets. Commas, periods, colons, semicolons, closing brackets,
+// “local” and “end” are free, and so is a minus sign or a “~” in front
+// of a number literal.
+int token_cost(std::vector<token> const &tokens, size_t i)
+{
+    token const &t = tokens[i];
+
+    if (t.kind == token_kind::keyword)
+        return t.text == "local" || t.text == "end" ? 0 : 1;
+
+    if (t.kind != token_kind::symbol)
+        return 1;
+
+    if (t.text == "," || t.text == "." || t.text == ":" || t.text == ";"
+         || t.text == "::" || t.text == ")" || t.text == "]" || t.text == "}")
+        return 0;
+
+    if ((t.text == "-" || t.text == "~") && i + 1 < tokens.size()
+         && tokens[i + 1].kind == token_kind::number
+         && (i == 0 || !ends_operand(tokens[i - 1])))
+        return 0;
+
+    return 1;
+}
+
+// Whether the “if” at position i is a PICO-8 one-line if, which has
+// no matching “end”: the condition is in parentheses and is followed
+// by neither “then” nor more of the condition.
+bool is_short_if(std::vector<token> const &tokens, size_t i)
+{
+    if (i + 1 >= tokens.size() || !tokens[i + 1].is(token_kind::symbol, "("))
+        return false;
+
+    size_t k = i + 1;
+    for (int depth = 0; k < tokens.size(); ++k)
+    {
+        if (tokens[k].is(token_kind::symbol, "("))
+            ++depth;
+        else if (tokens[k].is(token_kind::symbol, ")") && --depth == 0)
+            break;
+    }
+
+    if (++k >= tokens.size())
+        return false;
+
+    token const &t = tokens[k];
+    switch (t.kind)
+    {
+    case token_kind::keyword:
+        return t.text != "then" && t.text != "and" && t.text != "or";
+    case token_kind::symbol:
+        return t.text == ";" || t.text == "::" || t.text == "?";
+    case token_kind::name:
+        return true;
+    default:
+        return false;
+    }
+}
+
+} // anonymous namespace
+
+bool budget::analyze(std::string const &code)
+{
+    std::vector<token> tokens;
+    if (!tokenize(code, tokens, &m_error))
+        return false;
+    tokens.erase(std::remove_if(tokens.begin(), tokens.end(), [](token const &t)
+    {
+        return t.kind == token_kind::comment;
+    }), tokens.end());
+
+    // Compressed bytes are attributed to the code they come from, with
+    // prefix sums to measure any range of the input
+    std::vector<int> sizes;
+    int const compressed = (int)cart::compress_code(code, &sizes).size();
+    std::vector<int> sums(code.length() + 1, 0);
+    for (size_t i = 0; i < code.length(); ++i)
+        sums[i + 1] = sums[i] + sizes[i];
+
+    m_total = item{ "", 1, 0, (int)code.length(), compressed };
+    m_functions.clear();
+
+    int depth = 0;
+    size_t first = 0;
+    bool in_function = false;
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        token const &t = tokens[i];
+        int const cost = token_cost(tokens, i);
+        m_total.tokens += cost;
+
+        if (in_function)
+            m_functions.back().tokens += cost;
+
+        if (t.kind != token_kind::keyword)
+            continue;
+
+        if (t.text == "function" && depth == 0)
+        {
+            // Find the function name: “function a.b:c()”, “a.b = function()”
+            // and their “local” variants, or use the line number
+            std::string name;
+            first = i;
+            if (i + 1 < tokens.size() && tokens[i + 1].kind == token_kind::name)
+            {
+                for (size_t j = i + 1; j < tokens.size() && !tokens[j].is(token_kind::symbol, "("); ++j)
+                    name += tokens[j].text;
+            }
+            else if (i >= 2 && tokens[i - 1].is(token_kind::symbol, "=")
+                      && tokens[i - 2].kind == token_kind::name)
+            {
+                first = i - 2;
+                while (first >= 2 && tokens[first - 2].kind == token_kind::name
+                        && (tokens[first - 1].is(token_kind::symbol, ".")
+                             || tokens[first - 1].is(token_kind::symbol, ":")))
+                    first -= 2;
+                for (size_t j = first; j < i - 1; ++j)
+                    name += tokens[j].text;
+            }
+            else
+                name = lol::format("function@%d", (int)t.line);
+
+            if (first > 0 && tokens[first - 1].is(token_kind::keyword, "local"))
+                --first;
+
+            m_functions.push_back(item{ name, (int)tokens[first].line, 0, 0, 0 });
+            for (size_t j = first; j < i; ++j)
+                m_functions.back().tokens += token_cost(tokens, j);
+            m_functions.back().tokens += cost;
+            in_function = true;
+        }
+
+        if (t.text == "function" || t.text == "do" || t.text == "repeat"
+             || (t.text == "if" && !is_short_if(tokens, i)))
+            ++depth;
+        else if ((t.text == "end" || t.text == "until") && depth > 0 && --depth == 0
+                  && in_function)
+        {
+            auto &f = m_functions.back();
+            size_t const start = tokens[first].offset;
+            size_t const end = t.offset + t.text.length();
+            f.chars = (int)(end - start);
+            f.compressed = sums[end] - sums[start];
+            in_function = false;
+        }
+    }
+
+    return true;
+}
+
+std::string budget::report() const
+{
+    auto percent = [](int n, int max) { return 100.f * n / max; };
+
+    std::string ret;
+    ret += lol::format("tokens:     %6d / %d (%.1f%%)\n", m_total.tokens,
+                       (int)max_tokens, percent(m_total.tokens, max_tokens));
+    ret += lol::format("characters: %6d / %d (%.1f%%)\n", m_total.chars,
+                       (int)max_chars, percent(m_total.chars, max_chars));
+    ret += lol::format("compressed: %6d / %d (%.1f%%)\n", m_total.compressed,
+                       (int)max_compressed, percent(m_total.compressed, max_compressed));
+
+    if (m_functions.empty())
+        return ret;
+
+    item other = m_total;
+    ret += lol::format("\n%-24s %6s %7s %7s %11s\n", "function", "line",
+                       "tokens", "chars", "compressed");
+    for (auto const &f : m_functions)
+    {
+        ret += lol::format("%-24s %6d %7d %7d %11d\n", f.name.c_str(), f.line,
+                           f.tokens, f.chars, f.compressed);
+        other.tokens -= f.tokens;
+        other.chars -= f.chars;
+        other.compressed -= f.compressed;
+    }
+    ret += lol::format("%-24s %6s %7d %7d %11d\n", "(other code)", "",
+                       other.tokens, other.chars, other.compressed);
+
+    return ret;
+}
+
+} // namespace z8
+
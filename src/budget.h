@@ -0,0 +1,61 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// The budget class
+// ————————————————
+// Measures code against the limits of PICO-8: the token count, the
+// character count, and the compressed size, both for the whole program
+// and for each top-level function. Everything is computed in one pass
+// over the tokens, so it is cheap enough to run after every edit.
+
+namespace z8
+{
+
+class budget
+{
+public:
+    enum : int
+    {
+        max_tokens = 8192,
+        max_chars = 65535,
+        max_compressed = 0x3d00 - 8,
+    };
+
+    struct item
+    {
+        std::string name;
+        int line, tokens, chars, compressed;
+    };
+
+    // Analyse code; returns false if it cannot be tokenized
+    bool analyze(std::string const &code);
+
+    item const &get_total() const { return m_total; }
+    std::vector<item> const &get_functions() const { return m_functions; }
+    std::string const &get_error() const { return m_error; }
+
+    // A table with the totals, then one line per top-level function
+    std::string report() const;
+
+private:
+    item m_total = { "", 0, 0, 0, 0 };
+    std::vector<item> m_functions;
+    std::string m_error;
+};
+
+} // namespace z8
+
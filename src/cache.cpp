@@ -0,0 +1,246 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#if defined _WIN32
+#   include <direct.h>
+#   include <process.h>
+#   define getpid _getpid
+#else
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <thread>
+
+#include "cache.h"
+#include "cart.h"
+#include "mapped_file.h"
+
+namespace z8
+{
+
+using lol::msg;
+
+namespace
+{
+
+// Bump this whenever the entry layout or the cart parser output changes
+uint32_t const CACHE_VERSION = 1;
+
+// Entries are a header, then the ROM, the label and the code, all in
+// native byte order since the cache is never shared between machines.
+struct entry_header
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t label_size;
+    uint32_t code_size;
+};
+
+std::string &cache_dir()
+{
+    static std::string dir = []()
+    {
+        char const *env = getenv("ZEPTO8_CACHE");
+        return std::string(env ? env : "");
+    }();
+    return dir;
+}
+
+// Write to a temporary file unique to this thread first, then rename
+// it, so that concurrent readers never see a partial entry.
+bool write_entry(std::string const &dst,
+                 std::initializer_list<std::pair<void const *, size_t>> chunks)
+{
+    std::string const tmp = dst + lol::format(".%d.%llx", (int)getpid(),
+        (unsigned long long)std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+
+    bool ok = true;
+    for (auto const &chunk : chunks)
+        ok = ok && fwrite(chunk.first, 1, chunk.second, f) == chunk.second;
+    ok = fclose(f) == 0 && ok;
+
+#if defined _WIN32
+    // rename() does not replace existing files on Windows
+    if (ok)
+        remove(dst.c_str());
+#endif
+    if (!ok || rename(tmp.c_str(), dst.c_str()) != 0)
+    {
+        remove(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+} // anonymous namespace
+
+void cart_cache::set_dir(std::string const &dir)
+{
+    cache_dir() = dir;
+    if (dir.length())
+    {
+#if defined _WIN32
+        _mkdir(dir.c_str());
+#else
+        mkdir(dir.c_str(), 0755);
+#endif
+    }
+}
+
+bool cart_cache::enabled()
+{
+    return cache_dir().length() > 0;
+}
+
+std::string cart_cache::path(uint64_t key, char const *ext)
+{
+    char name[32];
+    sprintf(name, "/%016llx.%s", (unsigned long long)key, ext);
+    return cache_dir() + name;
+}
+
+uint64_t cart_cache::hash(uint8_t const *data, size_t size)
+{
+    uint64_t const k = 0x9e3779b97f4a7c15ull;
+    uint64_t h = size * k;
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ w) * k;
+        h ^= h >> 29;
+    }
+
+    uint64_t w = 0;
+    memcpy(&w, data + i, size - i);
+    h = (h ^ w) * k;
+
+    // Final avalanche from MurmurHash3
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+bool cart_cache::hash_file(char const *filename, uint64_t &key)
+{
+    mapped_file f;
+    for (auto const &candidate : lol::sys::get_path_list(filename))
+    {
+        if (f.open(candidate.c_str()))
+        {
+            key = hash(f.data(), f.size());
+            return true;
+        }
+    }
+    return false;
+}
+
+bool cart_cache::load(uint64_t key, cart &c)
+{
+    mapped_file f;
+    if (!f.open(path(key, "z8c").c_str()) || f.size() < sizeof(entry_header))
+        return false;
+
+    entry_header header;
+    memcpy(&header, f.data(), sizeof(header));
+    if (memcmp(header.magic, "z8c", 4) != 0 || header.version != CACHE_VERSION
+         || header.key != key
+         || f.size() != sizeof(header) + sizeof(c.m_rom) + header.label_size
+                                       + header.code_size)
+    {
+        msg::warn("ignoring invalid cache entry %s\n", path(key, "z8c").c_str());
+        return false;
+    }
+
+    uint8_t const *p = f.data() + sizeof(header);
+    memcpy(&c.m_rom, p, sizeof(c.m_rom));
+    p += sizeof(c.m_rom);
+    c.m_label.assign(p, p + header.label_size);
+    p += header.label_size;
+    c.m_code.assign((char const *)p, header.code_size);
+    c.m_lua.clear();
+
+    msg::debug("loaded cart %016llx from cache\n", (unsigned long long)key);
+    return true;
+}
+
+bool cart_cache::store(uint64_t key, cart const &c)
+{
+    entry_header header;
+    memcpy(header.magic, "z8c", 4);
+    header.version = CACHE_VERSION;
+    header.key = key;
+    header.label_size = (uint32_t)c.m_label.size();
+    header.code_size = (uint32_t)c.m_code.length();
+
+    return write_entry(path(key, "z8c"), { { &header, sizeof(header) },
+                                           { &c.m_rom, sizeof(c.m_rom) },
+                                           { c.m_label.data(), c.m_label.size() },
+                                           { c.m_code.data(), c.m_code.length() } });
+}
+
+bool cart_cache::load_data(uint64_t key, char const *ext, uint32_t version,
+                           std::string &data)
+{
+    mapped_file f;
+    if (!f.open(path(key, ext).c_str()) || f.size() < sizeof(entry_header))
+        return false;
+
+    entry_header header;
+    memcpy(&header, f.data(), sizeof(header));
+    if (memcmp(header.magic, "z8d", 4) != 0 || header.version != version
+         || header.key != key || f.size() != sizeof(header) + header.code_size)
+        return false;
+
+    data.assign((char const *)f.data() + sizeof(header), header.code_size);
+    return true;
+}
+
+bool cart_cache::store_data(uint64_t key, char const *ext, uint32_t version,
+                            std::string const &data)
+{
+    entry_header header;
+    memcpy(header.magic, "z8d", 4);
+    header.version = version;
+    header.key = key;
+    header.label_size = 0;
+    header.code_size = (uint32_t)data.length();
+
+    return write_entry(path(key, ext), { { &header, sizeof(header) },
+                                         { data.data(), data.length() } });
+}
+
+} // namespace z8
+
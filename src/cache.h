@@ -0,0 +1,64 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+// The cart_cache class
+// ————————————————————
+// An optional on-disk cache of parsed cartridges. Each entry holds the
+// ROM, label and code of a cart, and is named after a hash of the source
+// file contents, so that renamed or copied carts still hit the cache and
+// modified carts never do. Entries are mapped in memory when loaded.
+// Data derived from cart code, such as its translation to standard Lua
+// or its bytecode, is cached, too, keyed by a hash of the code.
+
+namespace z8
+{
+
+class cart;
+
+class cart_cache
+{
+public:
+    // Store cache entries in “dir”, which is created if necessary. An
+    // empty string disables the cache. The default is the contents of
+    // the ZEPTO8_CACHE environment variable.
+    static void set_dir(std::string const &dir);
+    static bool enabled();
+
+    // Hash the contents of a source file; returns false if the file
+    // cannot be read.
+    static bool hash_file(char const *filename, uint64_t &key);
+    static uint64_t hash(uint8_t const *data, size_t size);
+
+    // Fill “c” with the entry for “key”; returns false on a cache miss
+    static bool load(uint64_t key, cart &c);
+    // Create or replace the entry for “key”
+    static bool store(uint64_t key, cart const &c);
+
+    // Arbitrary data derived from some source text, such as translated
+    // or compiled code, keyed by a hash of the source. “ext” tells the
+    // kinds of data apart, and entries with another “version” are ignored.
+    static bool load_data(uint64_t key, char const *ext, uint32_t version,
+                          std::string &data);
+    static bool store_data(uint64_t key, char const *ext, uint32_t version,
+                           std::string const &data);
+
+private:
+    static std::string path(uint64_t key, char const *ext);
+};
+
+} // namespace z8
+
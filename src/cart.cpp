@@ -16,12 +16,24 @@
 
 #include <lol/engine.h>
 
-#include "tao/pegtl.hpp"
-
 #include "zepto8.h"
 #include "cart.h"
+#include "archive.h"
+#include "cache.h"
+#include "mapped_file.h"
+#include "pxa.h"
+
+#if defined __AVX2__
+#   include <immintrin.h>
+#elif defined __SSE2__ || defined _M_X64
+#   include <emmintrin.h>
+#endif
 
-#include <regex>
+#include <array>
+#include <cctype>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace z8
 {
@@ -31,12 +43,26 @@ using lol::msg;
 using lol::u8vec4;
 using lol::PixelFormat;
 
-using namespace tao;
-
 bool cart::load(char const *filename)
 {
-    if (load_p8(filename) || load_png(filename))
+    if (char const *sep = strstr(filename, ".z8a:"))
     {
+        cart_archive archive;
+        int n = -1;
+        return archive.open(std::string(filename, sep + 4).c_str())
+                && (n = archive.find(sep + 5)) >= 0 && archive.load(n, *this);
+    }
+
+    uint64_t key = 0;
+    bool const cached = cart_cache::enabled() && cart_cache::hash_file(filename, key);
+    if (cached && cart_cache::load(key, *this))
+        return true;
+
+    if (load_p8(filename) || load_rom(filename) || load_png(filename))
+    {
+        if (cached && !cart_cache::store(key, *this))
+            msg::warn("could not store %s in cache\n", filename);
+
         // Dump code to stdout
         //msg::info("Cartridge code:\n");
         //printf("%s", m_code.c_str());
@@ -47,9 +73,122 @@ bool cart::load(char const *filename)
     return false;
 }
 
-static uint8_t const *compress_lut = nullptr;
+std::string const &cart::get_lua()
+{
+    if (m_lua.length() || m_code.length() == 0)
+        return m_lua;
+
+    uint64_t key = 0;
+    bool const cached = cart_cache::enabled();
+    if (cached)
+    {
+        key = cart_cache::hash((uint8_t const *)m_code.data(), m_code.length());
+        if (cart_cache::load_data(key, "lua", analyzer::version, m_lua))
+            return m_lua;
+    }
+
+    m_lua = analyzer().fix(m_code);
+    if (cached && !cart_cache::store_data(key, "lua", analyzer::version, m_lua))
+        msg::warn("could not store translated code in cache\n");
+    return m_lua;
+}
+
 static char const *decompress_lut = "\n 0123456789abcdefghijklmnopqrstuvwxyz!#%(){}[]<>+=/*:;.,~_";
 
+namespace
+{
+
+// Each ROM byte is stored in the two low bits of the A, R, G and B
+// components of a pixel, from most to least significant.
+inline uint8_t rom_byte(u8vec4 p)
+{
+    return (uint8_t)((p.a & 3) << 6 | (p.r & 3) << 4 | (p.g & 3) << 2 | (p.b & 3));
+}
+
+#if defined __SSE2__ || defined _M_X64
+// Same as rom_byte() for 4 RGBA pixels; the result is in the low byte
+// of each 32-bit lane.
+inline __m128i rom_bytes(__m128i p)
+{
+    __m128i const t = _mm_and_si128(p, _mm_set1_epi8(3));
+    __m128i const ret = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(t, 4), _mm_srli_epi32(t, 6)),
+                                     _mm_or_si128(_mm_srli_epi32(t, 16), _mm_srli_epi32(t, 18)));
+    return _mm_and_si128(ret, _mm_set1_epi32(0xff));
+}
+#endif
+
+// Map label pixels to palette indices. Labels are almost always drawn
+// with the exact palette colours, so look these up in a small hash table
+// before falling back to a nearest colour search, whose results are kept
+// in a direct-mapped cache.
+struct palette_lookup
+{
+    enum
+    {
+        EXACT_BITS = 6,
+        MISS_BITS = 8,
+    };
+
+    palette_lookup()
+    {
+        memset(m_miss, 0, sizeof(m_miss));
+    }
+
+    uint8_t get(u8vec4 p)
+    {
+        uint32_t const rgb = p.r << 16 | p.g << 8 | p.b;
+
+        for (uint32_t h = hash(rgb, EXACT_BITS); exact.key[h] >= 0; h = (h + 1) % (1 << EXACT_BITS))
+            if ((uint32_t)exact.key[h] == rgb)
+                return exact.index[h];
+
+        // Cache entries store the colour plus one, so that zero is empty
+        auto &entry = m_miss[hash(rgb, MISS_BITS)];
+        if (entry.rgb != rgb + 1)
+        {
+            entry.rgb = rgb + 1;
+            entry.index = (uint8_t)palette::best(p);
+        }
+        return entry.index;
+    }
+
+private:
+    static inline uint32_t hash(uint32_t rgb, int bits)
+    {
+        return (rgb * 0x9e3779b1u) >> (32 - bits);
+    }
+
+    // Open addressing table of the 16 palette colours, with linear probing
+    static struct exact_table
+    {
+        exact_table()
+        {
+            for (auto &k : key)
+                k = -1;
+            for (int i = 0; i < 16; ++i)
+            {
+                u8vec4 c = palette::get8(i);
+                uint32_t const rgb = c.r << 16 | c.g << 8 | c.b;
+                uint32_t h = hash(rgb, EXACT_BITS);
+                while (key[h] >= 0)
+                    h = (h + 1) % (1 << EXACT_BITS);
+                key[h] = (int32_t)rgb;
+                index[h] = (uint8_t)i;
+            }
+        }
+
+        int32_t key[1 << EXACT_BITS];
+        uint8_t index[1 << EXACT_BITS];
+    }
+    const exact;
+
+    struct { uint32_t rgb; uint8_t index; } m_miss[1 << MISS_BITS];
+};
+
+palette_lookup::exact_table const palette_lookup::exact;
+
+} // anonymous namespace
+
 bool cart::load_png(char const *filename)
 {
     // Open cartridge as PNG image
@@ -63,23 +202,34 @@ bool cart::load_png(char const *filename)
     u8vec4 const *pixels = img.lock<PixelFormat::RGBA_8>();
 
     // Retrieve cartridge data from lower image bits
-    uint8_t version = 0;
-    for (int n = 0; n < (int)sizeof(m_rom) + 1; ++n)
+    uint8_t *rom = &m_rom[0];
+    int n = 0;
+#if defined __SSE2__ || defined _M_X64
+    // Fast path: 16 pixels at a time
+    for (; n + 16 <= (int)sizeof(m_rom); n += 16)
     {
-        u8vec4 p = pixels[n] * 64;
-        uint8_t byte = p.a + p.r / 4 + p.g / 16 + p.b / 64;
-        (n < (int)sizeof(m_rom) ? m_rom[n] : version) = byte;
+        __m128i v[4];
+        for (int i = 0; i < 4; ++i)
+            v[i] = rom_bytes(_mm_loadu_si128((__m128i const *)(pixels + n + 4 * i)));
+        _mm_storeu_si128((__m128i *)(rom + n), _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]),
+                                                                _mm_packs_epi32(v[2], v[3])));
     }
+#endif
+    for (; n < (int)sizeof(m_rom); ++n)
+        rom[n] = rom_byte(pixels[n]);
+    uint8_t version = rom_byte(pixels[sizeof(m_rom)]);
 
     // Retrieve label from image pixels
+    m_label.clear();
     if (size.x >= LABEL_WIDTH + LABEL_X && size.y >= LABEL_HEIGHT + LABEL_Y)
     {
+        palette_lookup lookup;
         m_label.resize(LABEL_WIDTH * LABEL_HEIGHT / 2);
         for (int y = 0; y < LABEL_HEIGHT; ++y)
         for (int x = 0; x < LABEL_WIDTH; ++x)
         {
             lol::u8vec4 p = pixels[(y + LABEL_Y) * size.x + (x + LABEL_X)];
-            uint8_t c = z8::palette::best(p);
+            uint8_t c = lookup.get(p);
             if (x & 1)
                 m_label[(y * LABEL_WIDTH + x) / 2] += c << 4;
             else
@@ -89,231 +239,322 @@ bool cart::load_png(char const *filename)
 
     img.unlock(pixels);
 
-    // Retrieve code, with optional decompression
-    if (version == 0 || m_rom.code[0] != ':' || m_rom.code[1] != 'c'
-                     || m_rom.code[2] != ':' || m_rom.code[3] != '\0')
-    {
-        int length = 0;
-        while (length < (int)sizeof(m_rom.code) && m_rom.code[length] != '\0')
-            ++length;
+    load_code(version);
 
-        m_code.resize(length);
-        memcpy(&m_code[0], &m_rom.code, length);
-    }
-    else if (version == 1 || version >= 5)
-    {
-        // Expected data length (including trailing zero)
-        int length = m_rom.code[4] * 256
-                   + m_rom.code[5];
+    return true;
+}
 
-        m_code.resize(0);
-        for (int i = 8; i < (int)sizeof(m_rom.code) && (int)m_code.length() < length; ++i)
+//
+// A single-pass scanner for the .p8 format
+//
+
+namespace
+{
+
+enum class p8_section : int8_t
+{
+    error = -1,
+    header = 0,
+    lua,
+    gfx,
+    gff,
+    map,
+    sfx,
+    mus,
+    lab,
+};
+
+// PICO-8 saves some symbols in the .p8 file as Emoji/Unicode characters
+// but the runtime expects characters \x80 — \x99 instead. This trie
+// matches their UTF-8 encodings so that code is transcoded as it is read.
+struct glyph_trie
+{
+    glyph_trie()
+    {
+        static char const *glyphs[] =
+        {
+            "█", "▒", "🐱", "⬇️", "░", "✽", "●", "♥",
+            "☉", "웃", "⌂", "⬅️", "😐", "♪", "🅾️", "◆",
+            "…", "➡️", "★", "⧗", "⬆️", "ˇ", "∧", "❎",
+            "▤", "▥",
+        };
+
+        m_nodes.resize(1);
+        for (int i = 0; i < (int)(sizeof(glyphs) / sizeof(*glyphs)); ++i)
         {
-            if (m_rom.code[i] >= 0x3c)
+            int n = 0;
+            for (uint8_t const *p = (uint8_t const *)glyphs[i]; *p; ++p)
             {
-                int a = (m_rom.code[i] - 0x3c) * 16 + (m_rom.code[i + 1] & 0xf);
-                int b = m_rom.code[i + 1] / 16 + 2;
-                if ((int)m_code.length() >= a)
-                    while (b--)
-                        m_code += m_code[m_code.length() - a];
-                ++i;
+                int next = find(n, *p);
+                if (next < 0)
+                {
+                    next = (int)m_nodes.size();
+                    m_nodes[n].next.push_back(std::make_pair(*p, next));
+                    m_nodes.push_back(node());
+                }
+                n = next;
             }
-            else
+            m_nodes[n].ch = (uint8_t)(0x80 + i);
+        }
+    }
+
+    // Return the length of the longest glyph at “p”, and store the
+    // matching character in “ch”; return 0 if there is no match.
+    int match(uint8_t const *p, uint8_t const *end, uint8_t &ch) const
+    {
+        int ret = 0;
+        for (int n = 0, len = 1; p < end; ++p, ++len)
+        {
+            n = find(n, *p);
+            if (n < 0)
+                break;
+            if (m_nodes[n].ch)
             {
-                m_code += m_rom.code[i] ? decompress_lut[m_rom.code[i] - 1]
-                                        : m_rom.code[++i];
+                ch = m_nodes[n].ch;
+                ret = len;
             }
         }
+        return ret;
+    }
 
-        if (length != (int)m_code.length())
-            msg::warn("expected %d code bytes, got %d\n", length, (int)m_code.length());
+private:
+    int find(int n, uint8_t byte) const
+    {
+        for (auto const &edge : m_nodes[n].next)
+            if (edge.first == byte)
+                return edge.second;
+        return -1;
     }
 
-    // Remove possible trailing zeroes
-    m_code.resize(strlen(m_code.c_str()));
+    struct node
+    {
+        uint8_t ch = 0;
+        std::vector<std::pair<uint8_t, int>> next;
+    };
 
-    msg::debug("version: %d code: %d\n", version, (int)m_code.length());
+    std::vector<node> m_nodes;
+};
 
-    // Invalidate code cache
-    m_lua.resize(0);
+glyph_trie const glyphs;
 
-    return true;
-}
+// Value of each hexadecimal digit, -2 for whitespace, or -1. Labels
+// may also use “g”…“v” for the extended palette; we only keep the low
+// four bits of these.
+struct hex_table
+{
+    hex_table(bool extended)
+    {
+        memset(value, -1, sizeof(value));
+        value[' '] = value['\t'] = value['\r'] = value['\n'] = -2;
+        for (int i = 0; i < 10; ++i)
+            value['0' + i] = (int8_t)i;
+        for (int i = 0; i < (extended ? 22 : 6); ++i)
+            value['a' + i] = value['A' + i] = (int8_t)((10 + i) & 0xf);
+    }
 
-//
-// A speacial parser object for the .p8 format
-//
+    int8_t value[256];
+};
+
+hex_table const hex(false), hex_label(true);
 
-struct p8_reader
+#if defined __SSE2__ || defined _M_X64
+// Convert 16 hex digits to nybble values; return false if any of the
+// characters is not a hex digit.
+inline bool hex_nybbles(__m128i c, __m128i &v)
 {
-    //
-    // Grammar rules
-    //
-
-    struct r_lua : TAOCPP_PEGTL_STRING("__lua__") {};
-    struct r_gfx : TAOCPP_PEGTL_STRING("__gfx__") {};
-    struct r_gff : TAOCPP_PEGTL_STRING("__gff__") {};
-    struct r_map : TAOCPP_PEGTL_STRING("__map__") {};
-    struct r_sfx : TAOCPP_PEGTL_STRING("__sfx__") {};
-    struct r_mus : TAOCPP_PEGTL_STRING("__music__") {};
-    struct r_lab : TAOCPP_PEGTL_STRING("__label__") {};
-    struct r_any : pegtl::seq<pegtl::two<'_'>, pegtl::plus<pegtl::alnum>, pegtl::two<'_'>> {};
-
-    struct r_section_name : pegtl::sor<r_lua,
-                                       r_gfx,
-                                       r_gff,
-                                       r_map,
-                                       r_sfx,
-                                       r_mus,
-                                       r_lab,
-                                       r_any> {};
-    struct r_section_line : pegtl::seq<r_section_name, pegtl::eolf> {};
-
-    struct r_data_line : pegtl::until<pegtl::eolf> {};
-    struct r_data : pegtl::star<pegtl::not_at<r_section_line>,
-                                pegtl::not_at<pegtl::eof>,
-                                r_data_line> {};
-
-    struct r_section : pegtl::seq<r_section_line, r_data> {};
-    struct r_version : pegtl::star<pegtl::digit> {};
-
-    struct r_header: pegtl::seq<TAOCPP_PEGTL_STRING("pico-8 cartridge"), pegtl::until<pegtl::eol>,
-                                TAOCPP_PEGTL_STRING("version "), r_version, pegtl::until<pegtl::eol>> {};
-    struct r_file : pegtl::seq<pegtl::opt<pegtl::utf8::bom>,
-                               r_header,
-                               r_data, /* data before the first section is ignored */
-                               pegtl::star<r_section>,
-                               pegtl::eof> {};
-
-    //
-    // Grammar actions
-    //
-
-    template<typename R>
-    struct action : pegtl::nothing<R> {};
-
-    //
-    // Parser state
-    //
-
-    int m_version = -1;
-
-    enum class section : int8_t
-    {
-        error = -1,
-        header = 0,
-        lua,
-        gfx,
-        gff,
-        map,
-        sfx,
-        mus,
-        lab,
-    };
+    __m128i const bias = _mm_set1_epi8((char)0x80);
+    __m128i const x = _mm_xor_si128(c, bias);
+    __m128i const lx = _mm_or_si128(x, _mm_set1_epi8(0x20));
+    __m128i const is_digit = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8((char)(('0' - 1) ^ 0x80))),
+                                           _mm_cmplt_epi8(x, _mm_set1_epi8((char)(('9' + 1) ^ 0x80))));
+    __m128i const is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lx, _mm_set1_epi8((char)(('a' - 1) ^ 0x80))),
+                                           _mm_cmplt_epi8(lx, _mm_set1_epi8((char)(('f' + 1) ^ 0x80))));
+    if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff)
+        return false;
 
-    section m_current_section;
-    std::map<int8_t, std::vector<uint8_t>> m_sections;
-    std::string m_code;
+    __m128i const lc = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    v = _mm_or_si128(_mm_and_si128(is_digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                     _mm_and_si128(is_alpha, _mm_sub_epi8(lc, _mm_set1_epi8('a' - 10))));
+    return true;
+}
 
-    //
-    // Actual reader
-    //
+// Combine pairs of nybbles into 8 bytes, stored in the low half of
+// each 16-bit lane
+inline __m128i hex_pairs(__m128i v, bool swap)
+{
+    __m128i const lo4 = _mm_set1_epi16(0x000f), hi4 = _mm_set1_epi16(0x00f0);
+    return swap ? _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 4), hi4), _mm_and_si128(v, lo4))
+                : _mm_or_si128(_mm_and_si128(_mm_slli_epi16(v, 4), hi4), _mm_srli_epi16(v, 8));
+}
+#endif
 
-    void parse(std::string const &str)
+// Decode hexadecimal digits from [p, end) into “dst”, with the low nybble
+// first if “swap” is true. Whitespace is ignored. Returns the number of
+// bytes written, or -1 if the data is malformed, in which case “p” points
+// to the offending character.
+int decode_hex(char const *&p, char const *end, uint8_t *dst,
+                      bool swap, hex_table const &table)
+{
+    uint8_t *out = dst;
+
+#if defined __AVX2__
+    // Fast path: 64 hex digits at a time
+    for (; end - p >= 64; p += 64, out += 32)
     {
-        pegtl::string_input<> in(str, "p8");
-        pegtl::parse<r_file, action>(in, *this);
+        __m128i v[4];
+        bool ok = true;
+        for (int i = 0; i < 4 && ok; ++i)
+            ok = hex_nybbles(_mm_loadu_si128((__m128i const *)(p + 16 * i)), v[i]);
+        if (!ok)
+            break;
+        __m256i const a = _mm256_set_m128i(hex_pairs(v[1], swap), hex_pairs(v[0], swap));
+        __m256i const b = _mm256_set_m128i(hex_pairs(v[3], swap), hex_pairs(v[2], swap));
+        // packus works within 128-bit lanes; restore the byte order
+        __m256i const packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)out, packed);
     }
-};
-
-template<>
-struct p8_reader::action<p8_reader::r_version>
-{
-    template<typename Input>
-    static void apply(Input const &in, p8_reader &r)
+#endif
+#if defined __SSE2__ || defined _M_X64
+    // Fast path: 32 hex digits at a time
+    for (; end - p >= 32; p += 32, out += 16)
     {
-        r.m_version = std::atoi(in.string().c_str());
+        __m128i v0, v1;
+        if (!hex_nybbles(_mm_loadu_si128((__m128i const *)p), v0)
+             || !hex_nybbles(_mm_loadu_si128((__m128i const *)(p + 16)), v1))
+            break;
+        _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(hex_pairs(v0, swap),
+                                                          hex_pairs(v1, swap)));
     }
-};
+#endif
 
-template<>
-struct p8_reader::action<p8_reader::r_section_name>
-{
-    template<typename Input>
-    static void apply(Input const &in, p8_reader &r)
-    {
-        if (in.string().find("lua") != std::string::npos)
-            r.m_current_section = section::lua;
-        else if (in.string().find("gfx") != std::string::npos)
-            r.m_current_section = section::gfx;
-        else if (in.string().find("gff") != std::string::npos)
-            r.m_current_section = section::gff;
-        else if (in.string().find("map") != std::string::npos)
-            r.m_current_section = section::map;
-        else if (in.string().find("sfx") != std::string::npos)
-            r.m_current_section = section::sfx;
-        else if (in.string().find("music") != std::string::npos)
-            r.m_current_section = section::mus;
-        else if (in.string().find("label") != std::string::npos)
-            r.m_current_section = section::lab;
-        else
+    // Scalar fallback, for the end of the data or when there is whitespace
+    int pending = -1;
+    char const *digit = p;
+    for (; p < end; ++p)
+    {
+        int8_t x = table.value[(uint8_t)*p];
+        if (x == -2)
+            continue;
+        if (x < 0)
+            return -1;
+        if (pending < 0)
         {
-            msg::info("unknown section name %s\n", in.string().c_str());
-            r.m_current_section = section::error;
+            pending = x;
+            digit = p;
+            continue;
         }
+        *out++ = (uint8_t)(swap ? (x << 4) | pending : (pending << 4) | x);
+        pending = -1;
     }
-};
 
-template<>
-struct p8_reader::action<p8_reader::r_data>
+    if (pending >= 0)
+    {
+        p = digit;
+        return -1;
+    }
+
+    return (int)(out - dst);
+}
+
+// Return the section for a “__name__” line, or header if the
+// line is not a section name.
+p8_section get_section(char const *p, char const *end)
 {
-    template<typename Input>
-    static void apply(Input const &in, p8_reader &r)
+    size_t len = end - p;
+    if (len < 5 || p[0] != '_' || p[1] != '_' || end[-1] != '_' || end[-2] != '_')
+        return p8_section::header;
+    for (char const *q = p + 2; q < end - 2; ++q)
+        if (!isalnum((uint8_t)*q))
+            return p8_section::header;
+
+    std::string name(p, end);
+    if (name.find("lua") != std::string::npos)
+        return p8_section::lua;
+    if (name.find("gfx") != std::string::npos)
+        return p8_section::gfx;
+    if (name.find("gff") != std::string::npos)
+        return p8_section::gff;
+    if (name.find("map") != std::string::npos)
+        return p8_section::map;
+    if (name.find("sfx") != std::string::npos)
+        return p8_section::sfx;
+    if (name.find("music") != std::string::npos)
+        return p8_section::mus;
+    if (name.find("label") != std::string::npos)
+        return p8_section::lab;
+
+    msg::info("unknown section name %s\n", name.c_str());
+    return p8_section::error;
+}
+
+} // anonymous namespace
+
+bool cart::load_rom(char const *filename)
+{
+    // There is no magic number in .p8.rom files, so rely on the extension
+    size_t const len = strlen(filename);
+    if (len < 4 || strcmp(filename + len - 4, ".rom") != 0)
+        return false;
+
+    mapped_file f;
+    for (auto const &candidate : lol::sys::get_path_list(filename))
     {
-        if (r.m_current_section == section::lua)
-        {
-            // Copy the code verbatim
-            r.m_code += in.string();
-        }
-        else
+        if (f.open(candidate.c_str()))
         {
-            bool must_swap = r.m_current_section == section::gfx
-                          || r.m_current_section == section::lab;
-
-            // Decode hexadecimal data from this section
-            auto &section = r.m_sections[(int8_t)r.m_current_section];
-            for (uint8_t const *parser = (uint8_t const *)in.begin(); parser < (uint8_t const *)in.end(); ++parser)
-            {
-                if ((parser[0] >= 'a' && parser[0] <= 'f')
-                     || (parser[0] >= 'A' && parser[0] <= 'F')
-                     || (parser[0] >= '0' && parser[0] <= '9'))
-                {
-                    char str[3] = { (char)parser[must_swap ? 1 : 0],
-                                    (char)parser[must_swap ? 0 : 1], '\0' };
-                    section.push_back((uint8_t)strtoul(str, nullptr, 16));
-                    ++parser;
-                }
-            }
+            msg::debug("loaded file %s\n", candidate.c_str());
+            break;
         }
     }
-};
 
-struct replacement
+    if (f.size() < offsetof(memory, code) || f.size() > sizeof(m_rom))
+        return false;
+
+    memset(&m_rom, 0, sizeof(m_rom));
+    memcpy(&m_rom, f.data(), f.size());
+    m_label.clear();
+
+    load_code(PICO8_VERSION);
+    return true;
+}
+
+void cart::load_code(int version)
 {
-    replacement(char const *re, char const *str)
-      : m_re(re),
-        m_str(str)
-    {}
+    // Retrieve code, with optional decompression
+    if (memcmp(m_rom.code, "\0pxa", 4) == 0)
+    {
+        if (!pxa_decompress(m_rom.code, sizeof(m_rom.code), m_code))
+            msg::warn("invalid PXA code data\n");
+    }
+    else if (version == 0 || m_rom.code[0] != ':' || m_rom.code[1] != 'c'
+                          || m_rom.code[2] != ':' || m_rom.code[3] != '\0')
+    {
+        int length = 0;
+        while (length < (int)sizeof(m_rom.code) && m_rom.code[length] != '\0')
+            ++length;
 
-    std::string replace(std::string const &str) const
+        m_code.resize(length);
+        memcpy(&m_code[0], &m_rom.code, length);
+    }
+    else if (version == 1 || version >= 5)
     {
-        return std::regex_replace(str, m_re, m_str);
+        // Expected data length (including trailing zero)
+        int length = m_rom.code[4] * 256
+                   + m_rom.code[5];
+
+        m_code = decompress_code(m_rom.code + 8, sizeof(m_rom.code) - 8, length);
+
+        if (length != (int)m_code.length())
+            msg::warn("expected %d code bytes, got %d\n", length, (int)m_code.length());
     }
 
-private:
-    std::regex m_re;
-    char const *m_str;
-};
+    // Remove possible trailing zeroes
+    m_code.resize(strlen(m_code.c_str()));
+
+    msg::debug("version: %d code: %d\n", version, (int)m_code.length());
+
+    // Invalidate code cache
+    m_lua.resize(0);
+}
 
 bool cart::load_p8(char const *filename)
 {
@@ -335,111 +576,188 @@ bool cart::load_p8(char const *filename)
     if (s.length() == 0)
         return false;
 
-    p8_reader reader;
-    reader.parse(s.c_str());
+    return parse_p8(s.c_str(), s.length());
+}
 
-    if (reader.m_version < 0)
-        return false;
+bool cart::parse_p8(char const *data, size_t size)
+{
+    char const *p = data, *end = data + size;
 
-    m_code = reader.m_code;
+    // Skip optional UTF-8 BOM
+    if (size >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0)
+        p += 3;
 
-    // PICO-8 saves some symbols in the .p8 file as Emoji/Unicode characters
-    // but the runtime expects characters \x80 — \x99 instead.
-    static replacement const replaces[] =
+    auto next_line = [&](char const *q) -> char const *
     {
-        { "█", "\x80" }, { "▒", "\x81" }, { "🐱", "\x82" }, { "⬇️", "\x83" },
-        { "░", "\x84" }, { "✽", "\x85" }, { "●", "\x86" }, { "♥", "\x87" },
-        { "☉", "\x88" }, { "웃", "\x89" }, { "⌂", "\x8a" }, { "⬅️", "\x8b" },
-        { "😐", "\x8c" }, { "♪", "\x8d" }, { "🅾️", "\x8e" }, { "◆", "\x8f" },
-        { "…", "\x90" }, { "➡️", "\x91" }, { "★", "\x92" }, { "⧗", "\x93" },
-        { "⬆️", "\x94" }, { "ˇ", "\x95" }, { "∧", "\x96" }, { "❎", "\x97" },
-        { "▤", "\x98" }, { "▥", "\x99" },
+        char const *eol = (char const *)memchr(q, '\n', end - q);
+        return eol ? eol + 1 : end;
     };
 
-    for (size_t i = 0; i < sizeof(replaces) / sizeof(*replaces); ++i)
-        m_code = replaces[i].replace(m_code);
+    // Header: “pico-8 cartridge” then “version <n>”
+    if (end - p < 16 || memcmp(p, "pico-8 cartridge", 16) != 0)
+        return false;
+    p = next_line(p);
+    if (end - p < 8 || memcmp(p, "version ", 8) != 0)
+        return false;
+    int version = 0;
+    for (p += 8; p < end && *p >= '0' && *p <= '9'; ++p)
+        version = version * 10 + (*p - '0');
+    p = next_line(p);
 
     memset(&m_rom, 0, sizeof(m_rom));
+    m_label.clear();
+    m_code.clear();
+    m_code.reserve(end - p);
+
+    p8_section section = p8_section::header;
+    m_label.reserve(LABEL_WIDTH * LABEL_HEIGHT / 2);
+
+    size_t offsets[8] = { 0 };
+    // Staging areas for packed sfx and music entries
+    uint8_t sfx_stage[4 + 32 * 5 / 2], mus_stage[5];
+    // Decoded hex data for the current line
+    std::vector<uint8_t> buf;
+
+    // Copy “count” decoded bytes to the current section; destinations
+    // are the fixed-size areas of the ROM, extra data is ignored.
+    auto write_data = [&](uint8_t const *src, size_t count)
+    {
+        size_t &off = offsets[(int)section];
 
-    auto const &gfx = reader.m_sections[(int8_t)p8_reader::section::gfx];
-    auto const &gff = reader.m_sections[(int8_t)p8_reader::section::gff];
-    auto const &map = reader.m_sections[(int8_t)p8_reader::section::map];
-    auto const &sfx = reader.m_sections[(int8_t)p8_reader::section::sfx];
-    auto const &mus = reader.m_sections[(int8_t)p8_reader::section::mus];
-    auto const &lab = reader.m_sections[(int8_t)p8_reader::section::lab];
+        auto copy_to = [&](uint8_t *dst, size_t size, size_t start)
+        {
+            if (off + count > start && off < start + size)
+            {
+                size_t skip = off < start ? start - off : 0;
+                size_t n = lol::min(count - skip, start + size - off - skip);
+                memcpy(dst + off + skip - start, src + skip, n);
+            }
+        };
 
-    msg::debug("version: %d code: %d gfx: %d/%d gff: %d/%d map: %d/%d "
-               "sfx: %d/%d mus: %d/%d lab: %d/%d\n",
-               reader.m_version, (int)m_code.length(),
-               (int)gfx.size(), (int)sizeof(m_rom.gfx),
-               (int)gff.size(), (int)sizeof(m_rom.gfx_props),
-               (int)map.size(), (int)(sizeof(m_rom.map) + sizeof(m_rom.map2)),
-               (int)sfx.size() / (4 + 80) * (4 + 64), (int)sizeof(m_rom.sfx),
-               (int)mus.size() / 5 * 4, (int)sizeof(m_rom.song),
-               (int)lab.size(), LABEL_WIDTH * LABEL_HEIGHT / 2);
-
-    // The optional second chunk of gfx is contiguous, we can copy it directly
-    memcpy(&m_rom.gfx, gfx.data(), lol::min(sizeof(m_rom.gfx), gfx.size()));
-
-    memcpy(&m_rom.gfx_props, gff.data(), lol::min(sizeof(m_rom.gfx_props), gff.size()));
-
-    // Map data + optional second chunk
-    memcpy(&m_rom.map, map.data(), lol::min(sizeof(m_rom.map), map.size()));
-    if (map.size() > sizeof(m_rom.map))
-    {
-        int map2_count = lol::min(sizeof(m_rom.map2),
-                                  map.size() - sizeof(m_rom.map));
-        // Use binary OR because some old versions of PICO-8 would store
-        // a full gfx+gfx2 section AND a full map+map2 section, so we cannot
-        // really decide which one is relevant.
-        for (int i = 0; i < map2_count; ++i)
-            m_rom.map2[i] |= map[sizeof(m_rom.map) + i];
-    }
-
-    // Song data is encoded slightly differently
-    size_t song_count = lol::min(sizeof(m_rom.song) / 4,
-                                 mus.size() / 5);
-    for (size_t i = 0; i < song_count; ++i)
-    {
-        m_rom.song[i].data[0] = mus[i * 5 + 1] | ((mus[i * 5] << 7) & 0x80);
-        m_rom.song[i].data[1] = mus[i * 5 + 2] | ((mus[i * 5] << 6) & 0x80);
-        m_rom.song[i].data[2] = mus[i * 5 + 3] | ((mus[i * 5] << 5) & 0x80);
-        m_rom.song[i].data[3] = mus[i * 5 + 4] | ((mus[i * 5] << 4) & 0x80);
-    }
-
-    // SFX data is packed
-    size_t sfx_count = lol::min(sizeof(m_rom.sfx) / (4 + 32 * 2),
-                                sfx.size() / (4 + 32 * 5 / 2));
-    for (size_t i = 0; i < sfx_count; ++i)
-    {
-        // FIXME move this to the parser maybe?
-        for (int j = 0; j < 32; ++j)
+        switch (section)
+        {
+        case p8_section::gfx:
+            // The optional second chunk of gfx is contiguous
+            copy_to(m_rom.gfx, sizeof(m_rom.gfx), 0);
+            break;
+        case p8_section::gff:
+            copy_to(m_rom.gfx_props, sizeof(m_rom.gfx_props), 0);
+            break;
+        case p8_section::map:
+            copy_to(&m_rom.map[0], sizeof(m_rom.map), 0);
+            // Optional second chunk. Use binary OR because some old versions
+            // of PICO-8 would store a full gfx+gfx2 section AND a full
+            // map+map2 section, so we cannot really decide which one is
+            // relevant.
+            for (size_t i = 0; i < count; ++i)
+                if (off + i >= sizeof(m_rom.map) && off + i < sizeof(m_rom.map) + sizeof(m_rom.map2))
+                    m_rom.map2[off + i - sizeof(m_rom.map)] |= src[i];
+            break;
+        case p8_section::sfx:
+            for (size_t i = 0; i < count; ++i)
+            {
+                size_t const pos = off + i;
+                sfx_stage[pos % sizeof(sfx_stage)] = src[i];
+                if (pos % sizeof(sfx_stage) == sizeof(sfx_stage) - 1
+                     && pos / sizeof(sfx_stage) < sizeof(m_rom.sfx) / sizeof(m_rom.sfx[0]))
+                    set_sfx(m_rom.sfx[pos / sizeof(sfx_stage)], sfx_stage);
+            }
+            break;
+        case p8_section::mus:
+            // Song data is encoded slightly differently
+            for (size_t i = 0; i < count; ++i)
+            {
+                size_t const pos = off + i;
+                mus_stage[pos % 5] = src[i];
+                if (pos % 5 == 4 && pos / 5 < sizeof(m_rom.song) / sizeof(m_rom.song[0]))
+                    for (int n = 0; n < 4; ++n)
+                        m_rom.song[pos / 5].data[n] = mus_stage[n + 1]
+                                                    | ((mus_stage[0] << (7 - n)) & 0x80);
+            }
+            break;
+        case p8_section::lab:
         {
-            uint32_t ins = (sfx[4 + i * (4 + 80) + j * 5 / 2 + 0] << 16)
-                         | (sfx[4 + i * (4 + 80) + j * 5 / 2 + 1] << 8)
-                         | (sfx[4 + i * (4 + 80) + j * 5 / 2 + 2]);
-            // We read unaligned data; must realign it if j is odd
-            ins = (j & 1) ? ins & 0xfffff : ins >> 4;
-
-            uint16_t dst = ((ins & 0x3f000) >> 4)  // pitch
-                         | ((ins & 0x00400) >> 10) // instrument (part 1)
-                         | ((ins & 0x00300) << 6)  // instrument (part 2)
-                         | ((ins & 0x00070) >> 3)  // volume
-                         | ((ins & 0x0000f) << 4); // effect
-
-            m_rom.sfx[i].notes[j][0] = dst >> 8;
-            m_rom.sfx[i].notes[j][1] = dst & 0x00ff;
+            size_t const max = LABEL_WIDTH * LABEL_HEIGHT / 2;
+            if (off < max)
+                m_label.insert(m_label.end(), src, src + lol::min(count, max - off));
+            break;
+        }
+        default:
+            break;
+        }
+
+        off += count;
+    };
+
+    for (int line = 3; p < end; ++line)
+    {
+        char const *eol = next_line(p);
+
+        // Section names may be followed by CR LF
+        char const *name_end = eol;
+        if (name_end > p && name_end[-1] == '\n')
+            --name_end;
+        if (name_end > p && name_end[-1] == '\r')
+            --name_end;
+
+        p8_section new_section = get_section(p, name_end);
+        if (new_section != p8_section::header)
+        {
+            section = new_section;
+        }
+        else if (section == p8_section::lua)
+        {
+            // Copy the code, transcoding glyphs on the fly
+            for (uint8_t const *q = (uint8_t const *)p; q < (uint8_t const *)eol; )
+            {
+                uint8_t const *ascii = q;
+                while (q < (uint8_t const *)eol && *q < 0x80)
+                    ++q;
+                m_code.append((char const *)ascii, (char const *)q);
+                if (q == (uint8_t const *)eol)
+                    break;
+
+                uint8_t ch;
+                int len = glyphs.match(q, (uint8_t const *)eol, ch);
+                m_code += len ? (char)ch : (char)*q;
+                q += len ? len : 1;
+            }
+        }
+        else if (section != p8_section::header && section != p8_section::error)
+        {
+            // Decode hexadecimal data; gfx and label store the low nybble
+            // first.
+            bool const must_swap = section == p8_section::gfx
+                                || section == p8_section::lab;
+            hex_table const &table = section == p8_section::lab ? hex_label : hex;
+
+            buf.resize((eol - p) / 2 + 1);
+            char const *q = p;
+            int count = decode_hex(q, eol, buf.data(), must_swap, table);
+            if (count < 0)
+            {
+                if (table.value[(uint8_t)*q] < 0)
+                    msg::error("line %d: invalid character 0x%02x in hexadecimal data\n",
+                               line, (uint8_t)*q);
+                else
+                    msg::error("line %d: odd number of hexadecimal digits\n", line);
+                return false;
+            }
+            write_data(buf.data(), count);
         }
 
-        m_rom.sfx[i].editor_mode = sfx[i * (4 + 32 * 5 / 2) + 0];
-        m_rom.sfx[i].speed       = sfx[i * (4 + 32 * 5 / 2) + 1];
-        m_rom.sfx[i].loop_start  = sfx[i * (4 + 32 * 5 / 2) + 2];
-        m_rom.sfx[i].loop_end    = sfx[i * (4 + 32 * 5 / 2) + 3];
+        p = eol;
     }
 
-    // Optional cartridge label
-    m_label.resize(lol::min(lab.size(), size_t(LABEL_WIDTH * LABEL_HEIGHT / 2)));
-    memcpy(m_label.data(), lab.data(), m_label.size());
+    msg::debug("version: %d code: %d gfx: %d/%d gff: %d/%d map: %d/%d "
+               "sfx: %d/%d mus: %d/%d lab: %d/%d\n",
+               version, (int)m_code.length(),
+               (int)offsets[(int)p8_section::gfx], (int)sizeof(m_rom.gfx),
+               (int)offsets[(int)p8_section::gff], (int)sizeof(m_rom.gfx_props),
+               (int)offsets[(int)p8_section::map], (int)(sizeof(m_rom.map) + sizeof(m_rom.map2)),
+               (int)offsets[(int)p8_section::sfx] / (4 + 80) * (4 + 64), (int)sizeof(m_rom.sfx),
+               (int)offsets[(int)p8_section::mus] / 5 * 4, (int)sizeof(m_rom.song),
+               (int)offsets[(int)p8_section::lab], LABEL_WIDTH * LABEL_HEIGHT / 2);
 
     // Invalidate code cache
     m_lua.resize(0);
@@ -447,7 +765,37 @@ bool cart::load_p8(char const *filename)
     return true;
 }
 
-lol::image cart::get_png() const
+void cart::set_sfx(struct sfx &sfx, uint8_t const *data)
+{
+    // SFX data is packed: four header bytes, then 5 nybbles per note
+    for (int j = 0; j < 32; ++j)
+    {
+        uint32_t ins = (data[4 + j * 5 / 2 + 0] << 16)
+                     | (data[4 + j * 5 / 2 + 1] << 8)
+                     | (data[4 + j * 5 / 2 + 2]);
+        // We read unaligned data; must realign it if j is odd
+        ins = (j & 1) ? ins & 0xfffff : ins >> 4;
+
+        uint16_t dst = ((ins & 0x3f000) >> 4)  // pitch
+                     | ((ins & 0x00400) >> 10) // instrument (part 1)
+                     | ((ins & 0x00300) << 6)  // instrument (part 2)
+                     | ((ins & 0x00070) >> 3)  // volume
+                     | ((ins & 0x00007) << 4)  // effect
+                     // SFX instrument flag: bit 3 of the instrument
+                     // nybble, or of the effect nybble in older exports
+                     | ((ins & 0x00808) ? 0x80 : 0);
+
+        sfx.notes[j][0] = dst >> 8;
+        sfx.notes[j][1] = dst & 0x00ff;
+    }
+
+    sfx.editor_mode = data[0];
+    sfx.speed       = data[1];
+    sfx.loop_start  = data[2];
+    sfx.loop_end    = data[3];
+}
+
+lol::image cart::get_png(code_format format, int effort) const
 {
     lol::image ret;
     ret.load("data/blank.png");
@@ -468,7 +816,7 @@ lol::image cart::get_png() const
     }
 
     /* Create ROM data */
-    std::vector<uint8_t> const &rom = get_bin();
+    std::vector<uint8_t> const &rom = get_bin(format, effort);
 
     /* Write ROM to lower image bits */
     for (size_t n = 0; n < rom.size(); ++n)
@@ -482,74 +830,147 @@ lol::image cart::get_png() const
     return ret;
 }
 
+std::string cart::decompress_code(uint8_t const *data, size_t size, int length)
+{
+    std::string ret;
+    ret.reserve(length);
+
+    for (size_t i = 0; i < size && (int)ret.length() < length; ++i)
+    {
+        if (data[i] >= 0x3c)
+        {
+            if (i + 1 >= size)
+                break;
+            int a = (data[i] - 0x3c) * 16 + (data[i + 1] & 0xf);
+            int b = data[i + 1] / 16 + 2;
+            if ((int)ret.length() >= a)
+                while (b--)
+                    ret += ret[ret.length() - a];
+            ++i;
+        }
+        else if (data[i])
+        {
+            ret += decompress_lut[data[i] - 1];
+        }
+        else if (i + 1 < size)
+        {
+            ret += (char)data[++i];
+        }
+    }
+
+    return ret;
+}
+
 std::vector<uint8_t> cart::get_compressed_code() const
+{
+    auto ret = compress_code(m_code);
+
+    msg::debug("compressed code (%d bytes, max %d)\n",
+               (int)ret.size(), (int)sizeof(m_rom.code) - 8);
+
+    return ret;
+}
+
+std::vector<uint8_t> cart::compress_code(std::string const &input, std::vector<int> *sizes)
 {
     std::vector<uint8_t> ret;
 
-    /* Ensure the compression LUT is initialised */
-    if (!compress_lut)
+    /* The compression LUT is the inverse of decompress_lut. It is a
+     * function-local static so that batch workers compressing code in
+     * parallel initialise it exactly once. */
+    static std::array<uint8_t, 256> const compress_lut = []()
     {
-        uint8_t *tmp = new uint8_t[256];
-        memset(tmp, 0, 256);
+        std::array<uint8_t, 256> ret {};
         for (int i = 0; i < 0x3b; ++i)
-            tmp[(uint8_t)decompress_lut[i]] = i + 1;
-        compress_lut = tmp;
-    }
+            ret[(uint8_t)decompress_lut[i]] = i + 1;
+        return ret;
+    }();
 
     /* FIXME: PICO-8 appears to be adding an implicit \n at the
      * end of the code, and ignoring it when compressing code. So
      * for the moment we write one char too many. */
-    for (int i = 0; i < (int)m_code.length(); ++i)
+    int const n = (int)input.length();
+    uint8_t const *code = (uint8_t const *)input.c_str();
+
+    /* Back references can go 3135 bytes back and copy 2 to 17 bytes.
+     * Find the longest one at each position using hash chains indexed
+     * by the next two characters. */
+    std::vector<int> head(0x10000, -1), prev(n, -1);
+    std::vector<int> match_len(n, 0), match_off(n, 0);
+
+    for (int i = 0; i + 1 < n; ++i)
     {
-        /* Look behind for possible patterns */
-        int best_j = 0, best_len = 0;
-        for (int j = lol::max(i - 3135, 0); j < i; ++j)
-        {
-            int end = lol::min((int)m_code.length() - j, 17);
+        int const key = code[i] << 8 | code[i + 1];
+        int const max_len = lol::min(17, n - i);
 
+        for (int j = head[key]; j >= 0 && i - j <= 3135; j = prev[j])
+        {
             /* XXX: official PICO-8 stops at i - j, despite being able
-             * to support m_code.length() - j, it seems. */
-            end = lol::min(end, i - j);
+             * to support m_code.length() - j, it seems. So a candidate
+             * right behind i cannot provide a 2-byte match. */
+            int const end = lol::min(max_len, i - j);
+            if (end < 2 || end <= match_len[i])
+                continue;
+
+            int k = 2;
+            while (k < end && code[j + k] == code[i + k])
+                ++k;
 
-            for (int k = 0; ; ++k)
+            if (k > match_len[i])
             {
-                if (k >= end || m_code[j + k] != m_code[i + k])
-                {
-                    if (k > best_len)
-                    {
-                        best_j = j;
-                        best_len = k;
-                    }
+                match_len[i] = k;
+                match_off[i] = i - j;
+                if (k == max_len)
                     break;
-                }
             }
         }
 
-        uint8_t byte = (uint8_t)m_code[i];
-
-        /* If best length is 2, it may or may not be interesting to emit a back
-         * reference. Most of the time, if the first character fits in a single
-         * byte, we should emit it directly. And if the first character needs
-         * to be escaped, we should always emit a back reference of length 2.
-         *
-         * However there is at least one suboptimal case with preexisting
-         * sequences “ab”, “b-”, and “-c-”. Then the sequence “ab-c-” can be
-         * encoded as “a” “b-” “c-” (5 bytes) or as “ab” “-c-” (4 bytes).
-         * Clearly it is more interesting to encode “ab” as a two-byte back
-         * reference. But since this case is statistically rare, we ignore
-         * it and accept that compression could be more efficient.
-         *
-         * If it can be a relief, PICO-8 is a lot less good than us at this. */
-        if (compress_lut[byte] && best_len <= 2)
+        prev[i] = head[key];
+        head[key] = i;
+    }
+
+    /* Optimal parse: cost[i] is the smallest number of bytes needed to
+     * encode the code from position i. Every back reference costs two
+     * bytes, and so do characters that are not in the LUT. Any prefix
+     * of the longest match is a valid match, too, and literals win
+     * ties. This handles cases where greedy matching is suboptimal,
+     * e.g. with preexisting “ab”, “b-”, and “-c-”, the sequence “ab-c-”
+     * is better encoded as “ab” “-c-” (4 bytes) than as “a” “b-” “c-”
+     * (5 bytes). */
+    std::vector<int> cost(n + 1, 0);
+    std::vector<uint8_t> step(n, 1);
+
+    for (int i = n - 1; i >= 0; --i)
+    {
+        cost[i] = (compress_lut[code[i]] ? 1 : 2) + cost[i + 1];
+        for (int len = 2; len <= match_len[i]; ++len)
         {
-            ret.push_back(compress_lut[byte]);
+            if (2 + cost[i + len] < cost[i])
+            {
+                cost[i] = 2 + cost[i + len];
+                step[i] = (uint8_t)len;
+            }
         }
-        else if (best_len >= 2)
+    }
+
+    ret.reserve(cost[0]);
+    if (sizes)
+        sizes->assign(n, 0);
+    for (int i = 0; i < n; i += step[i])
+    {
+        uint8_t byte = code[i];
+        if (sizes)
+            (*sizes)[i] = cost[i] - cost[i + step[i]];
+
+        if (step[i] >= 2)
         {
-            uint8_t a = 0x3c + (i - best_j) / 16;
-            uint8_t b = ((i - best_j) & 0xf) + (best_len - 2) * 16;
+            uint8_t a = 0x3c + match_off[i] / 16;
+            uint8_t b = (match_off[i] & 0xf) + (step[i] - 2) * 16;
             ret.insert(ret.end(), { a, b });
-            i += best_len - 1;
+        }
+        else if (compress_lut[byte])
+        {
+            ret.push_back(compress_lut[byte]);
         }
         else
         {
@@ -557,13 +978,10 @@ std::vector<uint8_t> cart::get_compressed_code() const
         }
     }
 
-    msg::debug("compressed code (%d bytes, max %d)\n",
-               (int)ret.size(), (int)sizeof(m_rom.code) - 8);
-
     return ret;
 }
 
-std::vector<uint8_t> cart::get_bin() const
+std::vector<uint8_t> cart::get_bin(code_format format, int effort) const
 {
     int const data_size = offsetof(memory, code);
 
@@ -573,149 +991,253 @@ std::vector<uint8_t> cart::get_bin() const
     ret.resize(data_size);
     memcpy(ret.data(), &m_rom, data_size);
 
-    ret.insert(ret.end(),
+    lol::timer t;
+
+    if (format == code_format::pxa)
+    {
+        /* The PXA data includes its own header */
+        auto const &code = pxa_compress(m_code, effort);
+        if (code.empty())
+            return std::vector<uint8_t>();
+        ret.insert(ret.end(), code.begin(), code.end());
+    }
+    else
     {
-        ':', 'c', ':', '\0',
-        (uint8_t)(m_code.length() >> 8),
-        (uint8_t)m_code.length(),
-        0, 0 /* FIXME: what is this? */
-    });
+        /* The header stores the code length on 16 bits */
+        if (m_code.length() > 0xffff)
+        {
+            msg::error("cannot compress %d bytes of code, the limit is 65535\n",
+                       (int)m_code.length());
+            return std::vector<uint8_t>();
+        }
 
-    auto const &code = get_compressed_code();
-    ret.insert(ret.end(), code.begin(), code.end());
+        ret.insert(ret.end(),
+        {
+            ':', 'c', ':', '\0',
+            (uint8_t)(m_code.length() >> 8),
+            (uint8_t)m_code.length(),
+            0, 0 /* FIXME: what is this? */
+        });
+
+        auto const &code = get_compressed_code();
+        ret.insert(ret.end(), code.begin(), code.end());
+    }
 
-    int max_len = (int)sizeof(m_rom.code);
-    msg::debug("compressed code length: %d/%d\n", (int)ret.size() - data_size, max_len);
+    float const seconds = t.get();
+    int const packed = (int)ret.size() - data_size;
+    msg::debug("compressed code: %d → %d/%d bytes (%.1f%%), %.2f MiB/s\n",
+               (int)m_code.length(), packed, (int)sizeof(m_rom.code),
+               100.f * packed / lol::max(1, (int)m_code.length()),
+               m_code.length() / lol::max(seconds, 1e-6f) / 1048576.f);
+    if (packed > (int)sizeof(m_rom.code))
+        msg::warn("compressed code does not fit in the cartridge\n");
 
     ret.push_back(PICO8_VERSION);
 
     return ret;
 }
 
-std::string cart::get_p8() const
+std::vector<uint8_t> cart::get_p8_rom(code_format format, int effort) const
 {
-    std::string ret = "pico-8 cartridge // http://www.pico-8.com\n";
-    ret += lol::format("version %d\n", PICO8_VERSION);
+    // Same as the binary data, without the version byte, padded to 32 KiB
+    std::vector<uint8_t> ret = get_bin(format, effort);
+    if (ret.empty())
+        return ret;
+    ret.pop_back();
+    if (ret.size() > sizeof(m_rom))
+    {
+        msg::error("cannot export .p8.rom: code too large\n");
+        return std::vector<uint8_t>();
+    }
 
-    ret += "__lua__\n";
-    ret += get_code();
-    if (ret.back() != '\n')
-        ret += '\n';
+    ret.resize(sizeof(m_rom), 0);
+    return ret;
+}
 
-    // Export gfx section
-    int gfx_lines = 0;
-    for (int i = 0; i < (int)sizeof(m_rom.gfx); ++i)
-        if (m_rom.gfx[i] != 0)
-            gfx_lines = 1 + i / 64;
+// The .p8 header, minus the two version digits and the newline
+static char const *header = "pico-8 cartridge // http://www.pico-8.com\nversion ";
 
-    for (int line = 0; line < gfx_lines; ++line)
+// Number of lines needed to serialise each section of the .p8 format;
+// trailing zero lines are omitted.
+struct cart::p8_layout
+{
+    p8_layout(cart const &c)
     {
-        if (line == 0)
-            ret += "__gfx__\n";
+        auto count = [](uint8_t const *data, int size, int stride)
+        {
+            int ret = 0;
+            for (int i = 0; i < size; ++i)
+                if (data[i] != 0)
+                    ret = 1 + i / stride;
+            return ret;
+        };
+
+        memory const &rom = c.m_rom;
+        gfx = count(rom.gfx, sizeof(rom.gfx), 64);
+        gff = count(rom.gfx_props, sizeof(rom.gfx_props), 128);
+        // Only serialise m_rom.map, because m_rom.map2 overlaps with m_rom.gfx
+        // which has already been serialised.
+        // FIXME: we could choose between map2 and gfx2 by looking at line
+        // patterns, because the stride is different. See mandel.p8 for an
+        // example.
+        map = count(&rom.map[0], sizeof(rom.map), 128);
+        sfx = count((uint8_t const *)&rom.sfx, sizeof(rom.sfx), sizeof(rom.sfx[0]));
+        music = count((uint8_t const *)&rom.song, sizeof(rom.song), sizeof(rom.song[0]));
+        label = c.m_label.size() >= LABEL_WIDTH * LABEL_HEIGHT / 2;
+
+        std::string const &code = c.get_code();
+        code_newline = code.length() && code.back() != '\n';
+    }
+
+    size_t size(cart const &c) const
+    {
+        size_t const label_bytes = LABEL_WIDTH * LABEL_HEIGHT / 2;
+
+        return strlen(header) + 3 + strlen("__lua__\n") + c.get_code().length() + code_newline
+             + (gfx ? strlen("__gfx__\n") + gfx * (64 * 2 + 1) : 0)
+             + (label ? strlen("__label__\n") + label_bytes * 2 + label_bytes / (LABEL_WIDTH / 2) + 1 : 0)
+             + (gff ? strlen("__gff__\n") + gff * (128 * 2 + 1) : 0)
+             + (map ? strlen("__map__\n") + map * (128 * 2 + 1) : 0)
+             + (sfx ? strlen("__sfx__\n") + sfx * (4 * 2 + 32 * 5 + 1) : 0)
+             + (music ? strlen("__music__\n") + music * (2 + 1 + 4 * 2 + 1) : 0)
+             + 1;
+    }
+
+    int gfx, gff, map, sfx, music;
+    bool label, code_newline;
+};
+
+void cart::fill_p8(p8_layout const &layout, char *out) const
+{
+    static char const *digits = "0123456789abcdef";
+
+    auto put_str = [&](char const *str)
+    {
+        size_t len = strlen(str);
+        memcpy(out, str, len);
+        out += len;
+    };
+
+    auto put_hex = [&](uint8_t const *data, int count, bool swap)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            out[0] = digits[swap ? data[i] & 0xf : data[i] >> 4];
+            out[1] = digits[swap ? data[i] >> 4 : data[i] & 0xf];
+            out += 2;
+        }
+    };
+
+    static_assert(PICO8_VERSION >= 10 && PICO8_VERSION < 100, "version must have two digits");
+    put_str(header);
+    *out++ = (char)('0' + PICO8_VERSION / 10);
+    *out++ = (char)('0' + PICO8_VERSION % 10);
+    *out++ = '\n';
 
-        for (int i = 0; i < 64; ++i)
-            ret += lol::format("%02x", uint8_t(m_rom.gfx[64 * line + i] * 0x101 / 0x10));
+    put_str("__lua__\n");
+    memcpy(out, m_code.data(), m_code.length());
+    out += m_code.length();
+    if (layout.code_newline)
+        *out++ = '\n';
 
-        ret += '\n';
+    // Export gfx section; nybbles are stored low first
+    for (int line = 0; line < layout.gfx; ++line)
+    {
+        if (line == 0)
+            put_str("__gfx__\n");
+        put_hex(m_rom.gfx + 64 * line, 64, true);
+        *out++ = '\n';
     }
 
     // Export label
-    if (m_label.size() >= LABEL_WIDTH * LABEL_HEIGHT / 2)
+    if (layout.label)
     {
-        ret += "__label__\n";
-        for (int i = 0; i < LABEL_WIDTH * LABEL_HEIGHT / 2; ++i)
+        put_str("__label__\n");
+        for (int line = 0; line < LABEL_WIDTH * LABEL_HEIGHT / 2 / (LABEL_WIDTH / 2); ++line)
         {
-            ret += lol::format("%02x", uint8_t(m_label.data()[i] * 0x101 / 0x10));
-            if ((i + 1) % (LABEL_WIDTH / 2) == 0)
-                ret += '\n';
+            put_hex(m_label.data() + LABEL_WIDTH / 2 * line, LABEL_WIDTH / 2, true);
+            *out++ = '\n';
         }
-        ret += '\n';
+        *out++ = '\n';
     }
 
     // Export gff section
-    int gff_lines = 0;
-    for (int i = 0; i < (int)sizeof(m_rom.gfx_props); ++i)
-        if (m_rom.gfx_props[i] != 0)
-            gff_lines = 1 + i / 128;
-
-    for (int line = 0; line < gff_lines; ++line)
+    for (int line = 0; line < layout.gff; ++line)
     {
         if (line == 0)
-            ret += "__gff__\n";
-
-        for (int i = 0; i < 128; ++i)
-            ret += lol::format("%02x", m_rom.gfx_props[128 * line + i]);
-
-        ret += '\n';
+            put_str("__gff__\n");
+        put_hex(m_rom.gfx_props + 128 * line, 128, false);
+        *out++ = '\n';
     }
 
-    // Only serialise m_rom.map, because m_rom.map2 overlaps with m_rom.gfx
-    // which has already been serialised.
-    // FIXME: we could choose between map2 and gfx2 by looking at line
-    // patterns, because the stride is different. See mandel.p8 for an
-    // example.
-    int map_lines = 0;
-    for (int i = 0; i < (int)sizeof(m_rom.map); ++i)
-        if (m_rom.map[i] != 0)
-            map_lines = 1 + i / 128;
-
-    for (int line = 0; line < map_lines; ++line)
+    // Export map section
+    for (int line = 0; line < layout.map; ++line)
     {
         if (line == 0)
-            ret += "__map__\n";
-
-        for (int i = 0; i < 128; ++i)
-            ret += lol::format("%02x", m_rom.map[128 * line + i]);
-
-        ret += '\n';
+            put_str("__map__\n");
+        put_hex(&m_rom.map[128 * line], 128, false);
+        *out++ = '\n';
     }
 
     // Export sfx section
-    int sfx_lines = 0;
-    for (int i = 0; i < (int)sizeof(m_rom.sfx); ++i)
-        if (((uint8_t const *)&m_rom.sfx)[i] != 0)
-            sfx_lines = 1 + i / (int)sizeof(m_rom.sfx[0]);
-
-    for (int line = 0; line < sfx_lines; ++line)
+    for (int line = 0; line < layout.sfx; ++line)
     {
         if (line == 0)
-            ret += "__sfx__\n";
+            put_str("__sfx__\n");
 
         uint8_t const *data = (uint8_t const *)&m_rom.sfx[line];
-        ret += lol::format("%02x%02x%02x%02x", data[64], data[65], data[66], data[67]);
+        put_hex(data + 64, 4, false);
         for (int j = 0; j < 64; j += 2)
         {
             int pitch = data[j] & 0x3f;
-            int instrument = ((data[j + 1] << 2) & 0x4) | (data[j] >> 6);
+            int instrument = ((data[j + 1] << 2) & 0x4) | (data[j] >> 6)
+                           | ((data[j + 1] >> 4) & 0x8); // SFX instrument flag
             int volume = (data[j + 1] >> 1) & 0x7;
-            int effect = (data[j + 1] >> 4) & 0xf;
-            ret += lol::format("%02x%1x%1x%1x", pitch, instrument, volume, effect);
+            int effect = (data[j + 1] >> 4) & 0x7;
+            out[0] = digits[pitch >> 4];
+            out[1] = digits[pitch & 0xf];
+            out[2] = digits[instrument];
+            out[3] = digits[volume];
+            out[4] = digits[effect];
+            out += 5;
         }
-
-        ret += '\n';
+        *out++ = '\n';
     }
 
     // Export music section
-    int music_lines = 0;
-    for (int i = 0; i < (int)sizeof(m_rom.song); ++i)
-        if (((uint8_t const *)&m_rom.song)[i] != 0)
-            music_lines = 1 + i / (int)sizeof(m_rom.song[0]);
-
-    for (int line = 0; line < music_lines; ++line)
+    for (int line = 0; line < layout.music; ++line)
     {
         if (line == 0)
-            ret += "__music__\n";
+            put_str("__music__\n");
 
         auto const &song = m_rom.song[line];
-        ret += lol::format("%02x %02x%02x%02x%02x\n", song.flags(),
-                                   song.sfx(0), song.sfx(1),
-                                   song.sfx(2), song.sfx(3));
+        uint8_t const data[5] = { song.flags(), song.sfx(0), song.sfx(1),
+                                  song.sfx(2), song.sfx(3) };
+        put_hex(data, 1, false);
+        *out++ = ' ';
+        put_hex(data + 1, 4, false);
+        *out++ = '\n';
     }
 
-    ret += '\n';
+    *out++ = '\n';
+}
 
+std::string cart::get_p8() const
+{
+    p8_layout const layout(*this);
+    std::string ret(layout.size(*this), '\0');
+    fill_p8(layout, &ret[0]);
     return ret;
 }
 
+bool cart::write_p8(FILE *f) const
+{
+    p8_layout const layout(*this);
+    size_t const size = layout.size(*this);
+    std::unique_ptr<char[]> buf(new char[size]);
+    fill_p8(layout, buf.get());
+    return fwrite(buf.get(), 1, size, f) == size;
+}
+
 } // namespace z8
 
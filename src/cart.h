@@ -21,20 +21,35 @@
 
 // The cart class
 // ——————————————
-// Represents a PICO-8 cartridge. Can load and unpack .p8 and .p8.png files,
-// so that the VM can then load their content into memory.
+// Represents a PICO-8 cartridge. Can load and unpack .p8, .p8.png and
+// .p8.rom files, so that the VM can then load their content into memory.
 
 namespace z8
 {
 
 class cart
 {
+    friend class cart_cache;
+    friend class cart_archive;
+
 public:
+    // Code compression format for .p8.png and binary exports
+    enum class code_format
+    {
+        legacy, // the “:c:” format of PICO-8 0.1.x
+        pxa,    // the “\0pxa” format of PICO-8 0.2.x
+    };
+
     cart()
     {}
 
+    // Load a cartridge, through the cart_cache if it is enabled. Carts
+    // in .z8a archives are named “archive.z8a:name”.
     bool load(char const *filename);
 
+    // Load a cartridge in .p8 format from memory
+    bool parse_p8(char const *data, size_t size);
+
     memory const &get_rom() const
     {
         return m_rom;
@@ -55,21 +70,36 @@ public:
         return m_code;
     }
 
-    std::string const &get_lua()
-    {
-        if (m_lua.length() == 0)
-            m_lua = analyzer().fix(m_code);
-        return m_lua;
-    }
+    // The code translated to standard Lua, from the cache if enabled
+    std::string const &get_lua();
 
     std::vector<uint8_t> get_compressed_code() const;
-    std::vector<uint8_t> get_bin() const;
+    // Compress code in the “:c:” format; if “sizes” is not null, it gets
+    // the number of output bytes spent at each position of the input
+    static std::vector<uint8_t> compress_code(std::string const &input,
+                                              std::vector<int> *sizes = nullptr);
+    // Decompress at most “length” characters of code in the “:c:” format
+    static std::string decompress_code(uint8_t const *data, size_t size, int length);
+    std::vector<uint8_t> get_bin(code_format format = code_format::legacy,
+                                 int effort = 8) const;
+    // Raw 32 KiB ROM image, as found in .p8.rom files; empty on error
+    std::vector<uint8_t> get_p8_rom(code_format format = code_format::legacy,
+                                    int effort = 8) const;
     std::string get_p8() const;
-    lol::image get_png() const;
+    // Serialise in .p8 format to a file; works with fdopen() for fds
+    bool write_p8(FILE *f) const;
+    lol::image get_png(code_format format = code_format::legacy,
+                       int effort = 8) const;
 
 private:
     bool load_png(char const *filename);
     bool load_p8(char const *filename);
+    bool load_rom(char const *filename);
+    void load_code(int version);
+    static void set_sfx(struct sfx &sfx, uint8_t const *data);
+
+    struct p8_layout;
+    void fill_p8(p8_layout const &layout, char *out) const;
 
     memory m_rom;
     std::vector<uint8_t> m_label;
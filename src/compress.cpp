@@ -14,15 +14,28 @@
 #   include "config.h"
 #endif
 
+#include <lol/engine.h>
+
 #include "compress.h"
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <iostream>
 #include <streambuf>
+#include <cctype>
 #include <cstdint>
 #include <cstdlib>
-#include <regex>
+#include <cstring>
+
+#if defined _WIN32
+#   include <io.h>
+#else
+#   include <unistd.h>
+#endif
 
 extern "C" {
 #define register /**/
@@ -37,102 +50,855 @@ extern z_const char * const z_errmsg[] = {};
 namespace z8
 {
 
+using lol::msg;
+
+static char const *chr59 = "\n,i])v+=e%1*c579}f#k<lmax>0q/42368ghjnprwyz!{:;.~_do t[sub(";
+
+// Each group of 47 bits is stored as 8 base 59 digits, least significant
+// first; 59^8 is just above 2^47.
+enum
+{
+    GROUP_BITS = 47,
+    GROUP_CHARS = 8,
+    BASE = 59,
+};
+
 std::string encode59(std::vector<uint8_t> const &v)
 {
-    char const *chr = "\n,i])v+=e%1*c579}f#k<lmax>0q/42368ghjnprwyz!{:;.~_do t[sub(";
-    int const n = 47;
-    int const p = 59;
+    size_t const groups = (v.size() * 8 + GROUP_BITS - 1) / GROUP_BITS;
 
-    std::string ret;
+    std::string raw;
+    raw.resize(groups * GROUP_CHARS);
+    char *out = &raw[0];
 
     // Read all the data
-    for (size_t pos = 0; pos < v.size() * 8; pos += n)
+    for (size_t pos = 0; pos < v.size() * 8; pos += GROUP_BITS)
     {
         // Read a group of 47 bits
         uint64_t val = 0;
-        for (size_t i = pos / 8; i <= (pos + n - 1) / 8 && i < v.size(); ++i)
+        for (size_t i = pos / 8; i <= (pos + GROUP_BITS - 1) / 8 && i < v.size(); ++i)
             val |= (uint64_t)v[i] << ((i - pos / 8) * 8);
-        val = (val >> (pos % 8)) & (((uint64_t)1 << n) - 1);
+        val = (val >> (pos % 8)) & (((uint64_t)1 << GROUP_BITS) - 1);
 
         // Convert those 47 bits to a string
-        for (int i = 0; i < 8; ++i)
+        for (int i = 0; i < GROUP_CHARS; ++i)
         {
-            ret += chr[val % p];
-            val /= p;
+            *out++ = chr59[val % BASE];
+            val /= BASE;
         }
     }
 
     // Remove trailing newlines
-    while (ret.size() && ret.back() == '\n')
-        ret.erase(ret.end() - 1);
+    size_t len = raw.size();
+    while (len && raw[len - 1] == '\n')
+        --len;
+
+    // Escape sequences that upset the PICO-8 parser, in a single pass. The
+    // escaped forms are longer, so reserve some room for them.
+    std::string ret;
+    ret.reserve(len + len / 8 + 16);
+    ret += "[[";
 
     // If string starts with \n we need to add an extra \n for Lua
-    if (ret.size() && ret[0] == '\n')
-        ret = '\n' + ret;
+    if (len && raw[0] == '\n')
+        ret += '\n';
 
-#if 1
     // Workaround for a PICO-8 bug that freezes everything… 10 chars wasted!
     // fixed in 1.1.12: https://www.lexaloffle.com/bbs/?tid=31673
     // This should not happen because we are inside a string and nothing
     // needs to be parsed, but apparently the PICO-8 parser starts parsing
-    // stuff after "]]" even if inside "[=[".
-    ret = std::regex_replace(ret, std::regex("]]\n"), "XXX_1");
-    ret = std::regex_replace(ret, std::regex("]]"), "XXX_2");
+    // stuff after "]]" even if inside "[=[". The newlines after "']]'"
+    // are also required to avoid another bug, reported for 1.1.11g:
+    // https://www.lexaloffle.com/bbs/?tid=32148
+    static char const *close2 = "]]..']]'\n..[[";
+    static char const *close2_lf = "]]..']]'\n..[[\n\n";
 
     // Workaround for another bug that messes with the parser
     // reported for 1.1.11g: https://www.lexaloffle.com/bbs/?tid=32155
-    ret = std::regex_replace(ret, std::regex("\\[\\[\\[\n"), "YYY_1");
-    ret = std::regex_replace(ret, std::regex("\\[\\[\\["), "YYY_2");
-    ret = std::regex_replace(ret, std::regex("\\[\\["), "YYY_3");
-
-    // Do the replacements described above
-    // Of course if the above workaround is used, we need to take care
-    // of the "[[\n" sequences we may have created.
-    ret = std::regex_replace(ret, std::regex("YYY_1"), "[]]..'[['..[[\n\n");
-    ret = std::regex_replace(ret, std::regex("YYY_2"), "[]]..'[['..[[");
-    ret = std::regex_replace(ret, std::regex("YYY_3"), "[]]..[[[");
-    // The newlines after "']]'" here are also required to avoid another bug,
-    // reported for 1.1.11g: https://www.lexaloffle.com/bbs/?tid=32148
-    ret = std::regex_replace(ret, std::regex("XXX_1"), "]]..']]'\n..[[\n\n");
-    ret = std::regex_replace(ret, std::regex("XXX_2"), "]]..']]'\n..[[");
+    static char const *open2 = "[]]..[[[";
+    static char const *open3 = "[]]..'[['..[[";
+    static char const *open3_lf = "[]]..'[['..[[\n\n";
+
+    // Runs of brackets are escaped as the former search and replace
+    // passes did: first the sequence that ends with a newline, at the
+    // end of the run, then the longest sequences from the left.
+    for (size_t i = 0; i < len; )
+    {
+        char const ch = raw[i];
+        if (ch != ']' && ch != '[')
+        {
+            ret += ch;
+            ++i;
+            continue;
+        }
+
+        size_t run = 1;
+        while (i + run < len && raw[i + run] == ch)
+            ++run;
+        bool const lf = i + run < len && raw[i + run] == '\n';
+        i += run;
+
+        if (ch == ']')
+        {
+            bool const tail = lf && run >= 2;
+            size_t const rest = tail ? run - 2 : run;
+            for (size_t k = 0; k < rest / 2; ++k)
+                ret += close2;
+            if (rest & 1)
+                ret += ']';
+            if (tail)
+                ret += close2_lf, ++i;
+        }
+        else
+        {
+            bool const tail = lf && run >= 3;
+            size_t const rest = tail ? run - 3 : run;
+            for (size_t k = 0; k < rest / 3; ++k)
+                ret += open3;
+            if (rest % 3 == 2)
+                ret += open2;
+            else if (rest % 3 == 1)
+                ret += '[';
+            if (tail)
+                ret += open3_lf, ++i;
+        }
+    }
 
     // And finally, we cannot end with "]".
     if (ret.back() == ']')
-        return "[[" + ret + "]..']'";
+        return ret + "]..']'";
 
-    return "[[" + ret + "]]";
-#else
-    // If ]] appears in string we need to escape it with [=[...]=] and so on
-    std::string prefix;
+    return ret + "]]";
+}
+
+std::vector<uint8_t> decode59(std::string const &s)
+{
+    static struct lut
+    {
+        lut()
+        {
+            memset(value, -1, sizeof(value));
+            for (int i = 0; i < BASE; ++i)
+                value[(uint8_t)chr59[i]] = (int8_t)i;
+        }
+
+        int8_t value[256];
+    }
+    const table;
 
-    while ((ret + "]").find("]" + prefix + "]") != std::string::npos)
-        prefix += "=";
+    // Evaluate the Lua expression: long strings and quoted strings joined
+    // with “..”; a newline right after “[[” is ignored.
+    std::string raw;
+    size_t i = 0;
+    auto skip_space = [&]() { while (i < s.size() && isspace((uint8_t)s[i])) ++i; };
+    auto starts = [&](char const *t) { return s.compare(i, strlen(t), t) == 0; };
 
-    return "[" + prefix + "[" + ret + "]" + prefix + "]";
-#endif
+    skip_space();
+    while (starts("[["))
+    {
+        i += 2;
+        if (i < s.size() && s[i] == '\n')
+            ++i;
+
+        size_t const end = s.find("]]", i);
+        if (end == std::string::npos)
+            return std::vector<uint8_t>();
+        raw.append(s, i, end - i);
+        i = end + 2;
+
+        // Quoted strings until the next long string, if any
+        for (;;)
+        {
+            skip_space();
+            if (!starts(".."))
+                break;
+            i += 2;
+            skip_space();
+            if (i >= s.size() || s[i] != '\'')
+                break;
+            size_t const quote = s.find('\'', i + 1);
+            if (quote == std::string::npos)
+                return std::vector<uint8_t>();
+            raw.append(s, i + 1, quote - i - 1);
+            i = quote + 1;
+        }
+    }
+
+    // Trailing newlines were removed by the encoder; they are zero digits
+    raw.resize((raw.size() + GROUP_CHARS - 1) / GROUP_CHARS * GROUP_CHARS, '\n');
+
+    size_t const bits = raw.size() / GROUP_CHARS * GROUP_BITS;
+    std::vector<uint8_t> ret(bits / 8 + 8, 0);
+    for (size_t g = 0, pos = 0; g < raw.size(); g += GROUP_CHARS, pos += GROUP_BITS)
+    {
+        uint64_t val = 0;
+        for (int k = GROUP_CHARS; k--; )
+        {
+            int8_t const d = table.value[(uint8_t)raw[g + k]];
+            if (d < 0)
+                return std::vector<uint8_t>();
+            val = val * BASE + d;
+        }
+
+        // Store the 47 bits, which may span 7 bytes
+        val <<= pos % 8;
+        for (size_t k = pos / 8; val; ++k, val >>= 8)
+            ret[k] |= (uint8_t)val;
+    }
+
+    ret.resize((bits + 7) / 8);
+    return ret;
+}
+
+namespace
+{
+
+// Deflate length and distance codes
+int const len_base[29] =
+{
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+int const len_extra[29] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+int const dist_base[30] =
+{
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193,
+    12289, 16385, 24577,
+};
+int const dist_extra[30] =
+{
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+// The bundled zlib is built with GZ8, which sends code length codes in
+// natural order, to suit the unz8 inflater
+int const cl_order[19] =
+{
+    16, 17, 18, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+};
+
+// MIN_MATCH, MAX_MATCH, L_CODES and D_CODES come from zlib
+int const window_size = 1 << MAX_WBITS;
+
+inline int len_code(int len)
+{
+    int c = 0;
+    while (c < 28 && len_base[c + 1] <= len)
+        ++c;
+    return c;
+}
+
+inline int dist_code(int dist)
+{
+    int c = 0;
+    while (c < 29 && dist_base[c + 1] <= dist)
+        ++c;
+    return c;
+}
+
+// Compute Huffman code lengths no longer than “limit” bits. When the
+// optimal tree is too deep, frequencies are flattened until it fits.
+std::vector<int> huffman_lengths(std::vector<size_t> freq, int limit)
+{
+    size_t const n = freq.size();
+    std::vector<int> lengths(n, 0);
+
+    for (;;)
+    {
+        std::vector<std::pair<size_t, int>> heap;
+        std::vector<int> parent;
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (freq[i])
+            {
+                heap.push_back(std::make_pair(freq[i], (int)parent.size()));
+                parent.push_back(-1);
+            }
+        }
+
+        auto cmp = [](std::pair<size_t, int> const &x, std::pair<size_t, int> const &y)
+        {
+            return x.first > y.first || (x.first == y.first && x.second > y.second);
+        };
+        std::make_heap(heap.begin(), heap.end(), cmp);
+
+        while (heap.size() > 1)
+        {
+            std::pop_heap(heap.begin(), heap.end(), cmp);
+            auto x = heap.back(); heap.pop_back();
+            std::pop_heap(heap.begin(), heap.end(), cmp);
+            auto y = heap.back(); heap.pop_back();
+            parent[x.second] = parent[y.second] = (int)parent.size();
+            heap.push_back(std::make_pair(x.first + y.first, (int)parent.size()));
+            parent.push_back(-1);
+            std::push_heap(heap.begin(), heap.end(), cmp);
+        }
+
+        // Depth of each leaf; parents always come after their children
+        std::vector<int> depth(parent.size(), 0);
+        for (size_t k = parent.size(); k--; )
+            if (parent[k] >= 0)
+                depth[k] = depth[parent[k]] + 1;
+
+        int max_depth = 0;
+        for (size_t i = 0, leaf = 0; i < n; ++i)
+        {
+            lengths[i] = freq[i] ? lol::max(1, depth[leaf++]) : 0;
+            max_depth = lol::max(max_depth, lengths[i]);
+        }
+
+        if (max_depth <= limit)
+            return lengths;
+
+        for (auto &f : freq)
+            if (f)
+                f = (f + 1) / 2;
+    }
+}
+
+// Canonical Huffman codes, bit-reversed for LSB-first output
+std::vector<uint16_t> huffman_codes(std::vector<int> const &lengths)
+{
+    int count[16] = { 0 }, next[16] = { 0 };
+    for (int l : lengths)
+        ++count[l];
+    count[0] = 0;
+    for (int l = 1, code = 0; l < 16; ++l)
+        next[l] = code = (code + count[l - 1]) << 1;
+
+    std::vector<uint16_t> codes(lengths.size(), 0);
+    for (size_t i = 0; i < lengths.size(); ++i)
+    {
+        int const l = lengths[i];
+        if (!l)
+            continue;
+        int c = next[l]++, r = 0;
+        for (int k = 0; k < l; ++k, c >>= 1)
+            r = (r << 1) | (c & 1);
+        codes[i] = (uint16_t)r;
+    }
+    return codes;
+}
+
+struct bit_writer
+{
+    void put(uint32_t value, int n)
+    {
+        m_buf |= (uint64_t)value << m_count;
+        for (m_count += n; m_count >= 8; m_count -= 8, m_buf >>= 8)
+            data.push_back((uint8_t)m_buf);
+    }
+
+    void flush()
+    {
+        if (m_count > 0)
+            data.push_back((uint8_t)m_buf);
+        m_buf = 0;
+        m_count = 0;
+    }
+
+    std::vector<uint8_t> data;
+
+private:
+    uint64_t m_buf = 0;
+    int m_count = 0;
+};
+
+// A single dynamic Huffman block, in the GZ8 variant of deflate: code
+// length tables and their encoding
+struct block_codes
+{
+    block_codes(std::vector<size_t> const &ll_freq, std::vector<size_t> const &d_freq)
+    {
+        // Ensure both codes are complete, with at least two symbols
+        auto fix = [](std::vector<size_t> f)
+        {
+            for (size_t i = 0, used = std::count_if(f.begin(), f.end(),
+                     [](size_t x) { return x != 0; }); used < 2; ++i)
+                if (!f[i])
+                    f[i] = 1, ++used;
+            return f;
+        };
+
+        ll = huffman_lengths(fix(ll_freq), 15);
+        dist = huffman_lengths(fix(d_freq), 15);
+
+        hlit = L_CODES;
+        while (hlit > 257 && !ll[hlit - 1])
+            --hlit;
+        hdist = D_CODES;
+        while (hdist > 1 && !dist[hdist - 1])
+            --hdist;
+
+        // Run-length encode the code lengths with symbols 16, 17 and 18
+        std::vector<int> all(ll.begin(), ll.begin() + hlit);
+        all.insert(all.end(), dist.begin(), dist.begin() + hdist);
+        for (size_t i = 0; i < all.size(); )
+        {
+            size_t run = 1;
+            while (i + run < all.size() && all[i + run] == all[i])
+                ++run;
+            if (all[i] == 0 && run >= 3)
+            {
+                run = lol::min(run, (size_t)138);
+                rle.push_back(run >= 11 ? std::make_pair(18, (int)run - 11)
+                                        : std::make_pair(17, (int)run - 3));
+            }
+            else if (all[i] != 0 && run >= 4)
+            {
+                run = lol::min(run, (size_t)7);
+                rle.push_back(std::make_pair(all[i], 0));
+                rle.push_back(std::make_pair(16, (int)run - 4));
+            }
+            else
+            {
+                run = 1;
+                rle.push_back(std::make_pair(all[i], 0));
+            }
+            i += run;
+        }
+
+        std::vector<size_t> cl_freq(19, 0);
+        for (auto const &r : rle)
+            ++cl_freq[r.first];
+        cl = huffman_lengths(fix(cl_freq), 7);
+
+        hclen = 19;
+        while (hclen > 4 && !cl[cl_order[hclen - 1]])
+            --hclen;
+    }
+
+    size_t header_bits() const
+    {
+        // Block header and end of stream marker, then the tables
+        size_t bits = 2 + 2 + 5 + 5 + 4 + 3 * hclen;
+        for (auto const &r : rle)
+            bits += cl[r.first] + (r.first == 16 ? 2 : r.first == 17 ? 3 : r.first == 18 ? 7 : 0);
+        return bits;
+    }
+
+    void write_header(bit_writer &out) const
+    {
+        // GZ8 block headers have two bits and no “last block” flag
+        out.put(3, 2);
+        out.put(hlit - 257, 5);
+        out.put(hdist - 1, 5);
+        out.put(hclen - 4, 4);
+        for (int i = 0; i < hclen; ++i)
+            out.put(cl[cl_order[i]], 3);
+
+        auto const codes = huffman_codes(cl);
+        for (auto const &r : rle)
+        {
+            out.put(codes[r.first], cl[r.first]);
+            if (r.first >= 16)
+                out.put(r.second, r.first == 16 ? 2 : r.first == 17 ? 3 : 7);
+        }
+    }
+
+    std::vector<int> ll, dist, cl;
+    std::vector<std::pair<int, int>> rle;
+    int hlit, hdist, hclen;
+};
+
+// Deflate with an optimal parse: for every position, the matches of all
+// useful lengths at their smallest distance are gathered, then a shortest
+// path is computed with a bit cost model, which is refined from the
+// symbol statistics of the previous pass.
+std::vector<uint8_t> deflate_optimal(std::vector<uint8_t> const &input, int iterations)
+{
+    int const n = (int)input.size();
+    uint8_t const *src = input.data();
+
+    // Matches at each position, with strictly increasing lengths
+    struct match { uint16_t len, dist; };
+    std::vector<std::vector<match>> matches(n);
+    {
+        int const hash_bits = 15;
+        std::vector<int> head(1 << hash_bits, -1), prev(n, -1);
+        auto hash = [&](int i)
+        {
+            return ((src[i] << 10) ^ (src[i + 1] << 5) ^ src[i + 2]) & ((1 << hash_bits) - 1);
+        };
+
+        for (int i = 0; i + MIN_MATCH <= n; ++i)
+        {
+            int const h = hash(i);
+            int best = MIN_MATCH - 1;
+            int const max_len = lol::min(MAX_MATCH, n - i);
+            for (int j = head[h], chain = 8192; j >= 0 && i - j <= window_size && chain--; j = prev[j])
+            {
+                if (best >= max_len || src[j + best] != src[i + best])
+                    continue;
+                int len = 0;
+                while (len < max_len && src[j + len] == src[i + len])
+                    ++len;
+                if (len > best)
+                {
+                    best = len;
+                    matches[i].push_back(match{ (uint16_t)len, (uint16_t)(i - j) });
+                }
+            }
+            prev[i] = head[h];
+            head[h] = i;
+        }
+    }
+
+    // Initial cost model: the fixed Huffman code lengths
+    std::vector<int> ll_cost(L_CODES), d_cost(D_CODES, 5);
+    for (int i = 0; i < L_CODES; ++i)
+        ll_cost[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+
+    std::vector<uint8_t> best;
+    size_t best_bits = SIZE_MAX;
+    std::vector<uint32_t> cost(n + 1);
+    std::vector<match> step(n + 1);
+
+    for (int iter = 0; iter < lol::max(iterations, 1); ++iter)
+    {
+        // Shortest path through the input; step[i] leads to position i
+        std::fill(cost.begin(), cost.end(), UINT32_MAX);
+        cost[0] = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            uint32_t const c = cost[i] + ll_cost[src[i]];
+            if (c < cost[i + 1])
+                cost[i + 1] = c, step[i + 1] = match{ 1, 0 };
+
+            int len = MIN_MATCH;
+            for (auto const &m : matches[i])
+            {
+                int const dc = dist_code(m.dist);
+                uint32_t const dbits = d_cost[dc] + dist_extra[dc];
+                for (; len <= m.len; ++len)
+                {
+                    int const lc = len_code(len);
+                    uint32_t const mc = cost[i] + ll_cost[257 + lc] + len_extra[lc] + dbits;
+                    if (mc < cost[i + len])
+                        cost[i + len] = mc, step[i + len] = match{ (uint16_t)len, m.dist };
+                }
+            }
+        }
+
+        std::vector<match> path;
+        for (int i = n; i > 0; i -= step[i].len)
+            path.push_back(step[i]);
+        std::reverse(path.begin(), path.end());
+
+        // Gather statistics and emit the block
+        std::vector<size_t> ll_freq(L_CODES, 0), d_freq(D_CODES, 0);
+        for (int i = 0, k = 0; k < (int)path.size(); i += path[k++].len)
+        {
+            if (path[k].dist == 0)
+                ++ll_freq[src[i]];
+            else
+                ++ll_freq[257 + len_code(path[k].len)], ++d_freq[dist_code(path[k].dist)];
+        }
+        ++ll_freq[256];
+
+        block_codes const block(ll_freq, d_freq);
+        size_t bits = block.header_bits();
+        for (int i = 0; i < L_CODES; ++i)
+            bits += ll_freq[i] * (block.ll[i] + (i > 256 ? len_extra[i - 257] : 0));
+        for (int i = 0; i < D_CODES; ++i)
+            bits += d_freq[i] * (block.dist[i] + dist_extra[i]);
+
+        if (bits < best_bits)
+        {
+            best_bits = bits;
+
+            bit_writer out;
+            block.write_header(out);
+            auto const ll_codes = huffman_codes(block.ll);
+            auto const d_codes = huffman_codes(block.dist);
+            for (int i = 0, k = 0; k < (int)path.size(); i += path[k++].len)
+            {
+                if (path[k].dist == 0)
+                {
+                    out.put(ll_codes[src[i]], block.ll[src[i]]);
+                    continue;
+                }
+                int const lc = len_code(path[k].len), dc = dist_code(path[k].dist);
+                out.put(ll_codes[257 + lc], block.ll[257 + lc]);
+                out.put(path[k].len - len_base[lc], len_extra[lc]);
+                out.put(d_codes[dc], block.dist[dc]);
+                out.put(path[k].dist - dist_base[dc], dist_extra[dc]);
+            }
+            out.put(ll_codes[256], block.ll[256]);
+            out.put(0, 2); // GZ8 end of stream
+            out.flush();
+            best = out.data;
+        }
+
+        // Next cost model: the code lengths just used, with unused
+        // symbols priced as if they were rare
+        for (int i = 0; i < L_CODES; ++i)
+            ll_cost[i] = block.ll[i] ? block.ll[i] : 15;
+        for (int i = 0; i < D_CODES; ++i)
+            d_cost[i] = block.dist[i] ? block.dist[i] : 15;
+    }
+
+    return best;
+}
+
+char const *strategy_name(int strategy)
+{
+    static char const *names[] = { "default", "filtered", "huffman", "rle", "fixed" };
+    return strategy >= 0 && strategy < 5 ? names[strategy] : "unknown";
+}
+
+} // anonymous namespace
+
+std::string compress_settings::describe() const
+{
+    if (iterations > 0)
+        return lol::format("optimal parse, %d iterations", iterations);
+    return lol::format("zlib level %d, strategy %s, window %d, memlevel %d%s",
+                       level, strategy_name(strategy), window_bits, mem_level,
+                       exhaustive ? ", exhaustive search" : "");
 }
 
 std::vector<uint8_t> compress(std::vector<uint8_t> &input)
 {
-    // Prepare a vector twice as big... we don't really care.
-    std::vector<uint8_t> output(input.size() * 2 + 10);
-
-    z_stream zs = {};
-    zs.zalloc = [](void *, unsigned int n, unsigned int m) -> void * { return new char[n * m]; };
-    zs.zfree = [](void *, void *p) -> void { delete[] (char *)p; };
-    zs.next_in = input.data();
-    zs.next_out = output.data();
-    zs.avail_in = (uInt)input.size();
-    zs.avail_out = (uInt)output.size();
-    
-    deflateInit(&zs, Z_BEST_COMPRESSION);
-    deflate(&zs, Z_FINISH);
-    // Strip first 2 bytes (deflate header) and last 4 bytes (checksum)
-    output = std::vector<uint8_t>(output.begin() + 2, output.begin() + zs.total_out - 4);
-    deflateEnd(&zs);
+    return compress(input, compress_settings());
+}
+
+std::vector<uint8_t> compress(std::vector<uint8_t> const &input,
+                              compress_settings const &settings)
+{
+    if (settings.iterations > 0)
+        return deflate_optimal(input, settings.iterations);
 
+    std::vector<uint8_t> output;
+    auto append = [&](uint8_t const *data, size_t size)
+    {
+        output.insert(output.end(), data, data + size);
+    };
+
+    compressor c(settings);
+    c.write(input.data(), input.size(), append);
+    c.finish(append);
     return output;
 }
 
+struct compressor::state
+{
+    enum { CHUNK = 1 << 16 };
+
+    z_stream zs;
+    bool ok;
+
+    // zlib allocates its state once, in deflateInit2(); these are carved
+    // out of the arena and never freed individually.
+    std::vector<uint8_t> arena;
+    size_t used = 0;
+
+    uint8_t out[CHUNK];
+};
+
+compressor::compressor(compress_settings const &settings)
+  : m_state(new state())
+{
+    state &s = *m_state;
+
+    // Same computation as in deflateInit2(), plus alignment padding
+    size_t const w_size = (size_t)1 << lol::max(settings.window_bits, 9);
+    size_t const hash_size = (size_t)1 << (settings.mem_level + 7);
+    size_t const lit_bufsize = (size_t)1 << (settings.mem_level + 6);
+    s.arena.resize(sizeof(deflate_state) + 2 * w_size + w_size * sizeof(Pos)
+                    + hash_size * sizeof(Pos) + lit_bufsize * (sizeof(ush) + 2)
+                    + 5 * 16);
+
+    s.zs = z_stream();
+    s.zs.opaque = &s;
+    s.zs.zalloc = [](void *opaque, unsigned int n, unsigned int m) -> void *
+    {
+        state &s = *(state *)opaque;
+        size_t const size = ((size_t)n * m + 15) & ~(size_t)15;
+        if (s.used + size > s.arena.size())
+            return Z_NULL;
+        void *ret = s.arena.data() + s.used;
+        s.used += size;
+        return ret;
+    };
+    s.zs.zfree = [](void *, void *) -> void {};
+
+    // Negative window bits give raw deflate data, without header or checksum
+    s.ok = deflateInit2(&s.zs, settings.level, Z_DEFLATED, -lol::max(settings.window_bits, 9),
+                        settings.mem_level, settings.strategy) == Z_OK;
+    if (s.ok && settings.exhaustive)
+        deflateTune(&s.zs, MAX_MATCH, MAX_MATCH, MAX_MATCH, 4096);
+    if (!s.ok)
+        msg::error("cannot initialise compressor: %s\n", settings.describe().c_str());
+}
+
+compressor::~compressor()
+{
+    if (m_state->ok)
+        deflateEnd(&m_state->zs);
+}
+
+bool compressor::run(int flush, sink const &out)
+{
+    state &s = *m_state;
+    if (!s.ok)
+        return false;
+
+    // Keep going while zlib fills the whole output chunk
+    do
+    {
+        s.zs.next_out = s.out;
+        s.zs.avail_out = state::CHUNK;
+        int const ret = deflate(&s.zs, flush);
+        if (ret == Z_STREAM_ERROR)
+            return false;
+        out(s.out, state::CHUNK - s.zs.avail_out);
+    }
+    while (s.zs.avail_out == 0);
+
+    return true;
+}
+
+bool compressor::write(uint8_t const *data, size_t size, sink const &out)
+{
+    bool ok = true;
+    // avail_in is 32-bit, so split very large inputs
+    while (ok && size > 0)
+    {
+        uInt const chunk = (uInt)lol::min(size, (size_t)1 << 30);
+        m_state->zs.next_in = (Bytef *)data;
+        m_state->zs.avail_in = chunk;
+        ok = run(Z_NO_FLUSH, out);
+        data += chunk;
+        size -= chunk;
+    }
+    return ok;
+}
+
+bool compressor::finish(sink const &out)
+{
+    m_state->zs.next_in = Z_NULL;
+    m_state->zs.avail_in = 0;
+    bool const ok = run(Z_FINISH, out);
+    if (m_state->ok)
+        deflateReset(&m_state->zs);
+    return ok;
+}
+
+bool compressor::write_fd(int fd, sink const &out)
+{
+    std::vector<uint8_t> buf(state::CHUNK);
+    for (;;)
+    {
+#if defined _WIN32
+        int const n = _read(fd, buf.data(), (unsigned int)buf.size());
+#else
+        ssize_t const n = read(fd, buf.data(), buf.size());
+#endif
+        if (n < 0)
+            return false;
+        if (n == 0)
+            return true;
+        if (!write(buf.data(), (size_t)n, out))
+            return false;
+    }
+}
+
+std::vector<uint8_t> compress_search(std::vector<uint8_t> const &input, size_t skip,
+                                     compress_settings *best_settings)
+{
+    std::vector<compress_settings> jobs;
+
+    // The optimal parser first, since it is the slowest and usually wins
+    for (int iterations : { 15, 5 })
+    {
+        compress_settings s;
+        s.iterations = iterations;
+        jobs.push_back(s);
+    }
+
+    for (int strategy = Z_DEFAULT_STRATEGY; strategy <= Z_FIXED; ++strategy)
+    for (int level = 1; level <= 9; ++level)
+    for (int window_bits = 9; window_bits <= 15; ++window_bits)
+    for (int mem_level = 1; mem_level <= 9; ++mem_level)
+    {
+        // Only level matters for Huffman-only and RLE strategies
+        if ((strategy == Z_HUFFMAN_ONLY || strategy == Z_RLE)
+             && (window_bits != 15 || mem_level != 8))
+            continue;
+
+        compress_settings s;
+        s.level = level;
+        s.strategy = strategy;
+        s.window_bits = window_bits;
+        s.mem_level = mem_level;
+        jobs.push_back(s);
+
+        if (level == 9 && (strategy == Z_DEFAULT_STRATEGY || strategy == Z_FILTERED))
+        {
+            s.exhaustive = true;
+            jobs.push_back(s);
+        }
+    }
+
+    // Rank results by the length of what ends up in the cart
+    auto encoded_size = [&](std::vector<uint8_t> output)
+    {
+        output.erase(output.begin(), output.begin() + std::min(skip, output.size()));
+        return encode59(output).length();
+    };
+
+    int const thread_count = lol::clamp((int)std::thread::hardware_concurrency(),
+                                        1, (int)jobs.size());
+
+    std::atomic<int> next(0);
+    std::mutex mutex;
+    std::vector<uint8_t> best;
+    size_t best_size = SIZE_MAX;
+    int best_job = -1;
+
+    auto worker = [&]()
+    {
+        for (;;)
+        {
+            int n = next++;
+            if (n >= (int)jobs.size())
+                break;
+
+            auto output = compress(input, jobs[n]);
+            size_t const size = encoded_size(output);
+
+            // Ties go to the first job, so that results are reproducible
+            std::unique_lock<std::mutex> lock(mutex);
+            if (size < best_size || (size == best_size && n < best_job))
+            {
+                best = std::move(output);
+                best_size = size;
+                best_job = n;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; ++i)
+        threads.push_back(std::thread(worker));
+    for (auto &th : threads)
+        th.join();
+
+    msg::info("tried %d settings on %d threads; best is %s: %d bytes, %d characters\n",
+              (int)jobs.size(), thread_count, jobs[best_job].describe().c_str(),
+              (int)best.size(), (int)best_size);
+    if (best_settings)
+        *best_settings = jobs[best_job];
+
+    return best;
+}
+
 } // namespace z8
 
@@ -12,6 +12,8 @@
 
 #pragma once
 
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 #include <cstdint>
@@ -19,8 +21,68 @@
 namespace z8
 {
 
+// Compression settings: either zlib parameters, or a number of passes
+// for the optimal parse encoder
+struct compress_settings
+{
+    int level = 9;
+    int strategy = 0;
+    int window_bits = 15;
+    int mem_level = 8;
+    bool exhaustive = false; // longest match search in zlib
+    int iterations = 0;      // use the optimal parse encoder if non-zero
+
+    std::string describe() const;
+};
+
+// Compress to raw deflate data
 std::vector<uint8_t> compress(std::vector<uint8_t> &input);
+std::vector<uint8_t> compress(std::vector<uint8_t> const &input,
+                              compress_settings const &settings);
+
+// The compressor class
+// ————————————————————
+// A raw deflate stream fed with chunks of input, which hands chunks of
+// output to a callback as they are produced. All zlib state lives in an
+// arena that is allocated once, so the object can be reused for many
+// streams without further allocations.
+
+class compressor
+{
+public:
+    typedef std::function<void(uint8_t const *data, size_t size)> sink;
+
+    compressor(compress_settings const &settings = compress_settings());
+    ~compressor();
+
+    // Feed a chunk of input
+    bool write(uint8_t const *data, size_t size, sink const &out);
+    // Flush the end of the stream; the compressor is then reset
+    bool finish(sink const &out);
+    // Compress everything that can be read from a file descriptor
+    bool write_fd(int fd, sink const &out);
+
+private:
+    bool run(int flush, sink const &out);
+
+    struct state;
+    std::unique_ptr<state> m_state;
+};
+
+// Try many compression settings on all cores and return the output that
+// is the shortest once the first “skip” bytes are removed and the rest
+// is encoded with encode59().
+std::vector<uint8_t> compress_search(std::vector<uint8_t> const &input, size_t skip,
+                                     compress_settings *best_settings = nullptr);
+
+// Encode data as a Lua string expression in base 59, escaped so that the
+// PICO-8 parser accepts it
 std::string encode59(std::vector<uint8_t> const &v);
 
+// Decode the output of encode59(). Trailing zero bytes are not always
+// recoverable, so the result may be a few zero bytes longer or shorter
+// than the original data. Returns an empty vector on error.
+std::vector<uint8_t> decode59(std::string const &s);
+
 } // namespace z8
 
@@ -1,7 +1,7 @@
 //
 //  ZEPTO-8 — Fantasy console emulator
 //
-//  Copyright © 2016—2018 Sam Hocevar <sam@hocevar.net>
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
 //
 //  This program is free software. It comes without any warranty, to
 //  the extent permitted by applicable law. You can redistribute it
@@ -17,6 +17,12 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include <lol/engine.h>
 
@@ -28,44 +34,600 @@
 namespace z8
 {
 
-void dither(char const *src, char const *out, bool hicolor, bool error_diffusion)
+namespace
+{
+
+// Nearest colour search using a grid of RGB cells. Each cell stores the
+// colours that are the nearest one for at least one point of the cell,
+// which is usually a single colour, so most lookups need no distance
+// computation at all and the result is always exact. The grid extends
+// beyond the RGB cube because error diffusion overshoots it.
+class nearest_color
+{
+public:
+    nearest_color(std::vector<lol::vec3> const &colors)
+      : m_colors(colors),
+        m_cells(SIZE * SIZE * SIZE)
+    {
+        std::vector<float> mins(colors.size());
+        for (int n = 0; n < SIZE * SIZE * SIZE; ++n)
+        {
+            lol::ivec3 p(n % SIZE, n / SIZE % SIZE, n / SIZE / SIZE);
+            lol::vec3 lo = lol::vec3(p) / scale() + lol::vec3(origin());
+            lol::vec3 hi = lo + lol::vec3(1.f / scale());
+
+            // A colour is a candidate if its distance to the cell is not
+            // larger than the distance within which some colour is sure
+            // to be found from any point of the cell
+            float threshold = FLT_MAX;
+            for (size_t k = 0; k < colors.size(); ++k)
+            {
+                lol::vec3 c = colors[k];
+                lol::vec3 dmin = lol::max(lol::max(lo - c, c - hi), lol::vec3(0.f));
+                lol::vec3 dmax = lol::max(lol::abs(c - lo), lol::abs(c - hi));
+                mins[k] = lol::sqlength(dmin);
+                threshold = lol::min(threshold, lol::sqlength(dmax));
+            }
+
+            m_cells[n] = (uint32_t)m_candidates.size() << 8;
+            for (size_t k = 0; k < colors.size(); ++k)
+                if (mins[k] <= threshold)
+                    m_candidates.push_back((uint8_t)k), ++m_cells[n];
+        }
+    }
+
+    int operator()(lol::vec3 color) const
+    {
+        lol::vec3 p = (color - lol::vec3(origin())) * scale();
+        if (p.x < 0.f || p.y < 0.f || p.z < 0.f
+             || p.x >= SIZE || p.y >= SIZE || p.z >= SIZE)
+            return scan(color, nullptr, (int)m_colors.size());
+
+        lol::ivec3 q(p);
+        uint32_t cell = m_cells[(q.z * SIZE + q.y) * SIZE + q.x];
+        int count = cell & 0xff;
+        uint8_t const *candidates = m_candidates.data() + (cell >> 8);
+        return count == 1 ? candidates[0] : scan(color, candidates, count);
+    }
+
+private:
+    int scan(lol::vec3 color, uint8_t const *candidates, int count) const
+    {
+        float best_dist = FLT_MAX;
+        int best = -1;
+        for (int n = 0; n < count; ++n)
+        {
+            int i = candidates ? candidates[n] : n;
+            float dist = lol::sqlength(m_colors[i] - color);
+            if (dist < best_dist)
+            {
+                best = i;
+                best_dist = dist;
+            }
+        }
+
+        return best;
+    }
+
+    // The grid covers [-0.5, 1.5] on each axis
+    enum { SIZE = 32 };
+    static float origin() { return -0.5f; }
+    static float scale() { return SIZE / 2.f; }
+
+    std::vector<lol::vec3> const &m_colors;
+    // Offset in m_candidates << 8 | number of candidates
+    std::vector<uint32_t> m_cells;
+    std::vector<uint8_t> m_candidates;
+};
+
+// Cache of dithering sequences, keyed by 24-bit colour. This is a flat
+// open addressing hash table with linear probing; sequences are stored
+// contiguously in the order they were added, so growing the table only
+// moves the keys.
+class sequence_cache
+{
+public:
+    sequence_cache()
+      : m_slots(1024, EMPTY)
+    {
+    }
+
+    uint8_t const *find(uint32_t key) const
+    {
+        for (size_t n = hash(key); ; n = (n + 1) & (m_slots.size() - 1))
+        {
+            if (m_slots[n] == EMPTY)
+                return nullptr;
+            if (m_keys[m_slots[n]] == key)
+                return m_data.data() + (size_t)m_slots[n] * DEPTH;
+        }
+    }
+
+    // Add a new key, which must not already be in the cache, and return
+    // the storage for its sequence
+    uint8_t *insert(uint32_t key)
+    {
+        if (2 * (m_keys.size() + 1) > m_slots.size())
+            grow();
+
+        uint32_t const index = (uint32_t)m_keys.size();
+        m_keys.push_back(key);
+        m_data.resize(m_data.size() + DEPTH);
+        place(key, index);
+        return m_data.data() + (size_t)index * DEPTH;
+    }
+
+private:
+    size_t hash(uint32_t key) const
+    {
+        return (key * 0x9e3779b1u >> 8) & (m_slots.size() - 1);
+    }
+
+    void place(uint32_t key, uint32_t index)
+    {
+        size_t n = hash(key);
+        while (m_slots[n] != EMPTY)
+            n = (n + 1) & (m_slots.size() - 1);
+        m_slots[n] = index;
+    }
+
+    void grow()
+    {
+        m_slots.assign(m_slots.size() * 2, EMPTY);
+        for (uint32_t i = 0; i < (uint32_t)m_keys.size(); ++i)
+            place(m_keys[i], i);
+    }
+
+    enum : uint32_t { EMPTY = 0xffffffffu };
+
+    std::vector<uint32_t> m_slots, m_keys;
+    std::vector<uint8_t> m_data;
+};
+
+// Planar RGB image. Rows have one float of padding on the left and two
+// on the right, and there is an extra row at the bottom, so that error
+// diffusion can scatter around any pixel without bounds checks.
+class rgb_planes
 {
+public:
+    void resize(lol::ivec2 size)
+    {
+        m_size = size;
+        m_stride = size.x + 3;
+        for (auto &plane : m_planes)
+            plane.assign((size_t)m_stride * (size.y + 1), 0.f);
+    }
 
-    std::vector<lol::vec3> colors;
-    std::vector<uint8_t> indices;
+    lol::ivec2 size() const { return m_size; }
 
-    for (int i = 0; i < 16; ++i)
-        colors.push_back(palette::get(i).rgb);
+    float *row(int n, int j) { return m_planes[n].data() + (size_t)j * m_stride + 1; }
+    float const *row(int n, int j) const { return m_planes[n].data() + (size_t)j * m_stride + 1; }
 
-    // Fix gamma (kinda)
-    for (auto &color : colors)
-        color *= color;
+    lol::vec3 get(int i, int j) const
+    {
+        return lol::vec3(row(0, j)[i], row(1, j)[i], row(2, j)[i]);
+    }
+
+    void set(int i, int j, lol::vec3 color)
+    {
+        row(0, j)[i] = color.r;
+        row(1, j)[i] = color.g;
+        row(2, j)[i] = color.b;
+    }
 
-    if (hicolor)
+private:
+    lol::ivec2 m_size;
+    int m_stride = 0;
+    std::vector<float> m_planes[3];
+};
+
+// Palette data and lookup tables for dithering to PICO-8 colours. For
+// ordered dithering, sequences are either computed on demand for each
+// 24-bit colour, or precomputed for all 15-bit colours by quantize(),
+// after which ordered() may be called from several threads.
+class ditherer
+{
+public:
+    ditherer(bool hicolor, lol::array2d<float> const &kernel)
+      : m_hicolor(hicolor),
+        m_kernel(kernel)
     {
-        // Add colour combinations that aren’t too awful
         for (int i = 0; i < 16; ++i)
-            for (int j = i + 1; j < 16; ++j)
-                if (distance(colors[i], colors[j]) < 0.8f)
+            m_colors.push_back(palette::get(i).rgb);
+
+        // Fix gamma (kinda)
+        for (auto &color : m_colors)
+            color *= color;
+
+        if (hicolor)
+        {
+            // Add colour combinations that aren’t too awful
+            for (int i = 0; i < 16; ++i)
+                for (int j = i + 1; j < 16; ++j)
+                    if (distance(m_colors[i], m_colors[j]) < 0.8f)
+                    {
+                        m_colors.push_back(0.5f * (m_colors[i] + m_colors[j]));
+                        m_indices.push_back(i * 16 + j);
+                    }
+        }
+
+        m_closest.reset(new nearest_color(m_colors));
+
+        // Colour indices from brightest to darkest, for sorting sequences
+        auto const &colors = m_colors;
+        m_by_luminance.resize(colors.size());
+        for (size_t k = 0; k < colors.size(); ++k)
+            m_by_luminance[k] = (uint8_t)k;
+        std::stable_sort(m_by_luminance.begin(), m_by_luminance.end(), [& colors](int a, int b)
+        {
+            return lol::dot(colors[a] - colors[b], lol::vec3(1)) > 0;
+        });
+    }
+
+    // Precompute the sequences of all 15-bit colours
+    void quantize(int thread_count)
+    {
+        m_table.resize((size_t)QUANT * QUANT * QUANT * DEPTH);
+
+        std::atomic<int> next(0);
+        auto worker = [&]()
+        {
+            for (;;)
+            {
+                int z = next++;
+                if (z >= QUANT)
+                    break;
+
+                for (int n = 0; n < QUANT * QUANT; ++n)
                 {
-                    colors.push_back(0.5f * (colors[i] + colors[j]));
-                    indices.push_back(i * 16 + j);
+                    lol::vec3 p(float(n % QUANT), float(n / QUANT), float(z));
+                    sequence((p + lol::vec3(0.5f)) / float(QUANT),
+                             &m_table[((size_t)z * QUANT * QUANT + n) * DEPTH]);
                 }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < thread_count; ++i)
+            threads.push_back(std::thread(worker));
+        for (auto &t : threads)
+            t.join();
     }
 
-#if 0
-    for (int i = 0; i < 16; ++i)
+    // Ordered dithering of an image to zeroed screen data
+    void ordered(rgb_planes const &img, uint8_t *screen)
     {
-    printf("  d: %02x %02x %02x  f: %f %f %f\n",
-       palette::get8(i).r,
-       palette::get8(i).g,
-       palette::get8(i).b,
-       palette::get(i).r,
-       palette::get(i).g,
-       palette::get(i).b);
+        lol::ivec2 size = img.size(), ksize = m_kernel.size();
+        size_t const stride = (size.x + 1) / 2;
+        for (int j = 0; j < size.y; ++j)
+            for (int i = 0; i < size.x; ++i)
+            {
+                uint8_t const *found = lookup(img.get(i, j));
+
+                // Pick the final color using a dithering kernel
+                put(screen + j * stride, stride * size.y, i, j,
+                    found[(int)(m_kernel[i % ksize.x][j % ksize.y] * DEPTH)]);
+            }
     }
-#endif
 
+    // Error diffusion dithering of an image, which is modified in place,
+    // to zeroed screen data. Rows are dithered in a wavefront: row j may
+    // process pixel i once row j - 1 is done with pixel i + 1. If
+    // “residual” is not null, it receives the error of each pixel.
+    void diffuse(rgb_planes &img, uint8_t *screen, int thread_count,
+                 lol::vec3 *residual = nullptr) const
+    {
+        lol::ivec2 const size = img.size();
+        thread_count = lol::clamp(thread_count, 1, lol::max(1, size.y));
+
+        std::vector<std::atomic<int>> progress(size.y);
+        for (auto &p : progress)
+            p.store(0);
+
+        auto worker = [&](int t)
+        {
+            for (int j = t; j < size.y; j += thread_count)
+                diffuse_row(img, j, screen, residual,
+                            j > 0 ? &progress[j - 1] : nullptr, progress[j]);
+        };
+
+        if (thread_count == 1)
+        {
+            worker(0);
+            return;
+        }
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_count; ++t)
+            threads.push_back(std::thread(worker, t));
+        for (auto &th : threads)
+            th.join();
+    }
+
+    // Size of the packed screen data for an image; rows start on a byte
+    size_t packed_size(lol::ivec2 size) const
+    {
+        return (size_t)(size.x + 1) / 2 * size.y * (m_hicolor ? 2 : 1);
+    }
+
+private:
+    void diffuse_row(rgb_planes &img, int j, uint8_t *screen, lol::vec3 *residual,
+                     std::atomic<int> const *above, std::atomic<int> &progress) const
+    {
+        // Wait for the row above in chunks, to limit synchronisation
+        enum { CHUNK = 16 };
+
+        lol::ivec2 const size = img.size();
+        size_t const stride = (size.x + 1) / 2;
+        uint8_t *line = screen + j * stride;
+        float const *r = img.row(0, j), *g = img.row(1, j), *b = img.row(2, j);
+        float *r1 = img.row(0, j + 1), *g1 = img.row(1, j + 1), *b1 = img.row(2, j + 1);
+
+        // Errors are accumulated in registers, and each pixel of the row
+        // below is written once, when it gets its last contribution, in
+        // the same order as a naive implementation would add them: “next”
+        // is the next pixel below, “pending” the current one, and “carry”
+        // is the error for the pixel to the right. Only the row above
+        // writes to a row, and the padding of rgb_planes absorbs errors
+        // at the edges.
+        lol::vec3 carry(0.f), pending(0.f), next(r1[0], g1[0], b1[0]);
+
+        for (int i0 = 0; i0 < size.x; i0 += CHUNK)
+        {
+            int const i1 = lol::min(i0 + CHUNK, size.x);
+            if (above)
+            {
+                int const needed = lol::min(i1 + 1, size.x);
+                while (above->load(std::memory_order_acquire) < needed)
+                    std::this_thread::yield();
+            }
+
+            for (int i = i0; i < i1; ++i)
+            {
+                lol::vec3 pixel = lol::vec3(r[i], g[i], b[i]) + carry;
+                uint8_t nearest = (*m_closest)(pixel);
+                lol::vec3 diff = pixel - m_colors[nearest];
+                if (residual)
+                    residual[j * size.x + i] = diff;
+
+                // Scatter 7/18 to the right, and 1/18, 5/18, 3/18 below
+                lol::vec3 error = diff / 18.f;
+                lol::vec3 done = pending + 1.f * error;
+                carry = 7.f * error;
+                pending = next + 5.f * error;
+                next = lol::vec3(r1[i + 1], g1[i + 1], b1[i + 1]) + 3.f * error;
+                r1[i - 1] = done.r;
+                g1[i - 1] = done.g;
+                b1[i - 1] = done.b;
+
+                put(line, stride * size.y, i, j, nearest);
+            }
+
+            if (i1 == size.x)
+            {
+                r1[i1 - 1] = pending.r;
+                g1[i1 - 1] = pending.g;
+                b1[i1 - 1] = pending.b;
+            }
+
+            progress.store(i1, std::memory_order_release);
+        }
+    }
+
+    // Write colour “c” of pixel (i, j) to a row of zeroed screen data; in
+    // hicolor mode, colour combinations are split between two screens
+    // that are “plane” bytes apart, with alternating components
+    void put(uint8_t *line, size_t plane, int i, int j, uint8_t c) const
+    {
+        int const shift = 4 * (i & 1);
+        uint8_t *p = line + i / 2;
+        if (!m_hicolor)
+        {
+            *p |= c << shift;
+            return;
+        }
+
+        int d = (j + i / 2) & 1;
+        uint8_t a = c < 16 ? c : (m_indices[c - 16] << (4 * d) >> 4) & 0xf;
+        uint8_t b = c < 16 ? c : (m_indices[c - 16] >> (4 * d)) & 0xf;
+        p[0] |= a << shift;
+        p[plane] |= b << shift;
+    }
+
+    uint8_t const *lookup(lol::vec3 pixel)
+    {
+        if (!m_table.empty())
+        {
+            lol::ivec3 q = lol::min(lol::max(lol::ivec3(pixel * float(QUANT)),
+                                             lol::ivec3(0)), lol::ivec3(QUANT - 1));
+            return &m_table[(size_t)((q.z * QUANT + q.y) * QUANT + q.x) * DEPTH];
+        }
+
+        uint32_t key = lol::dot(lol::ivec3(pixel * 255.99f), lol::ivec3(0x1, 0x100, 0x10000));
+        uint8_t const *found = m_cache.find(key);
+        if (!found)
+        {
+            uint8_t *buffer = m_cache.insert(key);
+            sequence(pixel, buffer);
+            found = buffer;
+        }
+        return found;
+    }
+
+    // Dither pixel DEPTH times with error diffusion, count how many times
+    // each colour is picked, and store the results sorted by luminance
+    void sequence(lol::vec3 pixel, uint8_t *buffer) const
+    {
+        int counts[256] = { 0 };
+        auto candidate = pixel;
+        for (int n = 0; n < DEPTH; ++n)
+        {
+            int k = (*m_closest)(candidate);
+            ++counts[k];
+            candidate = pixel + 7.f / 16 * (candidate - m_colors[k]);
+        }
+
+        for (uint8_t k : m_by_luminance)
+            buffer = std::fill_n(buffer, counts[k], k);
+    }
+
+    // Precomputed sequences have 5 bits per component
+    enum { QUANT = 32 };
+
+    bool m_hicolor;
+    lol::array2d<float> const &m_kernel;
+    std::vector<lol::vec3> m_colors;
+    std::vector<uint8_t> m_indices, m_by_luminance;
+    std::unique_ptr<nearest_color> m_closest;
+    sequence_cache m_cache;
+    std::vector<uint8_t> m_table;
+};
+
+// Frame reader for raw RGB24 data or YUV4MPEG2 streams, which is what
+// “ffmpeg -f rawvideo -pix_fmt rgb24 -” and “ffmpeg -f yuv4mpegpipe -”
+// output. Raw frames are always 128×128.
+class frame_reader
+{
+public:
+    frame_reader(FILE *f)
+      : m_file(f)
+    {
+    }
+
+    // Read the stream header, if any
+    bool open()
+    {
+        char magic[10];
+        size_t len = fread(magic, 1, sizeof(magic), m_file);
+        if (len < sizeof(magic) || memcmp(magic, "YUV4MPEG2 ", sizeof(magic)))
+        {
+            m_pending.assign(magic, magic + len);
+            return true;
+        }
+
+        m_y4m = true;
+        m_size = lol::ivec2(0);
+
+        std::string header;
+        for (int ch; (ch = fgetc(m_file)) != EOF && ch != '\n'; )
+            header += (char)ch;
+
+        for (size_t pos = 0, end; pos < header.length(); pos = end + 1)
+        {
+            end = lol::min(header.find(' ', pos), header.length());
+            std::string param = header.substr(pos, end - pos);
+            if (param.empty())
+                continue;
+            else if (param[0] == 'W')
+                m_size.x = atoi(param.c_str() + 1);
+            else if (param[0] == 'H')
+                m_size.y = atoi(param.c_str() + 1);
+            else if (param[0] == 'C')
+            {
+                std::string c = param.substr(1);
+                // Mono streams have no chroma planes, and no subsampling
+                m_mono = c == "mono";
+                m_subsampling = c.substr(0, 3) == "420" ? lol::ivec2(1, 1)
+                              : c == "422" ? lol::ivec2(1, 0)
+                              : c == "444" || m_mono ? lol::ivec2(0, 0)
+                              : lol::ivec2(-1);
+                if (m_subsampling.x < 0)
+                {
+                    lol::msg::error("unsupported YUV4MPEG2 colour space %s\n", c.c_str());
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    lol::ivec2 size() const { return m_size; }
+
+    size_t frame_size() const
+    {
+        if (!m_y4m)
+            return (size_t)m_size.x * m_size.y * 3;
+        if (m_mono)
+            return (size_t)m_size.x * m_size.y;
+        lol::ivec2 csize = chroma_size();
+        return (size_t)m_size.x * m_size.y + 2 * csize.x * csize.y;
+    }
+
+    // Read the raw data of the next frame; return false at end of stream
+    bool read(std::vector<uint8_t> &data)
+    {
+        data.resize(frame_size());
+
+        size_t offset = 0;
+        if (m_y4m)
+        {
+            // Frame data is preceded with “FRAME” and optional parameters
+            char tag[5];
+            if (fread(tag, 1, sizeof(tag), m_file) != sizeof(tag)
+                 || memcmp(tag, "FRAME", sizeof(tag)))
+                return false;
+            for (int ch; (ch = fgetc(m_file)) != EOF && ch != '\n'; )
+                ;
+        }
+        else if (m_pending.size())
+        {
+            offset = lol::min(m_pending.size(), data.size());
+            memcpy(data.data(), m_pending.data(), offset);
+            m_pending.clear();
+        }
+
+        return fread(data.data() + offset, 1, data.size() - offset, m_file)
+                == data.size() - offset;
+    }
+
+    // Convert raw frame data to RGB; YUV data uses BT.601 limited range
+    void convert(uint8_t const *data, rgb_planes &img) const
+    {
+        if (!m_y4m)
+        {
+            for (int j = 0; j < m_size.y; ++j)
+                for (int i = 0; i < m_size.x; ++i, data += 3)
+                    img.set(i, j, lol::vec3(data[0], data[1], data[2]) / 255.f);
+            return;
+        }
+
+        lol::ivec2 csize = chroma_size();
+        uint8_t const *u = data + m_size.x * m_size.y;
+        uint8_t const *v = u + csize.x * csize.y;
+        for (int j = 0; j < m_size.y; ++j)
+            for (int i = 0; i < m_size.x; ++i)
+            {
+                float y = 1.164f / 255.f * (data[j * m_size.x + i] - 16);
+                lol::vec3 c(y);
+                if (!m_mono)
+                {
+                    int k = (j >> m_subsampling.y) * csize.x + (i >> m_subsampling.x);
+                    float cb = (u[k] - 128) / 255.f, cr = (v[k] - 128) / 255.f;
+                    c += lol::vec3(1.596f * cr, -0.392f * cb - 0.813f * cr, 2.017f * cb);
+                }
+                img.set(i, j, lol::min(lol::max(c, lol::vec3(0.f)), lol::vec3(1.f)));
+            }
+    }
+
+private:
+    lol::ivec2 chroma_size() const
+    {
+        lol::ivec2 round((1 << m_subsampling.x) - 1, (1 << m_subsampling.y) - 1);
+        return lol::ivec2((m_size.x + round.x) >> m_subsampling.x,
+                          (m_size.y + round.y) >> m_subsampling.y);
+    }
+
+    FILE *m_file;
+    bool m_y4m = false, m_mono = false;
+    lol::ivec2 m_size = lol::ivec2(128), m_subsampling = lol::ivec2(1);
+    std::vector<uint8_t> m_pending;
+};
+
+} // anonymous namespace
+
+void dither(char const *src, char const *out, bool hicolor, bool error_diffusion)
+{
     /* Load images */
     lol::image im;
     im.load(src);
@@ -87,126 +649,201 @@ void dither(char const *src, char const *out, bool hicolor, bool error_diffusion
 
     lol::msg::info("image size %d×%d\n", size.x, size.y);
 
-    lol::image dst(size);
-    std::vector<uint8_t> pixels;
-
     //auto kernel = lol::image::kernel::halftone(lol::ivec2(6));
     //auto kernel = lol::image::kernel::blue_noise(lol::ivec2(64));
     auto kernel = lol::image::kernel::bayer(lol::ivec2(32));
 
-    auto closest = [& colors](lol::vec3 color) -> int
+    ditherer d(hicolor, kernel);
+
+    rgb_planes img;
+    img.resize(size);
+    lol::array2d<lol::vec4> &curdata = im.lock2d<lol::PixelFormat::RGBA_F32>();
+    for (int j = 0; j < size.y; ++j)
+        for (int i = 0; i < size.x; ++i)
+            img.set(i, j, curdata[i][j].rgb);
+    im.unlock2d(curdata);
+
+    /* Dither image for first destination */
+    std::vector<uint8_t> rawdata(d.packed_size(size), 0);
+    if (error_diffusion)
+        d.diffuse(img, rawdata.data(), (int)std::thread::hardware_concurrency());
+    else
+        d.ordered(img, rawdata.data());
+
+    /* Save data */
+    FILE *s = out ? fopen(out, "wb+") : stdout;
+    fwrite(rawdata.data(), 1, rawdata.size(), s);
+    if (out)
+        fclose(s);
+}
+
+bool dither_video(char const *src, char const *out, dither_options const &opts)
+{
+    FILE *f = strcmp(src, "-") ? fopen(src, "rb") : stdin;
+    if (!f)
     {
-        float best_dist = FLT_MAX;
-        int best = -1;
-        for (int i = 0; i < (int)colors.size(); ++i)
-        {
-            float dist = lol::distance(colors[i], color);
-            if (dist < best_dist)
-            {
-                best = i;
-                best_dist = dist;
-            }
-        }
+        lol::msg::error("cannot open %s\n", src);
+        return false;
+    }
 
-        return best;
+    frame_reader reader(f);
+    bool ok = reader.open();
+
+    lol::ivec2 const size = reader.size();
+    if (ok && size != lol::ivec2(128))
+    {
+        lol::msg::error("frames must be 128×128, not %d×%d; scale them first, e.g. "
+                        "with “ffmpeg -vf scale=128:128”\n", size.x, size.y);
+        ok = false;
+    }
+
+    FILE *s = !ok ? nullptr : out ? fopen(out, "wb+") : stdout;
+    if (!s)
+    {
+        if (ok)
+            lol::msg::error("cannot open %s\n", out);
+        if (f != stdin)
+            fclose(f);
+        return false;
+    }
+
+    // Carrying error from one frame to the next requires frames to be
+    // dithered in order, so rows of each frame are dithered in parallel
+    // instead
+    bool const carry = opts.error_diffusion && opts.carry_error;
+    int const cores = lol::max(1, (int)std::thread::hardware_concurrency());
+    int const thread_count = carry ? 1 : cores;
+
+    auto kernel = opts.blue_noise ? lol::image::kernel::blue_noise(lol::ivec2(64))
+                                  : lol::image::kernel::bayer(lol::ivec2(32));
+    ditherer d(opts.hicolor, kernel);
+    if (!opts.error_diffusion)
+        d.quantize(thread_count);
+
+    // Frames are read, dithered and written through a ring of slots; the
+    // reader may not get more than ring.size() frames ahead of the writer
+    struct slot
+    {
+        std::vector<uint8_t> data, screen;
+        bool done = false;
     };
 
-    std::map<uint32_t, int[DEPTH]> luts;
+    std::vector<slot> ring(4 * thread_count);
+    std::atomic<int> next(0);
+    std::mutex mutex;
+    std::condition_variable cv;
+    int frames_read = 0, written = 0;
+    bool eof = false;
 
-    /* Dither image for first destination */
-    lol::array2d<lol::vec4> &curdata = im.lock2d<lol::PixelFormat::RGBA_F32>();
-    lol::array2d<lol::vec4> &dstdata = dst.lock2d<lol::PixelFormat::RGBA_F32>();
-    for (int j = 0; j < size.y; ++j)
+    lol::timer t;
+
+    std::thread reader_thread([&]()
     {
-        for (int i = 0; i < size.x; ++i)
+        for (int n = 0; ; ++n)
         {
-            lol::vec3 pixel = curdata[i][j].rgb;
-            uint8_t nearest = 0;
-
-            if (error_diffusion)
             {
-                nearest = closest(pixel);
-                auto error = lol::vec4(pixel - colors[nearest], 0.f) / 18.f;
-                if (i < size.x - 1)
-                    curdata[i + 1][j] += 7.f * error;
-                if (j < size.y - 1)
-                {
-                    if (i > 0)
-                        curdata[i - 1][j + 1] += 1.f * error;
-                    curdata[i][j + 1] += 5.f * error;
-                    if (i < size.x - 1)
-                        curdata[i + 1][j + 1] += 3.f * error;
-                }
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return n < written + (int)ring.size(); });
             }
-            else
-            {
-                uint32_t key = lol::dot(lol::ivec3(pixel * 255.99f), lol::ivec3(0x1, 0x100, 0x10000));
 
-                if (luts.find(key) == luts.end())
-                {
-                    // Dither pixel DEPTH times with error diffusion
-                    int buffer[DEPTH];
-                    auto candidate = pixel;
-                    for (int n = 0; n < DEPTH; ++n)
-                    {
-                        buffer[n] = closest(candidate);
-                        candidate = pixel + 7.f / 16 * (candidate - colors[buffer[n]]);
-                    }
+            bool ok = reader.read(ring[n % ring.size()].data);
 
-                    // Sort results by luminance
-                    std::sort(buffer, buffer + DEPTH, [& colors](int a, int b)
-                    {
-                        return lol::dot(colors[a] - colors[b], lol::vec3(1)) > 0;
-                    });
-                    memcpy(luts[key], buffer, sizeof(buffer));
-                }
-
-                // Pick the final color using a dithering kernel
-                int *found = luts[key];
-                nearest = found[(int)(kernel[i % kernel.size().x][j % kernel.size().y] * DEPTH)];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (ok)
+                    frames_read = n + 1;
+                else
+                    eof = true;
             }
+            cv.notify_all();
 
-            pixels.push_back(nearest);
+            if (!ok)
+                break;
         }
-    }
+    });
 
-    im.unlock2d(curdata);
-    dst.unlock2d(dstdata);
-
-#if 0
-    /* Save image */
-    //dst = dst.Resize(size * 4, ResampleAlgorithm::Bresenham);
-    dst.save(argv[4]);
-#endif
+    auto worker = [&]()
+    {
+        rgb_planes img;
+        img.resize(size);
+        std::vector<lol::vec3> carried(carry ? size.x * size.y : 0);
 
-    std::vector<uint8_t> rawdata;
-    rawdata.resize(hicolor ? pixels.size() : pixels.size() / 2);
-    for (int j = 0; j < size.y; ++j)
-        for (int i = 0; i < size.x; i += 2)
+        for (;;)
         {
-            uint8_t c1 = pixels[j * 128 + i];
-            uint8_t c2 = pixels[j * 128 + i + 1];
-            if (hicolor)
+            int n = next++;
+
             {
-                int d = (j + i / 2) & 1;
-                uint8_t a1 = c1 < 16 ? c1 : (indices[c1 - 16] << (4 * d) >> 4) & 0xf;
-                uint8_t a2 = c2 < 16 ? c2 : (indices[c2 - 16] << (4 * d) >> 4) & 0xf;
-                uint8_t b1 = c1 < 16 ? c1 : (indices[c1 - 16] >> (4 * d)) & 0xf;
-                uint8_t b2 = c2 < 16 ? c2 : (indices[c2 - 16] >> (4 * d)) & 0xf;
-                rawdata[j * 64 + i / 2] = a2 * 16 + a1;
-                rawdata[(j + size.x) * 64 + i / 2] = b2 * 16 + b1;
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return n < frames_read || eof; });
+                if (n >= frames_read)
+                    break;
             }
+
+            slot &sl = ring[n % ring.size()];
+            reader.convert(sl.data.data(), img);
+            sl.screen.assign(d.packed_size(size), 0);
+
+            if (!opts.error_diffusion)
+                d.ordered(img, sl.screen.data());
+            else if (!carry)
+                d.diffuse(img, sl.screen.data(), 1);
             else
             {
-                rawdata[j * 64 + i / 2] = c2 * 16 + c1;
+                // Add part of the previous frame’s error, which averages
+                // colours over time as well as over space
+                for (int j = 0; j < size.y; ++j)
+                    for (int i = 0; i < size.x; ++i)
+                        img.set(i, j, img.get(i, j) + 0.25f * carried[j * size.x + i]);
+                d.diffuse(img, sl.screen.data(), cores, carried.data());
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                sl.done = true;
             }
+            cv.notify_all();
         }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; ++i)
+        threads.push_back(std::thread(worker));
+
+    // Write screens in order
+    for (;;)
+    {
+        slot *sl;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            sl = &ring[written % ring.size()];
+            cv.wait(lock, [&]() { return sl->done || (eof && written >= frames_read); });
+            if (!sl->done)
+                break;
+        }
+
+        fwrite(sl->screen.data(), 1, sl->screen.size(), s);
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            sl->done = false;
+            ++written;
+        }
+        cv.notify_all();
+    }
+
+    reader_thread.join();
+    for (auto &th : threads)
+        th.join();
+
+    float const elapsed = t.get();
+    lol::msg::info("dithered %d frames in %.2f s (%.1f fps)\n", written, elapsed,
+                   written / lol::max(elapsed, 1e-6f));
 
-    /* Save data */
-    FILE *s = out ? fopen(out, "wb+") : stdout;
-    fwrite(rawdata.data(), 1, rawdata.size(), s);
     if (out)
         fclose(s);
+    if (f != stdin)
+        fclose(f);
+    return true;
 }
 
 } // namespace z8
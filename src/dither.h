@@ -19,5 +19,22 @@ namespace z8
 
 void dither(char const *src, char const *out, bool hicolor, bool error_diffusion);
 
+struct dither_options
+{
+    bool hicolor = false;
+    bool error_diffusion = false;
+    // Use a blue noise kernel instead of a Bayer matrix for ordered
+    // dithering, which flickers less when the picture moves
+    bool blue_noise = false;
+    // Carry part of each pixel’s error over to the next frame with error
+    // diffusion; frames are then dithered on a single thread
+    bool carry_error = false;
+};
+
+// Dither a stream of 128×128 frames, either raw RGB24 or YUV4MPEG2, read
+// from “src” or from stdin if “src” is “-”, and write one packed screen
+// per frame, or two in hicolor mode
+bool dither_video(char const *src, char const *out, dither_options const &opts);
+
 } // namespace z8
 
@@ -50,6 +50,18 @@ editor::~editor()
 void editor::render()
 {
     ImGui::Begin("cODE", nullptr);
+
+    // Only measure the code when it changed since the last frame
+    if (m_dirty || m_widget.IsTextChanged())
+        m_budget.analyze(m_widget.GetText());
+    m_dirty = false;
+
+    auto const &total = m_budget.get_total();
+    ImGui::Text("tokens %d/%d  chars %d/%d  compressed %d%%",
+                total.tokens, (int)budget::max_tokens,
+                total.chars, (int)budget::max_chars,
+                (int)(100.f * total.compressed / budget::max_compressed));
+
     m_widget.Render("Text Editor");
     ImGui::End();
 }
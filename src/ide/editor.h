@@ -16,6 +16,8 @@
 
 #include "3rdparty/imgui-color-text-edit/TextEditor.h"
 
+#include "budget.h"
+
 namespace z8
 {
 
@@ -29,6 +31,8 @@ public:
 
 private:
     TextEditor m_widget;
+    budget m_budget;
+    bool m_dirty = true;
 };
 
 } // namespace z8
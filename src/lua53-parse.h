@@ -422,6 +422,7 @@ namespace lua53
    // thought, because “else” is ignored. Found in cartridge 14948 at least.
    // It is implemented by making short_if_tail optional after “else”.
    struct not_at_if_then : pegtl::not_at< pegtl::seq< seps, expression, seps, key_then > > {};
+   struct short_if_cond : bracket_expr {};
 
    struct short_if_tail_two : pegtl::if_must< key_return, statement_return > {};
    struct short_if_tail_one : pegtl::seq< statement, seps,
@@ -431,7 +432,7 @@ namespace lua53
    struct short_if_body : pegtl::seq< short_if_tail, seps, pegtl::opt< key_else, seps, pegtl::opt< short_if_tail > > > {};
 
    struct short_if_statement : pegtl::seq< key_if, not_at_if_then,
-                                           one_line_seq< seps, pegtl::try_catch< bracket_expr >, seps, short_if_body > > {};
+                                           one_line_seq< seps, pegtl::try_catch< short_if_cond >, seps, short_if_body > > {};
 
    // Undocumented feature: if (...) do
    //
@@ -443,7 +444,7 @@ namespace lua53
    struct if_do_trail : key_do {};
    struct if_do_statement : pegtl::seq< key_if, not_at_if_then,
                                         // The “do” must be at end of line or at a comment
-                                        one_line_seq< seps, pegtl::try_catch< bracket_expr >, seps, if_do_trail, seps, pegtl::sor< pegtl::at< comment >, pegtl::eolf > >,
+                                        one_line_seq< seps, pegtl::try_catch< short_if_cond >, seps, if_do_trail, seps, pegtl::sor< pegtl::at< comment >, pegtl::eolf > >,
                                         // Same as the end of the actual “if” statement
                                         statement_list< at_elseif_else_end >, seps, pegtl::until< pegtl::sor< else_statement, key_end >, elseif_statement, seps > > {};
 
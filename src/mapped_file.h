@@ -0,0 +1,51 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The mapped_file class
+// —————————————————————
+// A read-only memory mapping of a whole file, unmapped on destruction.
+
+namespace z8
+{
+
+class mapped_file
+{
+public:
+    mapped_file() {}
+    ~mapped_file() { close(); }
+
+    mapped_file(mapped_file const &) = delete;
+    mapped_file &operator =(mapped_file const &) = delete;
+
+    // Map “filename”; empty files cannot be mapped and are reported as
+    // errors.
+    bool open(char const *filename);
+    void close();
+
+    inline uint8_t const *data() const { return m_data; }
+    inline size_t size() const { return m_size; }
+
+private:
+    uint8_t const *m_data = nullptr;
+    size_t m_size = 0;
+#if defined _WIN32
+    void *m_mapping = nullptr;
+#endif
+};
+
+} // namespace z8
+
@@ -36,6 +36,7 @@ struct note
     float volume() const;
     uint8_t effect() const;
     uint8_t instrument() const;
+    bool custom() const;
 
     inline uint8_t &operator[](int n)
     {
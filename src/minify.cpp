@@ -1,7 +1,7 @@
 //
 //  ZEPTO-8 — Fantasy console emulator
 //
-//  Copyright © 2016—2018 Sam Hocevar <sam@hocevar.net>
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
 //
 //  This program is free software. It comes without any warranty, to
 //  the extent permitted by applicable law. You can redistribute it
@@ -14,83 +14,525 @@
 #   include "config.h"
 #endif
 
+#include <lol/engine.h>
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
-#include <iostream>
-#include <streambuf>
+#include <cctype>
 #include <cstdint>
-#include <cstdlib>
-#include <regex>
+#include <cstring>
 
 #include "minify.h"
+#include "tokenizer.h"
+
+using lol::msg;
 
 namespace z8
 {
 
+namespace
+{
+
+inline bool is_word(token const &t)
+{
+    return t.kind == token_kind::name || t.kind == token_kind::keyword
+            || t.kind == token_kind::number;
+}
+
+// Whether an expression may end with this token
+bool ends_operand(token const &t)
+{
+    switch (t.kind)
+    {
+    case token_kind::name:
+    case token_kind::number:
+    case token_kind::string:
+        return true;
+    case token_kind::keyword:
+        return t.text == "nil" || t.text == "true" || t.text == "false" || t.text == "end";
+    case token_kind::symbol:
+        return t.text == ")" || t.text == "]" || t.text == "}" || t.text == "...";
+    default:
+        return false;
+    }
+}
+
+// Whether this token, after an operand, still belongs to the same
+// expression. When in doubt, say yes: this only delays the moment
+// local variables come into scope.
+bool continues(token const &t)
+{
+    switch (t.kind)
+    {
+    case token_kind::string:
+        return true;
+    case token_kind::keyword:
+        return t.text == "and" || t.text == "or";
+    case token_kind::symbol:
+        return t.text != ";" && t.text != "::" && t.text != "?";
+    default:
+        return false;
+    }
+}
+
+// Two tokens need a space between them if they would otherwise be read
+// as a single token, a different operator, or a comment.
+bool needs_space(token const &a, token const &b)
+{
+    if (is_word(a) && is_word(b))
+        return true;
+    if (a.kind == token_kind::number && b.text[0] == '.')
+        return true;
+    if (is_word(a) || is_word(b))
+        return false;
+
+    char const last = a.text.back(), first = b.text[0];
+    if (last == first && strchr("-/.:<>=[^~", first))
+        return true;
+    return a.kind == token_kind::symbol && first == '=' && !strchr(")]}", last);
+}
+
+// Shortest names first, skipping keywords
+std::string short_name(size_t n)
+{
+    static char const *first = "abcdefghijklmnopqrstuvwxyz_";
+    static char const *other = "abcdefghijklmnopqrstuvwxyz_0123456789";
+
+    size_t len = 1, count = 27;
+    for (; n >= count; count *= 37, ++len)
+        n -= count;
+
+    std::string ret(1, first[n % 27]);
+    for (n /= 27; ret.length() < len; n /= 37)
+        ret += other[n % 37];
+    return ret;
+}
+
+bool is_keyword(std::string const &s)
+{
+    static std::unordered_set<std::string> const keywords =
+    {
+        "and", "break", "do", "else", "elseif", "end", "false", "for",
+        "function", "goto", "if", "in", "local", "nil", "not", "or",
+        "repeat", "return", "then", "true", "until", "while",
+    };
+    return keywords.count(s) > 0;
+}
+
+// If the input is a .p8 cart, only keep its __lua__ section
+std::string lua_section(std::string const &input)
+{
+    if (input.compare(0, 16, "pico-8 cartridge") != 0)
+        return input;
+
+    std::string ret;
+    bool in_lua = false;
+    for (size_t start = 0, end; start < input.length(); start = end + 1)
+    {
+        end = input.find('\n', start);
+        if (end == std::string::npos)
+            end = input.length();
+
+        size_t len = end - start;
+        if (len && input[start + len - 1] == '\r')
+            --len;
+
+        bool is_section = len >= 5 && input.compare(start, 2, "__") == 0
+                           && input.compare(start + len - 2, 2, "__") == 0;
+        for (size_t i = start + 2; is_section && i < start + len - 2; ++i)
+            is_section = isalnum((uint8_t)input[i]) != 0;
+
+        if (is_section)
+            in_lua = input.compare(start, len, "__lua__") == 0;
+        else if (in_lua)
+            ret.append(input, start, end - start).append("\n");
+    }
+
+    return ret;
+}
+
+//
+// Scope analysis
+//
+
+enum class frame_kind : uint8_t
+{
+    block,    // do…end, then…end, loop and function bodies
+    short_if, // PICO-8 one-line if, which ends with its line
+    header,   // if, while or for statement, before “then” or “do”
+    repeat,   // repeat…until
+    bracket,  // (), [] and {}
+};
+
+struct frame
+{
+    frame_kind kind;
+    char close;
+    size_t line;
+    std::vector<std::string> names;     // locals declared in this scope
+    std::vector<std::string> loop_vars; // for headers: variables of the loop
+};
+
+// A “local” statement: its variables only come into scope once the
+// expression list is over.
+struct pending_local
+{
+    size_t depth, start;
+    bool after_operand;
+    std::vector<std::string> names;
+};
+
+// Rename local variables so that the most used ones get the shortest
+// names. Names are replaced consistently across the whole program, so
+// only names that are never used as globals are renamed; this keeps the
+// analysis simple and linear, since shadowing is preserved as long as
+// new names are unique and do not clash with the remaining ones. Any
+// doubt about scopes leads to fewer renamed names, never to wrong ones.
+void rename_locals(std::vector<token> &tokens, std::unordered_set<std::string> const &keep)
+{
+    size_t const n = tokens.size();
+
+    // Match brackets first, since short if statements need lookahead
+    std::vector<size_t> match(n, n), stack;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (tokens[i].kind != token_kind::symbol)
+            continue;
+        char const ch = tokens[i].text[0];
+        if (tokens[i].text.length() == 1 && strchr("([{", ch))
+            stack.push_back(i);
+        else if (tokens[i].text.length() == 1 && strchr(")]}", ch))
+        {
+            if (stack.empty())
+                return;
+            match[stack.back()] = i;
+            stack.pop_back();
+        }
+    }
+    if (!stack.empty())
+        return;
+
+    std::vector<frame> frames(1, frame{ frame_kind::block, 0, 0, {}, {} });
+    std::vector<pending_local> pending;
+    std::unordered_map<std::string, int> active;
+    std::unordered_map<std::string, size_t> uses;
+    std::unordered_set<std::string> globals;
+    std::vector<bool> variable(n, false), declaration(n, false);
+    bool in_function = false, in_params = false;
+    size_t if_do = n;
+
+    auto declare = [&](std::string const &name)
+    {
+        frames.back().names.push_back(name);
+        ++active[name];
+    };
+
+    auto push = [&](frame_kind kind, char close = 0, size_t line = 0)
+    {
+        frames.push_back(frame{ kind, close, line, {}, {} });
+    };
+
+    auto pop = [&]()
+    {
+        for (auto const &name : frames.back().names)
+            --active[name];
+        frames.pop_back();
+        while (!pending.empty() && pending.back().depth > frames.size())
+            pending.pop_back();
+    };
+
+    // Collect a comma-separated list of names starting at i, and return
+    // the index of the last one
+    auto name_list = [&](size_t i, std::vector<std::string> &names)
+    {
+        size_t last = i;
+        for (; i < n && tokens[i].kind == token_kind::name; i += 2)
+        {
+            names.push_back(tokens[i].text);
+            declaration[i] = true;
+            last = i;
+            if (i + 1 >= n || !tokens[i + 1].is(token_kind::symbol, ","))
+                break;
+        }
+        return last;
+    };
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        token const &t = tokens[i];
+
+        // One-line if statements end with their line, or at the end of
+        // the enclosing block
+        while (frames.back().kind == frame_kind::short_if
+                && (t.line != frames.back().line || t.is(token_kind::keyword, "end")
+                     || t.is(token_kind::keyword, "elseif") || t.is(token_kind::keyword, "until")))
+            pop();
+
+        // Pending locals come into scope when their statement is over
+        if (!pending.empty() && pending.back().depth == frames.size()
+             && i > pending.back().start && pending.back().after_operand && !continues(t))
+        {
+            for (auto const &name : pending.back().names)
+                declare(name);
+            pending.pop_back();
+        }
+
+        auto &top = frames.back();
+
+        if (t.kind == token_kind::keyword)
+        {
+            if (t.text == "local")
+            {
+                if (i + 2 < n && tokens[i + 1].is(token_kind::keyword, "function")
+                     && tokens[i + 2].kind == token_kind::name)
+                {
+                    declare(tokens[i + 2].text);
+                    declaration[i + 2] = true;
+                }
+                else
+                {
+                    std::vector<std::string> names;
+                    size_t const last = name_list(i + 1, names);
+                    if (names.size())
+                        pending.push_back(pending_local{ frames.size(), last, true, names });
+                }
+            }
+            else if (t.text == "function")
+                in_function = true;
+            else if (t.text == "if")
+            {
+                // “if (…) stmt” is a one-line if unless the parentheses
+                // are followed by “then” or by more of the condition
+                size_t const k = i + 1 < n && tokens[i + 1].is(token_kind::symbol, "(")
+                               ? match[i + 1] + 1 : n;
+                if (k >= n || tokens[k].is(token_kind::keyword, "then") || continues(tokens[k]))
+                    push(frame_kind::header);
+                else if (tokens[k].is(token_kind::keyword, "do"))
+                {
+                    push(frame_kind::block);
+                    if_do = k;
+                }
+                else
+                    push(frame_kind::short_if, 0, tokens[k].line);
+            }
+            else if (t.text == "while")
+                push(frame_kind::header);
+            else if (t.text == "for")
+            {
+                push(frame_kind::header);
+                name_list(i + 1, frames.back().loop_vars);
+            }
+            else if (t.text == "then" || (t.text == "do" && i != if_do && top.kind == frame_kind::header))
+            {
+                if (top.kind != frame_kind::header)
+                    return;
+                top.kind = frame_kind::block;
+                auto const vars = std::move(top.loop_vars);
+                for (auto const &name : vars)
+                    declare(name);
+            }
+            else if (t.text == "do" && i != if_do)
+                push(frame_kind::block);
+            else if (t.text == "elseif" || t.text == "else")
+            {
+                if (frames.size() < 2 || (top.kind != frame_kind::block && top.kind != frame_kind::short_if))
+                    return;
+                auto const kind = t.text == "else" ? top.kind : frame_kind::header;
+                auto const line = top.line;
+                pop();
+                push(kind, 0, line);
+            }
+            else if (t.text == "repeat")
+                push(frame_kind::repeat);
+            else if (t.text == "until" || t.text == "end")
+            {
+                if (frames.size() < 2 || top.kind != (t.text == "end" ? frame_kind::block : frame_kind::repeat))
+                    return;
+                pop();
+            }
+        }
+        else if (t.kind == token_kind::symbol)
+        {
+            if (t.text == "(" && in_function)
+            {
+                in_function = false;
+                in_params = true;
+                push(frame_kind::block);
+            }
+            else if (t.text == ")" && in_params)
+                in_params = false;
+            else if (t.text == "(" || t.text == "[" || t.text == "{")
+                push(frame_kind::bracket, t.text == "(" ? ')' : t.text == "[" ? ']' : '}');
+            else if (t.text == ")" || t.text == "]" || t.text == "}")
+            {
+                if (top.kind != frame_kind::bracket || top.close != t.text[0])
+                    return;
+                pop();
+            }
+        }
+        else if (t.kind == token_kind::name)
+        {
+            token const *prev = i > 0 ? &tokens[i - 1] : nullptr;
+            token const *next = i + 1 < n ? &tokens[i + 1] : nullptr;
+
+            if (in_params)
+            {
+                declare(t.text);
+                declaration[i] = true;
+            }
+
+            if (declaration[i])
+                variable[i] = true;
+            else if (prev && (prev->is(token_kind::symbol, ".") || prev->is(token_kind::symbol, ":")
+                               || prev->is(token_kind::symbol, "::") || prev->is(token_kind::keyword, "goto")))
+                ; // Field, method or label name
+            else if (top.kind == frame_kind::bracket && top.close == '}' && prev && next
+                      && (prev->is(token_kind::symbol, "{") || prev->is(token_kind::symbol, ",")
+                           || prev->is(token_kind::symbol, ";"))
+                      && next->is(token_kind::symbol, "="))
+                ; // Table constructor key
+            else if (active[t.text] > 0)
+                variable[i] = true;
+            else
+                globals.insert(t.text);
+
+            if (variable[i])
+                ++uses[t.text];
+        }
+
+        if (!pending.empty() && pending.back().depth == frames.size())
+            pending.back().after_operand = ends_operand(t);
+    }
+
+    while (frames.back().kind == frame_kind::short_if)
+        pop();
+    if (frames.size() != 1)
+        return;
+
+    // Most used names first
+    std::vector<std::pair<size_t, std::string>> order;
+    for (auto const &u : uses)
+        if (!globals.count(u.first) && !keep.count(u.first) && u.first != "self")
+            order.push_back(std::make_pair(u.second, u.first));
+    std::sort(order.begin(), order.end(), [](std::pair<size_t, std::string> const &a,
+                                             std::pair<size_t, std::string> const &b)
+    {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+
+    std::unordered_map<std::string, std::string> renames;
+    size_t counter = 0;
+    for (auto const &o : order)
+    {
+        std::string name;
+        do
+            name = short_name(counter++);
+        while (is_keyword(name) || globals.count(name) || keep.count(name) || name == "self");
+        renames[o.second] = name;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (!variable[i])
+            continue;
+        auto r = renames.find(tokens[i].text);
+        if (r != renames.end())
+            tokens[i].text = r->second;
+    }
+}
+
+} // anonymous namespace
+
 std::string minify(std::string const &input)
 {
-    std::regex re_spaces(" +");
-
-    // Split input into lines
-    std::vector<std::string> lines;
-    std::regex re_crlf("\r*\n");
-    std::copy(std::sregex_token_iterator(input.begin(), input.end(), re_crlf, -1),
-              std::sregex_token_iterator(),
-              std::back_inserter(lines));
-
-    // Skip first three lines (they’re the PICO-8 cart header)
-    lines.erase(lines.begin(), lines.begin() + 3);
-
-    std::vector<std::tuple<std::string, std::string>> replaces;
-    std::string result;
-
-    // Process each line
-    for (auto & line : lines)
-    {
-        // Parse special comments indicating possible replacements
-        static std::regex re_replaces("^(.*--.*replaces: |.*)");
-        static std::regex re_replace_pair(" *([^ ]+) *([^ ]+) *");
-        std::vector<std::string> replaces_list;
-        auto tmp = std::regex_replace(line, re_replaces, "");
-        std::copy(std::sregex_token_iterator(tmp.begin(), tmp.end(), re_spaces, -1),
-                  std::sregex_token_iterator(),
-                  std::back_inserter(replaces_list));
-        for (size_t i = 0; i + 1 < replaces_list.size(); i += 2)
-            replaces.push_back(std::make_tuple(replaces_list[i], replaces_list[i + 1]));
-
-        // Strip comments; if comment starts with "debug" then whole line is stripped
-        static std::regex re_comment("(^.*-- *debug| *--).*");
-        line = std::regex_replace(line, re_comment, "");
-
-        // Ignore empty lines
-        static std::regex re_empty("^ *$");
-        if (std::regex_match(line, re_empty))
+    std::vector<token> tokens;
+    std::string error;
+    if (!tokenize(lua_section(input), tokens, &error))
+    {
+        msg::error("cannot minify code: %s\n", error.c_str());
+        return input;
+    }
+
+    // Special comments: “-- debug” removes the whole line, and
+    // “-- replaces: old new…” renames identifiers
+    std::unordered_set<size_t> debug_lines;
+    std::unordered_map<std::string, std::string> replaces;
+    std::unordered_set<std::string> keep;
+    for (auto const &t : tokens)
+    {
+        if (t.kind != token_kind::comment)
             continue;
 
-        // Protect lines that contain +=, -= etc.
-        static std::regex re_compound(".*[-+*/%]=.*");
-        line = std::regex_replace(line, re_compound, "X $0 X");
+        size_t const start = t.text.find_first_not_of(' ', 2);
+        if (start != std::string::npos && t.text.compare(start, 5, "debug") == 0)
+            debug_lines.insert(t.line);
 
-        result += result.empty() ? line : " " + line;
+        size_t const pos = t.text.find("replaces: ");
+        if (pos != std::string::npos)
+        {
+            std::istringstream list(t.text.substr(pos + 10));
+            for (std::string from, to; list >> from >> to; )
+            {
+                replaces[from] = to;
+                keep.insert(to);
+            }
+        }
     }
 
-    // Rename all variables according to our rules
-    for (auto & rep : replaces)
-        result = std::regex_replace(result, std::regex("([^a-z_])(" + std::get<0>(rep) + ")([^a-z0-9_])"), "$1" + std::get<1>(rep) + "$3");
+    tokens.erase(std::remove_if(tokens.begin(), tokens.end(), [&](token const &t)
+    {
+        return t.kind == token_kind::comment || debug_lines.count(t.line);
+    }), tokens.end());
 
-    // Strip multiple spaces
-    result = std::regex_replace(result, re_spaces, " ");
+    for (auto &t : tokens)
+    {
+        auto r = t.kind == token_kind::name ? replaces.find(t.text) : replaces.end();
+        if (r != replaces.end())
+            t.text = r->second;
+    }
 
-    // Exploit Lua parsing rules
-    result = std::regex_replace(result, std::regex("0 ([g-wyz])"), "0$1");
-    result = std::regex_replace(result, std::regex("([1-9]) ([g-z])"), "$1$2");
+    // Lines with PICO-8 shorthand (one-line if, compound assignment,
+    // short print) must keep their line breaks
+    std::vector<bool> sensitive(tokens.empty() ? 0 : tokens.back().line + 1, false);
+    std::unordered_map<size_t, int> open_ifs;
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        token const &t = tokens[i];
+        if (t.kind == token_kind::keyword && (t.text == "if" || t.text == "elseif" || t.text == "then"))
+            open_ifs[t.line] += t.text == "then" ? -1 : 1;
+        else if (t.is(token_kind::symbol, "?") || t.is(token_kind::symbol, "+=")
+                  || t.is(token_kind::symbol, "-=") || t.is(token_kind::symbol, "*=")
+                  || t.is(token_kind::symbol, "/=") || t.is(token_kind::symbol, "%="))
+            sensitive[t.line] = true;
+        else if (t.is(token_kind::symbol, "=") && i > 0 && tokens[i - 1].kind == token_kind::symbol
+                  && strchr(")]}", tokens[i - 1].text[0]) == nullptr)
+            sensitive[t.line] = true;
+    }
+    for (auto const &o : open_ifs)
+        if (o.second > 0)
+            sensitive[o.first] = true;
 
-    // Unprotect lines protected with X
-    result = std::regex_replace(result, std::regex(" *X[ X]*"), " ");
+    rename_locals(tokens, keep);
 
-    // Remove spaces before and after symbols
-    result = std::regex_replace(result, std::regex(" *([[\\]<>(){}#+*%^/=:!~,-]) *"), "$1");
+    std::string ret;
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        if (i > 0)
+        {
+            token const &a = tokens[i - 1], &b = tokens[i];
+            if (a.line != b.line && (sensitive[a.line] || sensitive[b.line]))
+                ret += '\n';
+            else if (needs_space(a, b))
+                ret += ' ';
+        }
+        ret += tokens[i].text;
+    }
 
-    return result;
+    return ret;
 }
 
 } // namespace z8
@@ -12,9 +12,15 @@
 
 #pragma once
 
+#include <string>
+
 namespace z8
 {
 
+// Minify Lua code, or the code section of a .p8 cart: comments and
+// whitespace are stripped, lines are only kept where PICO-8 shorthand
+// syntax needs them, and local variables are renamed so that the most
+// used ones get the shortest names.
 std::string minify(std::string const &input);
 
 } // namespace z8
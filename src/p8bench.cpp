@@ -0,0 +1,453 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include "tao/pegtl.hpp"
+
+#include <map>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "zepto8.h"
+#include "cart.h"
+#include "p8bench.h"
+#include "pxa.h"
+
+namespace z8
+{
+
+using lol::msg;
+
+using namespace tao;
+
+//
+// The former PEGTL-based .p8 parser, kept as a reference
+//
+
+struct p8_reader
+{
+    //
+    // Grammar rules
+    //
+
+    struct r_lua : TAOCPP_PEGTL_STRING("__lua__") {};
+    struct r_gfx : TAOCPP_PEGTL_STRING("__gfx__") {};
+    struct r_gff : TAOCPP_PEGTL_STRING("__gff__") {};
+    struct r_map : TAOCPP_PEGTL_STRING("__map__") {};
+    struct r_sfx : TAOCPP_PEGTL_STRING("__sfx__") {};
+    struct r_mus : TAOCPP_PEGTL_STRING("__music__") {};
+    struct r_lab : TAOCPP_PEGTL_STRING("__label__") {};
+    struct r_any : pegtl::seq<pegtl::two<'_'>, pegtl::plus<pegtl::alnum>, pegtl::two<'_'>> {};
+
+    struct r_section_name : pegtl::sor<r_lua,
+                                       r_gfx,
+                                       r_gff,
+                                       r_map,
+                                       r_sfx,
+                                       r_mus,
+                                       r_lab,
+                                       r_any> {};
+    struct r_section_line : pegtl::seq<r_section_name, pegtl::eolf> {};
+
+    struct r_data_line : pegtl::until<pegtl::eolf> {};
+    struct r_data : pegtl::star<pegtl::not_at<r_section_line>,
+                                pegtl::not_at<pegtl::eof>,
+                                r_data_line> {};
+
+    struct r_section : pegtl::seq<r_section_line, r_data> {};
+    struct r_version : pegtl::star<pegtl::digit> {};
+
+    struct r_header: pegtl::seq<TAOCPP_PEGTL_STRING("pico-8 cartridge"), pegtl::until<pegtl::eol>,
+                                TAOCPP_PEGTL_STRING("version "), r_version, pegtl::until<pegtl::eol>> {};
+    struct r_file : pegtl::seq<pegtl::opt<pegtl::utf8::bom>,
+                               r_header,
+                               r_data, /* data before the first section is ignored */
+                               pegtl::star<r_section>,
+                               pegtl::eof> {};
+
+    //
+    // Grammar actions
+    //
+
+    template<typename R>
+    struct action : pegtl::nothing<R> {};
+
+    //
+    // Parser state
+    //
+
+    int m_version = -1;
+
+    enum class section : int8_t
+    {
+        error = -1,
+        header = 0,
+        lua,
+        gfx,
+        gff,
+        map,
+        sfx,
+        mus,
+        lab,
+    };
+
+    section m_current_section;
+    std::map<int8_t, std::vector<uint8_t>> m_sections;
+    std::string m_code;
+
+    //
+    // Actual reader
+    //
+
+    void parse(std::string const &str)
+    {
+        pegtl::string_input<> in(str, "p8");
+        pegtl::parse<r_file, action>(in, *this);
+    }
+};
+
+template<>
+struct p8_reader::action<p8_reader::r_version>
+{
+    template<typename Input>
+    static void apply(Input const &in, p8_reader &r)
+    {
+        r.m_version = std::atoi(in.string().c_str());
+    }
+};
+
+template<>
+struct p8_reader::action<p8_reader::r_section_name>
+{
+    template<typename Input>
+    static void apply(Input const &in, p8_reader &r)
+    {
+        if (in.string().find("lua") != std::string::npos)
+            r.m_current_section = section::lua;
+        else if (in.string().find("gfx") != std::string::npos)
+            r.m_current_section = section::gfx;
+        else if (in.string().find("gff") != std::string::npos)
+            r.m_current_section = section::gff;
+        else if (in.string().find("map") != std::string::npos)
+            r.m_current_section = section::map;
+        else if (in.string().find("sfx") != std::string::npos)
+            r.m_current_section = section::sfx;
+        else if (in.string().find("music") != std::string::npos)
+            r.m_current_section = section::mus;
+        else if (in.string().find("label") != std::string::npos)
+            r.m_current_section = section::lab;
+        else
+        {
+            msg::info("unknown section name %s\n", in.string().c_str());
+            r.m_current_section = section::error;
+        }
+    }
+};
+
+template<>
+struct p8_reader::action<p8_reader::r_data>
+{
+    template<typename Input>
+    static void apply(Input const &in, p8_reader &r)
+    {
+        if (r.m_current_section == section::lua)
+        {
+            // Copy the code verbatim
+            r.m_code += in.string();
+        }
+        else
+        {
+            bool must_swap = r.m_current_section == section::gfx
+                          || r.m_current_section == section::lab;
+
+            // Decode hexadecimal data from this section
+            auto &section = r.m_sections[(int8_t)r.m_current_section];
+            for (uint8_t const *parser = (uint8_t const *)in.begin(); parser < (uint8_t const *)in.end(); ++parser)
+            {
+                if ((parser[0] >= 'a' && parser[0] <= 'f')
+                     || (parser[0] >= 'A' && parser[0] <= 'F')
+                     || (parser[0] >= '0' && parser[0] <= '9'))
+                {
+                    char str[3] = { (char)parser[must_swap ? 1 : 0],
+                                    (char)parser[must_swap ? 0 : 1], '\0' };
+                    section.push_back((uint8_t)strtoul(str, nullptr, 16));
+                    ++parser;
+                }
+            }
+        }
+    }
+};
+
+struct replacement
+{
+    replacement(char const *re, char const *str)
+      : m_re(re),
+        m_str(str)
+    {}
+
+    std::string replace(std::string const &str) const
+    {
+        return std::regex_replace(str, m_re, m_str);
+    }
+
+private:
+    std::regex m_re;
+    char const *m_str;
+};
+
+static bool legacy_parse_p8(std::string const &s, memory &rom,
+                            std::string &code, std::vector<uint8_t> &label)
+{
+    p8_reader reader;
+    reader.parse(s.c_str());
+
+    if (reader.m_version < 0)
+        return false;
+
+    code = reader.m_code;
+
+    // PICO-8 saves some symbols in the .p8 file as Emoji/Unicode characters
+    // but the runtime expects characters \x80 — \x99 instead.
+    static replacement const replaces[] =
+    {
+        { "█", "\x80" }, { "▒", "\x81" }, { "🐱", "\x82" }, { "⬇️", "\x83" },
+        { "░", "\x84" }, { "✽", "\x85" }, { "●", "\x86" }, { "♥", "\x87" },
+        { "☉", "\x88" }, { "웃", "\x89" }, { "⌂", "\x8a" }, { "⬅️", "\x8b" },
+        { "😐", "\x8c" }, { "♪", "\x8d" }, { "🅾️", "\x8e" }, { "◆", "\x8f" },
+        { "…", "\x90" }, { "➡️", "\x91" }, { "★", "\x92" }, { "⧗", "\x93" },
+        { "⬆️", "\x94" }, { "ˇ", "\x95" }, { "∧", "\x96" }, { "❎", "\x97" },
+        { "▤", "\x98" }, { "▥", "\x99" },
+    };
+
+    for (size_t i = 0; i < sizeof(replaces) / sizeof(*replaces); ++i)
+        code = replaces[i].replace(code);
+
+    memset(&rom, 0, sizeof(rom));
+
+    auto const &gfx = reader.m_sections[(int8_t)p8_reader::section::gfx];
+    auto const &gff = reader.m_sections[(int8_t)p8_reader::section::gff];
+    auto const &map = reader.m_sections[(int8_t)p8_reader::section::map];
+    auto const &sfx = reader.m_sections[(int8_t)p8_reader::section::sfx];
+    auto const &mus = reader.m_sections[(int8_t)p8_reader::section::mus];
+    auto const &lab = reader.m_sections[(int8_t)p8_reader::section::lab];
+
+    msg::debug("version: %d code: %d gfx: %d/%d gff: %d/%d map: %d/%d "
+               "sfx: %d/%d mus: %d/%d lab: %d/%d\n",
+               reader.m_version, (int)code.length(),
+               (int)gfx.size(), (int)sizeof(rom.gfx),
+               (int)gff.size(), (int)sizeof(rom.gfx_props),
+               (int)map.size(), (int)(sizeof(rom.map) + sizeof(rom.map2)),
+               (int)sfx.size() / (4 + 80) * (4 + 64), (int)sizeof(rom.sfx),
+               (int)mus.size() / 5 * 4, (int)sizeof(rom.song),
+               (int)lab.size(), LABEL_WIDTH * LABEL_HEIGHT / 2);
+
+    // The optional second chunk of gfx is contiguous, we can copy it directly
+    memcpy(&rom.gfx, gfx.data(), lol::min(sizeof(rom.gfx), gfx.size()));
+
+    memcpy(&rom.gfx_props, gff.data(), lol::min(sizeof(rom.gfx_props), gff.size()));
+
+    // Map data + optional second chunk
+    memcpy(&rom.map, map.data(), lol::min(sizeof(rom.map), map.size()));
+    if (map.size() > sizeof(rom.map))
+    {
+        int map2_count = lol::min(sizeof(rom.map2),
+                                  map.size() - sizeof(rom.map));
+        // Use binary OR because some old versions of PICO-8 would store
+        // a full gfx+gfx2 section AND a full map+map2 section, so we cannot
+        // really decide which one is relevant.
+        for (int i = 0; i < map2_count; ++i)
+            rom.map2[i] |= map[sizeof(rom.map) + i];
+    }
+
+    // Song data is encoded slightly differently
+    size_t song_count = lol::min(sizeof(rom.song) / 4,
+                                 mus.size() / 5);
+    for (size_t i = 0; i < song_count; ++i)
+    {
+        rom.song[i].data[0] = mus[i * 5 + 1] | ((mus[i * 5] << 7) & 0x80);
+        rom.song[i].data[1] = mus[i * 5 + 2] | ((mus[i * 5] << 6) & 0x80);
+        rom.song[i].data[2] = mus[i * 5 + 3] | ((mus[i * 5] << 5) & 0x80);
+        rom.song[i].data[3] = mus[i * 5 + 4] | ((mus[i * 5] << 4) & 0x80);
+    }
+
+    // SFX data is packed
+    size_t sfx_count = lol::min(sizeof(rom.sfx) / (4 + 32 * 2),
+                                sfx.size() / (4 + 32 * 5 / 2));
+    for (size_t i = 0; i < sfx_count; ++i)
+    {
+        for (int j = 0; j < 32; ++j)
+        {
+            uint32_t ins = (sfx[4 + i * (4 + 80) + j * 5 / 2 + 0] << 16)
+                         | (sfx[4 + i * (4 + 80) + j * 5 / 2 + 1] << 8)
+                         | (sfx[4 + i * (4 + 80) + j * 5 / 2 + 2]);
+            // We read unaligned data; must realign it if j is odd
+            ins = (j & 1) ? ins & 0xfffff : ins >> 4;
+
+            uint16_t dst = ((ins & 0x3f000) >> 4)  // pitch
+                         | ((ins & 0x00400) >> 10) // instrument (part 1)
+                         | ((ins & 0x00300) << 6)  // instrument (part 2)
+                         | ((ins & 0x00070) >> 3)  // volume
+                         | ((ins & 0x00007) << 4)  // effect
+                         // SFX instrument flag: bit 3 of the instrument
+                         // nybble, or of the effect nybble in older exports
+                         | ((ins & 0x00808) ? 0x80 : 0);
+
+            rom.sfx[i].notes[j][0] = dst >> 8;
+            rom.sfx[i].notes[j][1] = dst & 0x00ff;
+        }
+
+        rom.sfx[i].editor_mode = sfx[i * (4 + 32 * 5 / 2) + 0];
+        rom.sfx[i].speed       = sfx[i * (4 + 32 * 5 / 2) + 1];
+        rom.sfx[i].loop_start  = sfx[i * (4 + 32 * 5 / 2) + 2];
+        rom.sfx[i].loop_end    = sfx[i * (4 + 32 * 5 / 2) + 3];
+    }
+
+    // Optional cartridge label
+    label.resize(lol::min(lab.size(), size_t(LABEL_WIDTH * LABEL_HEIGHT / 2)));
+    memcpy(label.data(), lab.data(), label.size());
+
+    return true;
+}
+
+// Time “f” over enough iterations to get a stable measurement, and
+// return the average time per call in seconds
+template<typename T>
+static float measure(T const &f)
+{
+    lol::timer t;
+    float elapsed = 0.f;
+    int count = 0;
+    while (elapsed < 0.25f || count < 3)
+    {
+        f();
+        ++count;
+        elapsed += t.get();
+    }
+    return elapsed / count;
+}
+
+int p8bench(std::vector<char const *> const &carts)
+{
+    int failures = 0;
+    size_t total_bytes = 0, total_export = 0;
+    float total_new = 0.f, total_old = 0.f, total_write = 0.f;
+
+    printf("%-24s %8s %10s %10s %8s %12s\n", "cart", "bytes", "new (µs)", "old (µs)",
+           "speedup", "export (µs)");
+
+    for (char const *name : carts)
+    {
+        std::string s;
+        lol::File f;
+        f.Open(name, lol::FileAccess::Read);
+        if (f.IsValid())
+        {
+            s = f.ReadString();
+            f.Close();
+        }
+
+        if (s.empty())
+        {
+            msg::error("cannot read %s\n", name);
+            ++failures;
+            continue;
+        }
+
+        cart c;
+        memory rom;
+        std::string code;
+        std::vector<uint8_t> label;
+
+        float const t_new = measure([&]() { c.parse_p8(s.c_str(), s.length()); });
+        float const t_old = measure([&]() { legacy_parse_p8(s, rom, code, label); });
+
+        // Both parsers must agree on everything they decode
+        bool const same = memcmp(&c.get_rom(), &rom, offsetof(memory, code)) == 0
+                       && c.get_code() == code && c.get_label() == label;
+        if (!same)
+            ++failures;
+
+        // Serialising back to .p8
+        std::string p8;
+        float const t_write = measure([&]() { p8 = c.get_p8(); });
+
+        total_bytes += s.length();
+        total_export += p8.length();
+        total_new += t_new;
+        total_old += t_old;
+        total_write += t_write;
+
+        std::string base = name;
+        base = base.substr(base.find_last_of("/\\") + 1);
+        printf("%-24s %8d %10.1f %10.1f %7.1f× %12.1f%s\n", base.c_str(), (int)s.length(),
+               t_new * 1e6f, t_old * 1e6f, t_old / lol::max(t_new, 1e-9f),
+               t_write * 1e6f, same ? "" : "  MISMATCH");
+    }
+
+    printf("throughput: new %.1f MiB/s, old %.1f MiB/s, export %.1f MiB/s\n",
+           total_bytes / lol::max(total_new, 1e-9f) / 1048576.f,
+           total_bytes / lol::max(total_old, 1e-9f) / 1048576.f,
+           total_export / lol::max(total_write, 1e-9f) / 1048576.f);
+
+    return failures;
+}
+
+int codebench(std::vector<char const *> const &carts)
+{
+    int failures = 0;
+
+    printf("%-24s %8s  %-23s  %-23s\n", "", "", "legacy :c: format", "PXA format");
+    printf("%-24s %8s  %8s %6s %7s  %8s %6s %7s\n", "cart", "code",
+           "packed", "ratio", "ms", "packed", "ratio", "ms");
+
+    for (char const *name : carts)
+    {
+        cart c;
+        if (!c.load(name))
+        {
+            msg::error("cannot load %s\n", name);
+            ++failures;
+            continue;
+        }
+
+        std::string const &code = c.get_code();
+        std::vector<uint8_t> legacy, pxa;
+        float const t_legacy = measure([&]() { legacy = c.get_compressed_code(); });
+        float const t_pxa = measure([&]() { pxa = pxa_compress(code); });
+
+        // The compressed code must decompress to the original
+        std::string tmp;
+        bool const same = cart::decompress_code(legacy.data(), legacy.size(),
+                                                (int)code.length()) == code
+                       && pxa_decompress(pxa.data(), pxa.size(), tmp) && tmp == code;
+        if (!same)
+            ++failures;
+
+        std::string base = name;
+        base = base.substr(base.find_last_of("/\\") + 1);
+        float const len = (float)lol::max(1, (int)code.length());
+        printf("%-24s %8d  %8d %5.1f%% %7.2f  %8d %5.1f%% %7.2f%s\n", base.c_str(),
+               (int)code.length(), (int)legacy.size(), 100.f * legacy.size() / len,
+               t_legacy * 1e3f, (int)pxa.size(), 100.f * pxa.size() / len,
+               t_pxa * 1e3f, same ? "" : "  MISMATCH");
+    }
+
+    return failures;
+}
+
+} // namespace z8
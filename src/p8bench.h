@@ -0,0 +1,37 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include <vector>
+
+// The cartridge benchmarks
+// ————————————————————————
+// Measure the speed of the .p8 loader, compared with the former PEGTL
+// and regex based implementation, of the .p8 writer, and of the code
+// compressors.
+
+namespace z8
+{
+
+// Parse every cart with both loaders, export it back to .p8, and print
+// timings. Returns the number of carts that could not be read or that
+// decoded differently.
+int p8bench(std::vector<char const *> const &carts);
+
+// Compress the code of every cart and print size, ratio and timings.
+// Returns the number of carts that failed to load or to round-trip.
+int codebench(std::vector<char const *> const &carts);
+
+} // namespace z8
@@ -75,7 +75,9 @@ player::player(lol::ivec2 window_size)
     scene.PushCamera(m_scenecam);
     lol::Ticker::Ref(m_scenecam);
 
-    // Register audio callbacks
+    // Register audio callbacks; the streams run at the synth’s native
+    // 22050 Hz rate, so the VM’s resampler is bypassed
+    m_vm.set_sample_rate(AUDIO_RATE);
     for (int i = 0; i < 4; ++i)
     {
         auto f = std::bind(&vm::getaudio, &m_vm, i,
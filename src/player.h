@@ -49,6 +49,12 @@ public:
     uint8_t *get_rom() { return (uint8_t *)&m_vm.m_cart.get_rom(); }
 
 private:
+    // Rate of the audio streams. Lol Engine opens the audio device at
+    // 22050 Hz and cannot report or choose another rate, so live output
+    // stays at the synth’s native rate and is never resampled; 44.1 and
+    // 48 kHz output is only available offline, through --towav.
+    enum { AUDIO_RATE = 22050 };
+
     vm m_vm;
     array<u8vec4> m_screen;
     bool m_render = true;
@@ -0,0 +1,390 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <cstring>
+
+#include "pxa.h"
+
+namespace z8
+{
+
+enum
+{
+    HEADER_SIZE = 8,
+    MIN_MATCH = 3,
+    MAX_OFFSET = 1 << 15,
+    HASH_BITS = 15,
+};
+
+namespace
+{
+
+// Bits are stored LSB first, and so are multi-bit values
+struct bit_reader
+{
+    bit_reader(uint8_t const *data, size_t size)
+      : m_data(data), m_end(data + size), m_size(size * 8)
+    {}
+
+    inline uint32_t peek(int n)
+    {
+        // Keep at least 32 bits in the buffer; past the end, read zeroes
+        while (m_count <= 56)
+        {
+            uint64_t byte = m_data < m_end ? *m_data++ : 0;
+            m_buf |= byte << m_count;
+            m_count += 8;
+        }
+        return (uint32_t)(m_buf & ((uint64_t(1) << n) - 1));
+    }
+
+    inline void skip(int n)
+    {
+        m_buf >>= n;
+        m_count -= n;
+        m_pos += n;
+    }
+
+    inline uint32_t get(int n)
+    {
+        uint32_t ret = peek(n);
+        skip(n);
+        return ret;
+    }
+
+    inline bool overrun() const { return m_pos > m_size; }
+
+private:
+    uint8_t const *m_data, *m_end;
+    uint64_t m_buf = 0;
+    int m_count = 0;
+    size_t m_pos = 0, m_size;
+};
+
+struct bit_writer
+{
+    inline void put(uint32_t value, int n)
+    {
+        m_buf |= (uint64_t)value << m_count;
+        for (m_count += n; m_count >= 8; m_count -= 8)
+        {
+            data.push_back((uint8_t)m_buf);
+            m_buf >>= 8;
+        }
+    }
+
+    void flush()
+    {
+        if (m_count > 0)
+            data.push_back((uint8_t)m_buf);
+        m_buf = 0;
+        m_count = 0;
+    }
+
+    std::vector<uint8_t> data;
+
+private:
+    uint64_t m_buf = 0;
+    int m_count = 0;
+};
+
+// Decoding tables: number of trailing one bits in a byte, which is the
+// unary prefix of literal indices, and the offset size selected by the
+// next two bits of a back reference.
+struct pxa_tables
+{
+    pxa_tables()
+    {
+        for (int i = 0; i < 256; ++i)
+        {
+            int n = 0;
+            while (n < 8 && (i >> n) & 1)
+                ++n;
+            trailing_ones[i] = (uint8_t)n;
+        }
+    }
+
+    uint8_t trailing_ones[256];
+
+    struct { uint8_t bits, consumed; } const offset_prefix[4] =
+    {
+        { 15, 1 }, { 10, 2 }, { 15, 1 }, { 5, 2 },
+    };
+};
+
+pxa_tables const tables;
+
+// Literal indices are split in ranges of 16, 32, 64… values, each
+// encoded with one more unary prefix bit and one more index bit.
+inline int literal_range(int index)
+{
+    int e = 0;
+    while (index >= 16 * ((2 << e) - 1))
+        ++e;
+    return e;
+}
+
+inline int literal_bits(int index)
+{
+    return 6 + 2 * literal_range(index);
+}
+
+inline int match_bits(int offset, int len)
+{
+    int const offset_bits = offset <= 32 ? 7 : offset <= 1024 ? 12 : 16;
+    return 1 + offset_bits + 3 * ((len - MIN_MATCH) / 7 + 1);
+}
+
+inline int mtf_find(uint8_t const *mtf, uint8_t ch)
+{
+    return (int)((uint8_t const *)memchr(mtf, ch, 256) - mtf);
+}
+
+inline void mtf_move(uint8_t *mtf, int index)
+{
+    uint8_t const ch = mtf[index];
+    memmove(mtf + 1, mtf, index);
+    mtf[0] = ch;
+}
+
+} // anonymous namespace
+
+bool pxa_decompress(uint8_t const *data, size_t size, std::string &code)
+{
+    code.clear();
+
+    if (size < HEADER_SIZE || memcmp(data, "\0pxa", 4) != 0)
+        return false;
+
+    size_t const length = data[4] << 8 | data[5];
+    size_t const packed = data[6] << 8 | data[7];
+    if (packed < HEADER_SIZE || packed > size)
+        return false;
+
+    uint8_t mtf[256];
+    for (int i = 0; i < 256; ++i)
+        mtf[i] = (uint8_t)i;
+
+    code.reserve(length);
+    bit_reader in(data + HEADER_SIZE, packed - HEADER_SIZE);
+
+    while (code.length() < length)
+    {
+        if (in.overrun())
+            return false;
+
+        if (in.get(1))
+        {
+            // Literal: index in the move-to-front table
+            int const e = tables.trailing_ones[in.peek(8)];
+            in.skip(e + 1);
+            int const index = (int)in.get(4 + e) + 16 * ((1 << e) - 1);
+            if (index > 255)
+                return false;
+            code += (char)mtf[index];
+            mtf_move(mtf, index);
+            continue;
+        }
+
+        auto const &prefix = tables.offset_prefix[in.peek(2)];
+        in.skip(prefix.consumed);
+        size_t const offset = in.get(prefix.bits) + 1;
+
+        if (prefix.bits == 10 && offset == 1)
+        {
+            // Raw block of 8-bit characters, terminated by zero
+            for (uint8_t ch; (ch = (uint8_t)in.get(8)) != 0 && !in.overrun(); )
+                code += (char)ch;
+            continue;
+        }
+
+        size_t len = MIN_MATCH;
+        for (uint32_t part = 7; part == 7 && !in.overrun(); len += part)
+            part = in.get(3);
+
+        if (offset > code.length())
+            return false;
+
+        // Copy one character at a time, since the match may overlap
+        for (size_t i = 0; i < len; ++i)
+            code += code[code.length() - offset];
+    }
+
+    code.resize(length);
+    return !in.overrun();
+}
+
+std::vector<uint8_t> pxa_compress(std::string const &code, int effort)
+{
+    // The header stores both lengths on 16 bits
+    if (code.length() > 0xffff)
+    {
+        lol::msg::error("cannot compress %d bytes of code to PXA, the limit is 65535\n",
+                        (int)code.length());
+        return std::vector<uint8_t>();
+    }
+
+    int const n = (int)code.length();
+    uint8_t const *src = (uint8_t const *)code.c_str();
+    int const max_chain = 1 << lol::clamp(effort, 0, 15);
+
+    // Hash chains indexed by the next three characters
+    std::vector<int> head(1 << HASH_BITS, -1), prev(n, -1);
+
+    auto hash = [&](int i)
+    {
+        return ((src[i] << 10) ^ (src[i + 1] << 5) ^ src[i + 2]) & ((1 << HASH_BITS) - 1);
+    };
+
+    auto insert = [&](int i)
+    {
+        if (i + MIN_MATCH <= n)
+        {
+            int const h = hash(i);
+            prev[i] = head[h];
+            head[h] = i;
+        }
+    };
+
+    // Find the longest match at position i, preferring the closest one
+    auto find = [&](int i, int &offset) -> int
+    {
+        int best = 0;
+        if (i + MIN_MATCH > n)
+            return 0;
+
+        int chain = max_chain;
+        for (int j = head[hash(i)]; j >= 0 && i - j <= MAX_OFFSET && chain--; j = prev[j])
+        {
+            if (src[j + best] != src[i + best])
+                continue;
+            int len = 0;
+            while (i + len < n && src[j + len] == src[i + len])
+                ++len;
+            if (len > best)
+            {
+                best = len;
+                offset = i - j;
+                if (i + len == n)
+                    break;
+            }
+        }
+
+        return best >= MIN_MATCH ? best : 0;
+    };
+
+    uint8_t mtf[256];
+    for (int i = 0; i < 256; ++i)
+        mtf[i] = (uint8_t)i;
+
+    bit_writer out;
+    out.data.resize(HEADER_SIZE);
+
+    auto put_literal = [&](int i)
+    {
+        int const index = mtf_find(mtf, src[i]);
+        int const e = literal_range(index);
+        out.put(1, 1);
+        out.put((1 << e) - 1, e + 1);
+        out.put(index - 16 * ((1 << e) - 1), 4 + e);
+        mtf_move(mtf, index);
+    };
+
+    auto put_match = [&](int offset, int len)
+    {
+        out.put(0, 1);
+        if (offset <= 32)
+            out.put(3, 2), out.put(offset - 1, 5);
+        else if (offset <= 1024)
+            out.put(1, 2), out.put(offset - 1, 10);
+        else
+            out.put(0, 1), out.put(offset - 1, 15);
+
+        for (len -= MIN_MATCH; len >= 7; len -= 7)
+            out.put(7, 3);
+        out.put(len, 3);
+    };
+
+    for (int i = 0; i < n; )
+    {
+        int offset = 0;
+        int len = find(i, offset);
+        insert(i);
+
+        // Lazy matching: emit a literal if the next position has a
+        // longer match
+        if (len && effort >= 4 && len < 32)
+        {
+            int next_offset = 0;
+            if (find(i + 1, next_offset) > len + 1)
+                len = 0;
+        }
+
+        // Short matches may cost more than the literals they replace
+        if (len && len < 8)
+        {
+            uint8_t tmp[256];
+            memcpy(tmp, mtf, sizeof(tmp));
+            int literal_cost = 0;
+            for (int k = 0; k < len; ++k)
+            {
+                int const index = mtf_find(tmp, src[i + k]);
+                literal_cost += literal_bits(index);
+                mtf_move(tmp, index);
+            }
+            if (match_bits(offset, len) >= literal_cost)
+                len = 0;
+        }
+
+        if (len)
+        {
+            put_match(offset, len);
+            for (int k = 1; k < len; ++k)
+                insert(i + k);
+            i += len;
+        }
+        else
+        {
+            put_literal(i);
+            ++i;
+        }
+    }
+
+    out.flush();
+
+    size_t const packed = out.data.size();
+    if (packed > 0xffff)
+    {
+        lol::msg::error("PXA compressed code is %d bytes, the limit is 65535\n",
+                        (int)packed);
+        return std::vector<uint8_t>();
+    }
+
+    uint8_t const header[HEADER_SIZE] =
+    {
+        '\0', 'p', 'x', 'a',
+        (uint8_t)(n >> 8), (uint8_t)n,
+        (uint8_t)(packed >> 8), (uint8_t)packed,
+    };
+    memcpy(out.data.data(), header, HEADER_SIZE);
+
+    return out.data;
+}
+
+} // namespace z8
+
@@ -0,0 +1,39 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// The PXA code format
+// ———————————————————
+// The compressed code format used by PICO-8 0.2.0 and later: an 8-byte
+// header starting with "\0pxa", then a bit stream of move-to-front coded
+// literals and back references with variable-length offsets.
+
+namespace z8
+{
+
+// Compress code to PXA format, including the header. The encoder looks
+// at up to 2^effort match candidates per position; effort is 0…15.
+// Returns an empty vector if the code or its compressed form is longer
+// than the 65535 bytes that the header can describe.
+std::vector<uint8_t> pxa_compress(std::string const &code, int effort = 8);
+
+// Decompress PXA data, starting with the header, from a buffer of at
+// most “size” bytes. Returns false if the data is malformed.
+bool pxa_decompress(uint8_t const *data, size_t size, std::string &code);
+
+} // namespace z8
+
@@ -0,0 +1,157 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <cmath>
+
+#include "resampler.h"
+
+namespace z8
+{
+
+enum
+{
+    // Number of filter phases; coefficients for intermediate positions
+    // are linearly interpolated between two neighbouring phases.
+    PHASES = 64,
+    // How many input samples are requested from the source at once
+    INPUT_BLOCK = 256,
+};
+
+resampler::resampler()
+{
+    init(1, 1, quality::fast);
+}
+
+char const *resampler::name(quality q)
+{
+    switch (q)
+    {
+        case quality::fast: return "fast";
+        case quality::medium: return "medium";
+        case quality::best: return "best";
+    }
+    return "unknown";
+}
+
+void resampler::init(int in_rate, int out_rate, quality q)
+{
+    m_step = (double)in_rate / out_rate;
+    m_bypass = in_rate == out_rate;
+    m_taps = q == quality::best ? 32 : q == quality::medium ? 8 : 2;
+
+    // Start with enough silence for the filter history, so that the first
+    // output sample is aligned with the first input sample.
+    m_input.assign(m_taps / 2 - 1, 0.f);
+    m_pos = m_taps / 2 - 1;
+    m_filter.clear();
+
+    if (m_bypass || q == quality::fast)
+        return;
+
+    // Low-pass at the lowest of the two Nyquist frequencies, with a
+    // small margin for the transition band.
+    double const cutoff = 0.95 * lol::min(1.0, 1.0 / m_step);
+    double const half = m_taps / 2;
+    double const pi = 3.14159265358979323846;
+
+    m_filter.resize((PHASES + 1) * m_taps);
+    for (int p = 0; p <= PHASES; ++p)
+    {
+        float *h = &m_filter[p * m_taps];
+        double sum = 0.0;
+
+        for (int k = 0; k < m_taps; ++k)
+        {
+            // Distance between tap k and the output position
+            double x = k - half + 1 - (double)p / PHASES;
+            double s = x == 0.0 ? 1.0 : std::sin(pi * cutoff * x) / (pi * cutoff * x);
+            // Blackman window
+            double w = lol::abs(x) >= half ? 0.0
+                     : 0.42 + 0.5 * std::cos(pi * x / half)
+                            + 0.08 * std::cos(2.0 * pi * x / half);
+            h[k] = (float)(s * w);
+            sum += h[k];
+        }
+
+        // Normalise for unity gain at DC
+        for (int k = 0; k < m_taps; ++k)
+            h[k] = (float)(h[k] / sum);
+    }
+}
+
+void resampler::fill(std::function<void(float *, int)> const &source)
+{
+    size_t const size = m_input.size();
+    m_input.resize(size + INPUT_BLOCK);
+    source(&m_input[size], INPUT_BLOCK);
+}
+
+void resampler::process(float *out, int count,
+                        std::function<void(float *, int)> const &source)
+{
+    if (m_bypass)
+    {
+        source(out, count);
+        return;
+    }
+
+    int const half = m_taps / 2;
+
+    for (int n = 0; n < count; ++n)
+    {
+        int const i = (int)m_pos;
+        while (i + half >= (int)m_input.size())
+            fill(source);
+
+        float const t = (float)(m_pos - i);
+        float const *in = &m_input[i - half + 1];
+
+        if (m_filter.empty())
+        {
+            out[n] = in[0] + (in[1] - in[0]) * t;
+        }
+        else
+        {
+            float const fp = t * PHASES;
+            int const p = lol::min((int)fp, PHASES - 1);
+            float const u = fp - p;
+            float const *h0 = &m_filter[p * m_taps];
+            float const *h1 = h0 + m_taps;
+
+            float acc0 = 0.f, acc1 = 0.f;
+            for (int k = 0; k < m_taps; ++k)
+            {
+                acc0 += h0[k] * in[k];
+                acc1 += h1[k] * in[k];
+            }
+            out[n] = acc0 + (acc1 - acc0) * u;
+        }
+
+        m_pos += m_step;
+    }
+
+    // Discard input samples that are no longer needed
+    int const drop = (int)m_pos - half + 1;
+    if (drop > 0)
+    {
+        m_input.erase(m_input.begin(), m_input.begin() + drop);
+        m_pos -= drop;
+    }
+}
+
+} // namespace z8
@@ -0,0 +1,62 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include <functional>
+#include <vector>
+
+// The resampler class
+// ———————————————————
+// Converts a mono float stream from one sample rate to another using a
+// polyphase windowed sinc filter. Input is pulled from a callback in
+// blocks, so the source can run at its own native rate.
+
+namespace z8
+{
+
+class resampler
+{
+public:
+    enum class quality : int
+    {
+        fast = 0,   // linear interpolation
+        medium = 1, // 8-tap polyphase filter
+        best = 2,   // 32-tap polyphase filter
+    };
+
+    resampler();
+
+    void init(int in_rate, int out_rate, quality q);
+
+    // Fill “out” with “count” samples, calling “source” whenever more
+    // input samples are needed.
+    void process(float *out, int count,
+                 std::function<void(float *, int)> const &source);
+
+    static char const *name(quality q);
+
+private:
+    void fill(std::function<void(float *, int)> const &source);
+
+    int m_taps = 2;
+    bool m_bypass = true;
+    double m_step = 1.0, m_pos = 0.0;
+
+    // Filter bank: (PHASES + 1) × m_taps coefficients
+    std::vector<float> m_filter;
+    std::vector<float> m_input;
+};
+
+} // namespace z8
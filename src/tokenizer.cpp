@@ -0,0 +1,112 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <string>
+#include <vector>
+
+#include <tao/pegtl.hpp>
+
+#include "tokenizer.h"
+#define WITH_PICO8 1
+#include "lua53-parse.h"
+
+using namespace tao;
+
+namespace lua53
+{
+
+// Token-level rules; the number rule is guarded because it raises an
+// error on a lone “.”.
+struct token_space : pegtl::plus< pegtl::ascii::space > {};
+struct token_comment : pegtl::sor< comment, cpp_comment > {};
+struct token_string : literal_string {};
+struct token_number : pegtl::seq< pegtl::at< pegtl::sor< pegtl::digit, pegtl::seq< pegtl::one< '.' >, pegtl::digit > > >,
+                                  numeral > {};
+struct token_keyword : keyword {};
+struct token_name : name {};
+struct token_symbol : pegtl::sor< three_dots,
+                                  pegtl::two< '.' >,
+                                  pegtl::two< ':' >,
+                                  pegtl::two< '=' >,
+                                  pegtl::two< '<' >,
+                                  pegtl::two< '>' >,
+                                  pegtl::string< '~', '=' >,
+                                  pegtl::string< '!', '=' >,
+                                  pegtl::string< '<', '=' >,
+                                  pegtl::string< '>', '=' >,
+                                  reassign_op,
+                                  pegtl::any > {};
+struct token_any : pegtl::sor< token_space,
+                               token_comment,
+                               token_string,
+                               token_number,
+                               token_keyword,
+                               token_name,
+                               token_symbol > {};
+struct token_grammar : pegtl::until< pegtl::eof, token_any > {};
+
+} // namespace lua53
+
+namespace z8
+{
+
+namespace
+{
+
+template<typename R>
+struct action : pegtl::nothing<R> {};
+
+template<token_kind K>
+struct push_token
+{
+    template<typename Input>
+    static void apply(Input const &in, std::vector<token> &tokens)
+    {
+        auto const pos = in.position();
+        tokens.push_back(token{ K, in.string(), pos.line, pos.byte });
+    }
+};
+
+template<> struct action<lua53::token_comment> : push_token<token_kind::comment> {};
+template<> struct action<lua53::token_string> : push_token<token_kind::string> {};
+template<> struct action<lua53::token_number> : push_token<token_kind::number> {};
+template<> struct action<lua53::token_keyword> : push_token<token_kind::keyword> {};
+template<> struct action<lua53::token_name> : push_token<token_kind::name> {};
+template<> struct action<lua53::token_symbol> : push_token<token_kind::symbol> {};
+
+} // anonymous namespace
+
+bool tokenize(std::string const &code, std::vector<token> &tokens, std::string *error)
+{
+    tokens.clear();
+    try
+    {
+        pegtl::memory_input<> in(code.data(), code.size(), "code");
+        pegtl::parse<lua53::token_grammar, action>(in, tokens);
+    }
+    catch (pegtl::parse_error const &e)
+    {
+        if (error)
+            *error = e.what();
+        return false;
+    }
+    return true;
+}
+
+} // namespace z8
+
@@ -0,0 +1,56 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// The Lua tokenizer
+// —————————————————
+// Splits PICO-8 code into tokens using the lexical rules of the Lua
+// grammar in lua53-parse.h, without parsing it. Whitespace is dropped
+// but comments are kept, since some tools give them a meaning.
+
+namespace z8
+{
+
+enum class token_kind : uint8_t
+{
+    comment,
+    string,
+    number,
+    keyword,
+    name,
+    symbol,
+};
+
+struct token
+{
+    token_kind kind;
+    std::string text;
+    size_t line, offset;
+
+    inline bool is(token_kind k, char const *s) const
+    {
+        return kind == k && text == s;
+    }
+};
+
+// Tokenize code; on malformed input, return false and store a message
+// in “error” if it is not null.
+bool tokenize(std::string const &code, std::vector<token> &tokens,
+              std::string *error = nullptr);
+
+} // namespace z8
+
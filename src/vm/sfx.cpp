@@ -49,9 +49,50 @@ enum
     FX_ARP_SLOW =  7,
 };
 
-static float key_to_freq(float key)
+enum
+{
+    SYNTH_RATE = 22050,
+};
+
+// Phase increments per key, in 0.32 fixed point cycles per sample at the
+// synth rate. These replace calls to exp2() in the audio loop. There is an
+// extra entry after the last key so that vibrato can interpolate towards
+// the next semitone.
+static struct pitch_table
+{
+    pitch_table()
+    {
+        for (int key = 0; key < 65; ++key)
+        {
+            double freq = 440.0 * std::exp2((key - 33.0) / 12.0);
+            inc[key] = (uint32_t)(freq / SYNTH_RATE * 4294967296.0 + 0.5);
+        }
+    }
+
+    uint32_t inc[65];
+}
+const pitch;
+
+// Linear interpolation between two phase increments; t may be negative
+static inline uint32_t mix_inc(uint32_t a, uint32_t b, float t)
+{
+    return (uint32_t)((double)a + ((double)b - (double)a) * t);
+}
+
+enum
 {
-    return 440.f * std::exp2((key - 33.f) / 12.f);
+    // Maximum number of rendered SFX instrument samples kept per channel
+    INST_CACHE_SAMPLES = 1 << 20,
+};
+
+// FNV-1a hash of the first “count” SFX in memory
+static uint64_t sfx_hash(memory const &ram, int count)
+{
+    uint8_t const *p = (uint8_t const *)&ram.sfx[0];
+    uint64_t ret = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < count * sizeof(ram.sfx[0]); ++i)
+        ret = (ret ^ p[i]) * 0x100000001b3ull;
+    return ret;
 }
 
 #if DEBUG_STUFF
@@ -77,12 +118,16 @@ inline float note::volume() const
 
 inline uint8_t note::effect() const
 {
-    // FIXME: there is an actual extra bit for the effect but I don’t
-    // know what it’s for: PICO-8 documentation says 0…7, not 0…15
-    // Update: maybe this is used for the new SFX instrument feature?
+    // The extra bit above the effect is the SFX instrument flag
     return (b[1] >> 4) & 0x7;
 }
 
+inline bool note::custom() const
+{
+    // If set, instrument() is the index of an SFX (0…7) used as instrument
+    return (b[1] >> 7) != 0;
+}
+
 inline uint8_t note::instrument() const
 {
     return ((b[1] << 2) & 0x4) | (b[0] >> 6);
@@ -104,6 +149,20 @@ uint8_t song::sfx(int n) const
 std::map<void const *, FILE *> exports;
 #endif
 
+void vm::voice::start(int sfx, int offset)
+{
+    m_sfx = sfx;
+    m_offset = (float)offset;
+    m_phi = 0;
+    m_can_loop = true;
+    // Playing an instrument starting with the note C-2 and the
+    // slide effect causes no noticeable pitch variation in PICO-8,
+    // so I assume this is the default value for “previous key”.
+    m_prev_key = 24;
+    // There is no default value for “previous volume”.
+    m_prev_vol = 0.f;
+}
+
 vm::channel::channel()
 {
 #if DEBUG_EXPORT_WAV
@@ -119,9 +178,36 @@ vm::channel::channel()
 #endif
 }
 
-static float get_waveform(int instrument, float advance)
+// Perlin-style 1D gradient noise. The gradients are hashed from the
+// lattice coordinates, so the output only depends on “x” and is the
+// same on every platform, which the audio golden tests rely on.
+static float gradient_noise(float x)
+{
+    auto gradient = [](int32_t i)
+    {
+        uint32_t h = (uint32_t)i * 0x9e3779b9u;
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        return (float)(h >> 8) / 8388608.f - 1.f;
+    };
+
+    float const f = lol::floor(x);
+    int32_t const i = (int32_t)f;
+    float const t = x - f;
+    float const a = gradient(i) * t;
+    float const b = gradient(i + 1) * (t - 1.f);
+    // Quintic fade curve
+    float const u = t * t * t * (t * (t * 6.f - 15.f) + 10.f);
+    return a + (b - a) * u;
+}
+
+// The phase is a 32.32 fixed point number of cycles. Only the top 24 bits
+// of the fractional part are used for floating point conversions, so that
+// t is exactly representable and always strictly below 1.
+static float get_waveform(int instrument, uint64_t phi)
 {
-    float t = lol::fmod(advance, 1.f);
+    float t = (float)((uint32_t)phi >> 8) / 16777216.f;
     float ret = 0.f;
 
     // Multipliers were measured from WAV exports. Waveforms are
@@ -156,16 +242,16 @@ static float get_waveform(int instrument, float advance)
             //
             // This may help us create a correct filter:
             // http://www.firstpr.com.au/dsp/pink-noise/
-            static lol::perlin_noise<1> noise;
+            float const advance = (float)((double)phi / 4294967296.0);
             for (float m = 1.75f, d = 1.f; m <= 128; m *= 2.25f, d *= 0.75f)
-                ret += d * noise.eval(lol::vec_t<float, 1>(m * advance));
+                ret += d * gradient_noise(m * advance);
             return ret * 0.4f;
         }
         case INST_PHASER:
         {   // This one has a subfrequency of freq/128 that appears
             // to modulate two signals using a triangle wave
             // FIXME: amplitude seems to be affected, too
-            float k = lol::abs(2.f * lol::fmod(advance / 128.f, 1.f) - 1.f);
+            float k = lol::abs(2.f * (float)((uint32_t)(phi >> 7) >> 8) / 16777216.f - 1.f);
             float u = lol::fmod(t + 0.5f * k, 1.0f);
             ret = lol::abs(4.f * u - 2.f) - lol::abs(8.f * t - 4.f);
             return ret * 0.166666666f;
@@ -178,132 +264,252 @@ static float get_waveform(int instrument, float advance)
 // FIXME: there is a problem with the per-channel approach; if a channel
 // advances the music, then all the other channels will reference the
 // new music chunk. Be careful when implementing music.
-void vm::getaudio(int chan, void *in_buffer, int in_bytes)
+void vm::synth(int chan, float *buffer, int samples)
 {
-    int const samples_per_second = 22050;
-    int const bytes_per_sample = 4; // stereo S16 for now
+    channel &ch = m_channels[chan];
 
-    int16_t *buffer = (int16_t *)in_buffer;
-    int const samples = in_bytes / bytes_per_sample;
-
-    for (int i = 0; i < samples; ++i)
+    // Invalidate rendered SFX instruments if their data changed
+    uint64_t const hash = sfx_hash(m_ram, 8);
+    if (hash != ch.m_inst_cache.m_hash)
     {
-        if (m_channels[chan].m_sfx == -1)
+        ch.m_inst_cache.m_entries.clear();
+        ch.m_inst_cache.m_hash = hash;
+        ch.m_inst_cache.m_total = 0;
+        if (ch.m_inst_entry)
         {
-            buffer[2 * i] = buffer[2 * i + 1] = 0;
-            continue;
+            ch.m_inst_entry = nullptr;
+            ch.m_inst_retrigger = true;
         }
+    }
+
+    for (int i = 0; i < samples; ++i)
+        buffer[i] = voice_sample(ch, 0, 1.0, &ch);
+}
 
-        int const index = m_channels[chan].m_sfx;
-        ASSERT(index >= 0 && index < 64);
-        struct sfx const &sfx = m_ram.sfx[index];
+// Compute one sample of voice “v” and advance it. Notes are transposed by
+// “key_offset” semitones and their pitch is multiplied by “ratio”, which
+// is how a parent note drives an SFX instrument. Only top-level voices
+// (when “ch” is not null) may use SFX instruments, so recursion is bounded.
+float vm::voice_sample(voice &v, int key_offset, double ratio, channel *ch)
+{
+    int const samples_per_second = SYNTH_RATE;
+
+    if (v.m_sfx == -1)
+        return 0.f;
+
+    int const index = v.m_sfx;
+    ASSERT(index >= 0 && index < 64);
+    struct sfx const &sfx = m_ram.sfx[index];
+
+    // Speed must be 1—255 otherwise the SFX is invalid
+    int const speed = lol::max(1, (int)sfx.speed);
 
-        // Speed must be 1—255 otherwise the SFX is invalid
-        int const speed = lol::max(1, (int)sfx.speed);
+    float offset = v.m_offset;
 
-        float offset = m_channels[chan].m_offset;
-        float phi = m_channels[chan].m_phi;
+    // PICO-8 exports instruments as 22050 Hz WAV files with 183 samples
+    // per speed unit per note, so this is how much we should advance
+    float const offset_per_second = 22050.f / (183.f * speed);
+    float const offset_per_sample = offset_per_second / samples_per_second;
+    float next_offset = offset + offset_per_sample;
+
+    // Handle SFX loops. From the documentation: “Looping is turned
+    // off when the start index >= end index”.
+    float const loop_range = float(sfx.loop_end - sfx.loop_start);
+    if (loop_range > 0.f && next_offset >= sfx.loop_end && v.m_can_loop)
+    {
+        next_offset = std::fmod(next_offset - sfx.loop_start, loop_range)
+                    + sfx.loop_start;
+    }
 
-        // PICO-8 exports instruments as 22050 Hz WAV files with 183 samples
-        // per speed unit per note, so this is how much we should advance
-        float const offset_per_second = 22050.f / (183.f * speed);
-        float const offset_per_sample = offset_per_second / samples_per_second;
-        float next_offset = offset + offset_per_sample;
+    int const note_id = (int)lol::floor(offset);
+    int const next_note_id = (int)lol::floor(next_offset);
 
-        // Handle SFX loops. From the documentation: “Looping is turned
-        // off when the start index >= end index”.
-        float const loop_range = float(sfx.loop_end - sfx.loop_start);
-        if (loop_range > 0.f && next_offset >= sfx.loop_end
-             && m_channels[chan].m_can_loop)
+    note const &n = sfx.notes[note_id];
+    int const key = lol::clamp(n.key() + key_offset, 0, 63);
+    float volume = n.volume();
+    uint32_t inc = pitch.inc[key];
+    float ret = 0.f;
+
+    if (volume > 0.f)
+    {
+        int const fx = n.effect();
+
+        // Apply effect, if any
+        switch (fx)
         {
-            next_offset = std::fmod(next_offset - sfx.loop_start, loop_range)
-                        + sfx.loop_start;
+            case FX_NO_EFFECT:
+                break;
+            case FX_SLIDE:
+            {
+                float t = lol::fmod(offset, 1.f);
+                int prev_key = lol::clamp(v.m_prev_key + key_offset, 0, 63);
+                // From the documentation: “Slide to the next note and volume”,
+                // but it’s actually _from_ the _prev_ note and volume.
+                inc = mix_inc(pitch.inc[prev_key], inc, t);
+                if (v.m_prev_vol > 0.f)
+                    volume = lol::mix(v.m_prev_vol, volume, t);
+                break;
+            }
+            case FX_VIBRATO:
+            {
+                // 7.5f and 0.25f were found empirically by matching
+                // frequency graphs of PICO-8 instruments.
+                float t = lol::abs(lol::fmod(7.5f * offset / offset_per_second, 1.0f) - 0.5f) - 0.25f;
+                // Vibrato half a semi-tone, so interpolate with the next key
+                inc = mix_inc(inc, pitch.inc[key + 1], t);
+                break;
+            }
+            case FX_DROP:
+                inc = (uint32_t)(inc * (1.0 - lol::fmod(offset, 1.f)));
+                break;
+            case FX_FADE_IN:
+                volume *= lol::fmod(offset, 1.f);
+                break;
+            case FX_FADE_OUT:
+                volume *= 1.f - lol::fmod(offset, 1.f);
+                break;
+            case FX_ARP_FAST:
+            case FX_ARP_SLOW:
+            {
+                // From the documentation:
+                // “6 arpeggio fast  //  Iterate over groups of 4 notes at speed of 4
+                //  7 arpeggio slow  //  Iterate over groups of 4 notes at speed of 8”
+                // “If the SFX speed is <= 8, arpeggio speeds are halved to 2, 4”
+                int const m = (speed <= 8 ? 32 : 16) / (fx == FX_ARP_FAST ? 4 : 8);
+                int const n = (int)(m * 7.5f * offset / offset_per_second);
+                int const arp_note = (note_id & ~3) | (n & 3);
+                int const arp_key = sfx.notes[arp_note].key() + key_offset;
+                inc = pitch.inc[lol::clamp(arp_key, 0, 63)];
+                break;
+            }
         }
 
-        int const note_id = (int)lol::floor(offset);
-        int const next_note_id = (int)lol::floor(next_offset);
+        if (ratio != 1.0)
+            inc = (uint32_t)(inc * ratio);
 
-        uint8_t key = sfx.notes[note_id].key();
-        float volume = sfx.notes[note_id].volume();
-        float freq = key_to_freq(key);
-
-        if (volume == 0.f)
+        if (ch && n.custom())
         {
-            // Play silence
-            buffer[2 * i] = buffer[2 * i + 1] = 0;
+            // Play SFX instrument, passing it our pitch effects
+            double const fx_ratio = (double)inc / pitch.inc[key];
+            ret = volume * instrument_sample(*ch, n.instrument(), key, fx, fx_ratio);
         }
         else
         {
-            int const fx = sfx.notes[note_id].effect();
+            // Play note
+            ret = volume * get_waveform(n.instrument(), v.m_phi);
+            v.m_phi += inc;
+        }
+    }
 
-            // Apply effect, if any
-            switch (fx)
-            {
-                case FX_NO_EFFECT:
-                    break;
-                case FX_SLIDE:
-                {
-                    float t = lol::fmod(offset, 1.f);
-                    // From the documentation: “Slide to the next note and volume”,
-                    // but it’s actually _from_ the _prev_ note and volume.
-                    freq = lol::mix(key_to_freq(m_channels[chan].m_prev_key), freq, t);
-                    if (m_channels[chan].m_prev_vol > 0.f)
-                        volume = lol::mix(m_channels[chan].m_prev_vol, volume, t);
-                    break;
-                }
-                case FX_VIBRATO:
-                {
-                    // 7.5f and 0.25f were found empirically by matching
-                    // frequency graphs of PICO-8 instruments.
-                    float t = lol::abs(lol::fmod(7.5f * offset / offset_per_second, 1.0f) - 0.5f) - 0.25f;
-                    // Vibrato half a semi-tone, so multiply by pow(2,1/12)
-                    freq = lol::mix(freq, freq * 1.059463094359f, t);
-                    break;
-                }
-                case FX_DROP:
-                    freq *= 1.f - lol::fmod(offset, 1.f);
-                    break;
-                case FX_FADE_IN:
-                    volume *= lol::fmod(offset, 1.f);
-                    break;
-                case FX_FADE_OUT:
-                    volume *= 1.f - lol::fmod(offset, 1.f);
-                    break;
-                case FX_ARP_FAST:
-                case FX_ARP_SLOW:
-                {
-                    // From the documentation:
-                    // “6 arpeggio fast  //  Iterate over groups of 4 notes at speed of 4
-                    //  7 arpeggio slow  //  Iterate over groups of 4 notes at speed of 8”
-                    // “If the SFX speed is <= 8, arpeggio speeds are halved to 2, 4”
-                    int const m = (speed <= 8 ? 32 : 16) / (fx == FX_ARP_FAST ? 4 : 8);
-                    int const n = (int)(m * 7.5f * offset / offset_per_second);
-                    int const arp_note = (note_id & ~3) | (n & 3);
-                    freq = key_to_freq(sfx.notes[arp_note].key());
-                    break;
-                }
-            }
+    v.m_offset = next_offset;
 
-            // Play note
-            float waveform = get_waveform(sfx.notes[note_id].instrument(), phi);
+    if (next_offset >= 32.f)
+    {
+        v.m_sfx = -1;
+    }
+    else if (next_note_id != note_id)
+    {
+        v.m_prev_key = n.key();
+        v.m_prev_vol = n.volume();
+    }
 
-            buffer[2 * i] = buffer[2 * i + 1]
-                  = (int16_t)(32767.99f * volume * waveform);
+    // SFX instruments restart on every new note
+    if (ch && (v.m_sfx == -1 || next_note_id != note_id))
+    {
+        ch->m_inst_retrigger = true;
+        ch->m_inst_entry = nullptr;
+    }
 
-            m_channels[chan].m_phi = phi + freq / samples_per_second;
+    return ret;
+}
+
+float vm::instrument_sample(channel &ch, int instrument, int key, int fx, double ratio)
+{
+    // SFX instruments are played relative to C-2
+    int const key_offset = key - 24;
+
+    if (ch.m_inst_retrigger)
+    {
+        ch.m_inst_retrigger = false;
+        ch.m_inst_pos = 0;
+
+        // Pitch effects modulate the instrument continuously, so only notes
+        // with no effect or with volume effects can use rendered waveforms.
+        if (fx == FX_NO_EFFECT || fx == FX_FADE_IN || fx == FX_FADE_OUT)
+        {
+            auto it = ch.m_inst_cache.m_entries.find(instrument * 64 + key);
+            if (it == ch.m_inst_cache.m_entries.end())
+            {
+                it = ch.m_inst_cache.m_entries.insert(std::make_pair(instrument * 64 + key, inst_entry())).first;
+                it->second.m_voice.start(instrument);
+            }
+            ch.m_inst_entry = &it->second;
         }
+        else
+        {
+            ch.m_inst.start(instrument);
+        }
+    }
+
+    if (inst_entry *e = ch.m_inst_entry)
+    {
+        if (ch.m_inst_pos < e->m_pcm.size())
+            return e->m_pcm[ch.m_inst_pos++];
 
-        m_channels[chan].m_offset = next_offset;
+        // The nested SFX has ended: the waveform is complete, and only
+        // silence follows, which is not worth caching
+        if (e->m_voice.m_sfx == -1)
+            return 0.f;
 
-        if (next_offset >= 32.f)
+        if (ch.m_inst_cache.m_total < INST_CACHE_SAMPLES)
         {
-            m_channels[chan].m_sfx = -1;
+            float x = voice_sample(e->m_voice, key_offset, 1.0, nullptr);
+            e->m_pcm.push_back(x);
+            ++ch.m_inst_cache.m_total;
+            ++ch.m_inst_pos;
+            return x;
         }
-        else if (next_note_id != note_id)
+
+        // The cache is full: continue rendering from the cached state
+        ch.m_inst = e->m_voice;
+        ch.m_inst_entry = nullptr;
+    }
+
+    return voice_sample(ch.m_inst, key_offset, ratio, nullptr);
+}
+
+void vm::set_sample_rate(int rate, resampler::quality q)
+{
+    for (auto &c : m_channels)
+        c.m_resampler.init(SYNTH_RATE, rate, q);
+}
+
+void vm::getaudio(int chan, void *in_buffer, int in_bytes)
+{
+    int const bytes_per_sample = 4; // stereo S16 for now
+
+    int16_t *buffer = (int16_t *)in_buffer;
+    int const samples = in_bytes / bytes_per_sample;
+
+    // The synth runs at its native rate and the resampler pulls from it
+    // in blocks; convert to S16 in chunks to keep the buffer on the stack.
+    auto source = [this, chan](float *dst, int count) { synth(chan, dst, count); };
+
+    for (int pos = 0; pos < samples; )
+    {
+        float tmp[256];
+        int const count = lol::min(samples - pos, (int)(sizeof(tmp) / sizeof(*tmp)));
+
+        m_channels[chan].m_resampler.process(tmp, count, source);
+
+        for (int i = 0; i < count; ++i)
         {
-            m_channels[chan].m_prev_key = sfx.notes[note_id].key();
-            m_channels[chan].m_prev_vol = sfx.notes[note_id].volume();
+            float const x = lol::clamp(tmp[i], -1.f, 1.f);
+            buffer[2 * (pos + i)] = buffer[2 * (pos + i) + 1]
+                  = (int16_t)(32767.99f * x);
         }
+
+        pos += count;
     }
 
 #if DEBUG_EXPORT_WAV
@@ -317,49 +523,8 @@ void vm::getaudio(int chan, void *in_buffer, int in_bytes)
 // Sound
 //
 
-int vm::api_music(lua_State *l)
+void vm::play_sfx(int sfx, int chan, int offset)
 {
-    // Pattern: 0..63, -1 to stop music.
-    int pattern = (int)lua_tonumber(l, 1);
-    // Fade length in milliseconds (default 0)
-    int fade_len = (int)lua_tonumber(l, 2);
-    // Reserved channels
-    int channel_mask = (int)lua_tonumber(l, 3) & 0xf;
-
-    if (pattern < -1 || pattern > 63)
-        return 0;
-
-    if (pattern == -1 && m_music.m_pattern >= 0)
-    {
-        // Stop playing the current song
-        for (int i = 0; i < 4; ++i)
-            if (m_music.m_mask & (1 << i))
-                m_channels[i].m_sfx = -1;
-        m_music.m_pattern = -1;
-        return 0;
-    }
-
-    m_music.m_pattern = pattern;
-    m_music.m_mask = channel_mask;
-
-    msg::info("z8:stub:music\n");
-    return 0;
-}
-
-int vm::api_sfx(lua_State *l)
-{
-    // SFX index: valid values are 0..63 for actual samples,
-    // -1 to stop sound on a channel, -2 to stop looping on a channel
-    int sfx = (int)lua_tonumber(l, 1);
-    // Audio channel: valid values are 0..3 or -1 (autoselect)
-    int chan = lua_isnone(l, 2) ? -1 : (int)lua_tonumber(l, 2);
-    // Sound offset: valid values are 0..31, negative values act as 0,
-    // and fractional values are ignored
-    int offset = lol::max(0, (int)lua_tonumber(l, 3));
-
-    if (sfx < -2 || sfx > 63 || chan < -1 || chan > 4 || offset > 31)
-        return 0;
-
     if (sfx == -1)
     {
         // Stop playing the current channel
@@ -407,18 +572,57 @@ int vm::api_sfx(lua_State *l)
                 if (m_channels[i].m_sfx == sfx)
                     m_channels[i].m_sfx = -1;
 
-            m_channels[chan].m_sfx = sfx;
-            m_channels[chan].m_offset = (float)offset;
-            m_channels[chan].m_phi = 0.f;
-            m_channels[chan].m_can_loop = true;
-            // Playing an instrument starting with the note C-2 and the
-            // slide effect causes no noticeable pitch variation in PICO-8,
-            // so I assume this is the default value for “previous key”.
-            m_channels[chan].m_prev_key = 24;
-            // There is no default value for “previous volume”.
-            m_channels[chan].m_prev_vol = 0.f;
+            m_channels[chan].start(sfx, offset);
+            m_channels[chan].m_inst_retrigger = true;
+            m_channels[chan].m_inst_entry = nullptr;
         }
     }
+}
+
+int vm::api_music(lua_State *l)
+{
+    // Pattern: 0..63, -1 to stop music.
+    int pattern = (int)lua_tonumber(l, 1);
+    // Fade length in milliseconds (default 0)
+    int fade_len = (int)lua_tonumber(l, 2);
+    // Reserved channels
+    int channel_mask = (int)lua_tonumber(l, 3) & 0xf;
+
+    if (pattern < -1 || pattern > 63)
+        return 0;
+
+    if (pattern == -1 && m_music.m_pattern >= 0)
+    {
+        // Stop playing the current song
+        for (int i = 0; i < 4; ++i)
+            if (m_music.m_mask & (1 << i))
+                m_channels[i].m_sfx = -1;
+        m_music.m_pattern = -1;
+        return 0;
+    }
+
+    m_music.m_pattern = pattern;
+    m_music.m_mask = channel_mask;
+
+    msg::info("z8:stub:music\n");
+    return 0;
+}
+
+int vm::api_sfx(lua_State *l)
+{
+    // SFX index: valid values are 0..63 for actual samples,
+    // -1 to stop sound on a channel, -2 to stop looping on a channel
+    int sfx = (int)lua_tonumber(l, 1);
+    // Audio channel: valid values are 0..3 or -1 (autoselect)
+    int chan = lua_isnone(l, 2) ? -1 : (int)lua_tonumber(l, 2);
+    // Sound offset: valid values are 0..31, negative values act as 0,
+    // and fractional values are ignored
+    int offset = lol::max(0, (int)lua_tonumber(l, 3));
+
+    if (sfx < -2 || sfx > 63 || chan < -1 || chan > 4 || offset > 31)
+        return 0;
+
+    play_sfx(sfx, chan, offset);
 
     return 0;
 }
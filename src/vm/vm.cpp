@@ -123,8 +123,12 @@ vm::vm()
     // Clear memory
     ::memset(&m_ram, 0, sizeof(m_ram));
 
-    // Initialize Zepto8 runtime
-    int status = luaL_dostring(m_lua, m_bios.get_code().c_str());
+    // Initialize Zepto8 runtime, using the precompiled BIOS if possible
+    size_t size = 0;
+    uint8_t const *bytecode = m_bios.get_bytecode(size);
+    int status = lua_loadcached(m_lua, m_bios.get_code(), bytecode, size);
+    if (status == LUA_OK)
+        status = lua_pcall(m_lua, 0, LUA_MULTRET, 0);
     if (status != LUA_OK)
     {
         char const *message = lua_tostring(m_lua, -1);
@@ -164,9 +168,9 @@ void vm::instruction_hook(lua_State *l, lua_Debug *)
         lua_yield(l, 0);
 }
 
-void vm::load(char const *name)
+bool vm::load(char const *name)
 {
-    m_cart.load(name);
+    return m_cart.load(name);
 }
 
 void vm::run()
@@ -231,11 +235,22 @@ int vm::api_run(lua_State *l)
     // Initialise VM state (TODO: check what else to init)
     ::memset(m_buttons, 0, sizeof(m_buttons));
 
-    // Load cartridge code and call _z8.run_cart() on it
+    // Compile cartridge code with the suffix provided by the BIOS, then
+    // call _z8.run_cart() on the function, or on nil and the error message
     lua_getglobal(l, "_z8");
     lua_getfield(l, -1, "run_cart");
-    lua_pushstring(l, m_cart.get_lua().c_str());
-    lua_pcall(l, 1, 0, 0);
+    lua_getfield(l, -2, "cart_suffix");
+    char const *suffix = lua_tostring(l, -1);
+    std::string const code = m_cart.get_lua() + (suffix ? suffix : "");
+    lua_pop(l, 1);
+    int nargs = 1;
+    if (lua_loadcached(l, code) != LUA_OK)
+    {
+        lua_pushnil(l);
+        lua_insert(l, -2);
+        nargs = 2;
+    }
+    lua_pcall(l, nargs, 0, 0);
 
     return 0;
 }
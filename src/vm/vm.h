@@ -14,10 +14,14 @@
 
 #include <lol/engine.h>
 
+#include <map>
+#include <vector>
+
 #include "zepto8.h"
 #include "bios.h"
 #include "cart.h"
 #include "memory.h"
+#include "resampler.h"
 #include "vm/z8lua.h"
 
 namespace z8
@@ -35,7 +39,7 @@ public:
     vm();
     ~vm();
 
-    void load(char const *name);
+    bool load(char const *name);
     void run();
     bool step(float seconds);
 
@@ -53,6 +57,19 @@ public:
     void mouse(lol::ivec2 coords, int buttons);
     void keyboard(char ch);
 
+    // Audio: these are also used for offline rendering
+    void play_sfx(int sfx, int chan = -1, int offset = 0);
+    void getaudio(int channel, void *buffer, int bytes);
+
+    // The synth always runs at 22050 Hz; other output rates are resampled
+    void set_sample_rate(int rate,
+                         resampler::quality q = resampler::quality::medium);
+
+    inline bool is_playing(int chan) const
+    {
+        return m_channels[chan].m_sfx != -1;
+    }
+
 private:
     static int panic_hook(lua_State *l);
     static void instruction_hook(lua_State *l, lua_Debug *ar);
@@ -129,7 +146,12 @@ private:
     uint8_t getspixel(int16_t x, int16_t y);
     void setspixel(int16_t x, int16_t y, uint8_t color);
 
-    void getaudio(int channel, void *buffer, int bytes);
+    struct voice;
+    struct channel;
+
+    void synth(int channel, float *buffer, int samples);
+    float voice_sample(voice &v, int key_offset, double ratio, channel *ch);
+    float instrument_sample(channel &ch, int instrument, int key, int fx, double ratio);
 
 private:
     lua_State *m_lua;
@@ -153,17 +175,49 @@ private:
     }
     m_music;
 
-    struct channel
+    // A voice plays one SFX; channels have a second voice for SFX
+    // instruments, which cannot nest any further.
+    struct voice
     {
-        channel();
+        void start(int sfx, int offset = 0);
 
         int16_t m_sfx = -1;
         float m_offset = 0;
-        float m_phi = 0;
+        uint64_t m_phi = 0; // 32.32 fixed point cycles
         bool m_can_loop = true;
 
         int8_t m_prev_key = 0;
         float m_prev_vol = 0;
+    };
+
+    // An SFX instrument rendered at a given key, and the voice state
+    // needed to render more of it
+    struct inst_entry
+    {
+        voice m_voice;
+        std::vector<float> m_pcm;
+    };
+
+    // Rendered SFX instruments, indexed by instrument * 64 + key, valid
+    // as long as the hash of SFX 0…7 does not change
+    struct inst_cache
+    {
+        uint64_t m_hash = 0;
+        size_t m_total = 0;
+        std::map<int, inst_entry> m_entries;
+    };
+
+    struct channel : voice
+    {
+        channel();
+
+        voice m_inst;
+        bool m_inst_retrigger = true;
+        size_t m_inst_pos = 0;
+        inst_entry *m_inst_entry = nullptr;
+        inst_cache m_inst_cache;
+
+        resampler m_resampler;
     }
     m_channels[4];
 
@@ -14,7 +14,15 @@
 #   include "config.h"
 #endif
 
+#include <lol/engine.h>
+
 #include "z8lua.h"
+#include "cache.h"
+
+// Checksum of the z8lua sources, computed by the build system
+#if HAVE_Z8LUA_VERSION
+#   include "z8lua-version.h"
+#endif
 
 #include <cctype>
 
@@ -71,5 +79,68 @@ void lua_pushtostr(lua_State *l, bool do_hex)
     lua_pushstring(l, str);
 }
 
+static int dump_writer(lua_State *, void const *p, size_t sz, void *ud)
+{
+    static_cast<std::string *>(ud)->append((char const *)p, sz);
+    return 0;
+}
+
+int lua_loadcached(lua_State *l, std::string const &code,
+                   uint8_t const *bytecode, size_t size)
+{
+    // The chunk is named after its code, like luaL_loadstring() does,
+    // so that error messages are the same whether it was cached or not
+    char const *name = code.c_str();
+
+    // Bytecode built for another VM or architecture is rejected by the
+    // header check in lua_load(), so we can safely try it first
+    if (bytecode && luaL_loadbufferx(l, (char const *)bytecode, size, name, "b") == LUA_OK)
+        return LUA_OK;
+    if (bytecode)
+    {
+        lol::msg::debug("embedded bytecode rejected: %s\n", lua_tostring(l, -1));
+        lua_pop(l, 1);
+    }
+
+    // Cached bytecode is versioned with the z8lua sources, since neither
+    // LUA_RELEASE nor the header check in lua_load() change when the
+    // parser or the opcodes do. Without that checksum, stale entries
+    // could not be detected, so bytecode is not cached at all.
+#if HAVE_Z8LUA_VERSION
+    uint32_t const version = Z8LUA_VERSION;
+    bool const cached = cart_cache::enabled();
+#else
+    uint32_t const version = 0;
+    bool const cached = false;
+#endif
+
+    uint64_t key = 0;
+    std::string data;
+    if (cached)
+    {
+        key = cart_cache::hash((uint8_t const *)code.data(), code.length());
+        if (cart_cache::load_data(key, "luac", version, data))
+        {
+            if (luaL_loadbufferx(l, data.data(), data.length(), name, "b") == LUA_OK)
+                return LUA_OK;
+            lua_pop(l, 1);
+        }
+    }
+
+    int status = luaL_loadbufferx(l, code.data(), code.length(), name, "t");
+    if (status == LUA_OK && cached)
+    {
+        data.clear();
+#if LUA_VERSION_NUM >= 503
+        lua_dump(l, dump_writer, &data, 0);
+#else
+        lua_dump(l, dump_writer, &data);
+#endif
+        if (!cart_cache::store_data(key, "luac", version, data))
+            lol::msg::warn("could not store bytecode in cache\n");
+    }
+    return status;
+}
+
 } // namespace z8
 
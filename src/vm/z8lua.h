@@ -16,6 +16,9 @@
 #include "z8lua/lauxlib.h"
 #include "z8lua/lualib.h"
 
+#include <cstdint>
+#include <string>
+
 // The z8lua.h header
 // ——————————————————
 // This header provides some Lua C API function helpers.
@@ -26,5 +29,11 @@ namespace z8
 char const *lua_tostringorboolean(lua_State *l, int n);
 void lua_pushtostr(lua_State *l, bool do_hex);
 
+// Load a chunk like luaL_loadbuffer(), using “bytecode” if it is not null
+// and was built for this Lua VM, then bytecode from the on-disk cache if
+// enabled. Code that has to be compiled is stored in the cache.
+int lua_loadcached(lua_State *l, std::string const &code,
+                   uint8_t const *bytecode = nullptr, size_t size = 0);
+
 } // namespace z8
 
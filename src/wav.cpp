@@ -0,0 +1,579 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "zepto8.h"
+#include "vm/vm.h"
+#include "wav.h"
+
+namespace z8
+{
+
+using lol::msg;
+
+enum
+{
+    SYNTH_RATE = 22050,
+    BLOCK_SAMPLES = 4096,
+};
+
+// A unit of work that can be rendered independently of the others:
+// either a single SFX, or one music pattern.
+struct wav_job
+{
+    int sfx[4] = { -1, -1, -1, -1 };
+    bool can_loop = false;
+    int samples = 0;
+
+    std::vector<int16_t> pcm;
+    bool done = false;
+};
+
+static int sfx_samples(memory const &rom, int n, int rate)
+{
+    // PICO-8 plays 183 samples per speed unit per note at 22050 Hz
+    int64_t samples = 32 * 183 * lol::max(1, (int)rom.sfx[n].speed);
+    return (int)(samples * rate / SYNTH_RATE);
+}
+
+static bool sfx_is_empty(memory const &rom, int n)
+{
+    // Volume is stored in bits 1—3 of the second note byte
+    for (auto const &note : rom.sfx[n].notes)
+        if ((note[1] >> 1) & 0x7)
+            return false;
+    return true;
+}
+
+static std::vector<wav_job> get_jobs(memory const &rom, int sfx, int music, int rate)
+{
+    std::vector<wav_job> ret;
+
+    if (music >= 0)
+    {
+        // Follow the song until a stop or loop end flag is found; we do
+        // not want to render looping songs forever.
+        for (int n = music; n < 64; ++n)
+        {
+            auto const &song = rom.song[n];
+            wav_job job;
+            job.can_loop = true;
+
+            // The leftmost non-looping channel dictates the pattern length;
+            // if all channels loop, use the leftmost one.
+            int any_samples = 0, nonloop_samples = 0;
+            for (int c = 0; c < 4; ++c)
+            {
+                int id = song.sfx(c);
+                if (id >= 64)
+                    continue; // channel is disabled
+
+                job.sfx[c] = id;
+                int samples = sfx_samples(rom, id, rate);
+                bool loops = rom.sfx[id].loop_start < rom.sfx[id].loop_end;
+                if (!any_samples)
+                    any_samples = samples;
+                if (!loops && !nonloop_samples)
+                    nonloop_samples = samples;
+            }
+
+            job.samples = nonloop_samples ? nonloop_samples : any_samples;
+            if (!job.samples)
+                break;
+
+            ret.push_back(std::move(job));
+
+            if (song.flags() & 0x6)
+                break;
+        }
+    }
+    else
+    {
+        for (int n = sfx >= 0 ? sfx : 0; n < (sfx >= 0 ? sfx + 1 : 64); ++n)
+        {
+            if (sfx < 0 && sfx_is_empty(rom, n))
+                continue;
+
+            wav_job job;
+            job.sfx[0] = n;
+            job.samples = sfx_samples(rom, n, rate);
+            ret.push_back(std::move(job));
+        }
+    }
+
+    return ret;
+}
+
+static void render(vm &v, wav_job &job, int rate, resampler::quality q)
+{
+    int16_t buffer[BLOCK_SAMPLES * 2];
+    int32_t mix[BLOCK_SAMPLES];
+
+    // Reset the resamplers, otherwise their buffered input and filter
+    // history from the previous job leak into the start of this one.
+    v.set_sample_rate(rate, q);
+
+    for (int c = 0; c < 4; ++c)
+    {
+        v.play_sfx(-1, c);
+        if (job.sfx[c] < 0)
+            continue;
+
+        v.play_sfx(job.sfx[c], c);
+        // Looping SFX are played only once when rendered on their own
+        if (!job.can_loop)
+            v.play_sfx(-2, c);
+    }
+
+    job.pcm.resize(job.samples);
+
+    for (int pos = 0; pos < job.samples; pos += BLOCK_SAMPLES)
+    {
+        int const count = lol::min((int)BLOCK_SAMPLES, job.samples - pos);
+        bool playing = false;
+
+        memset(mix, 0, count * sizeof(*mix));
+        for (int c = 0; c < 4; ++c)
+        {
+            if (job.sfx[c] < 0)
+                continue;
+
+            // getaudio() outputs stereo S16 with identical channels
+            playing |= v.is_playing(c);
+            v.getaudio(c, buffer, count * 4);
+            for (int i = 0; i < count; ++i)
+                mix[i] += buffer[2 * i];
+        }
+
+        for (int i = 0; i < count; ++i)
+            job.pcm[pos + i] = (int16_t)lol::clamp(mix[i], -32768, 32767);
+
+        // Stop early if all channels are done
+        if (!playing)
+        {
+            job.pcm.resize(pos + count);
+            break;
+        }
+    }
+}
+
+static void write_header(FILE *f, int rate, uint32_t samples)
+{
+    uint32_t const data_bytes = samples * 2;
+    uint8_t header[44];
+
+    auto put16 = [&](int n, uint32_t x)
+    {
+        header[n] = (uint8_t)x;
+        header[n + 1] = (uint8_t)(x >> 8);
+    };
+
+    auto put32 = [&](int n, uint32_t x)
+    {
+        put16(n, x);
+        put16(n + 2, x >> 16);
+    };
+
+    memcpy(header, "RIFF\0\0\0\0WAVEfmt ", 16);
+    put32(4, 36 + data_bytes);  // chunk size
+    put32(16, 16);              // subchunk size
+    put16(20, 1);               // format (PCM)
+    put16(22, 1);               // channels (mono)
+    put32(24, rate);            // sample rate
+    put32(28, rate * 2);        // byte rate
+    put16(32, 2);               // block align
+    put16(34, 16);              // bits per sample
+    memcpy(header + 36, "data", 4);
+    put32(40, data_bytes);
+
+    fwrite(header, 1, sizeof(header), f);
+}
+
+bool towav(char const *cart, char const *out, int sfx, int music,
+           int rate, resampler::quality q)
+{
+    if (!out || (sfx > 63) || (music > 63))
+        return false;
+
+    lol::timer t;
+
+    // We need the ROM to build the job list; workers each get their own VM
+    z8::cart c;
+    if (!c.load(cart))
+        return false;
+
+    std::vector<wav_job> jobs = get_jobs(c.get_rom(), sfx, music, rate);
+
+    FILE *f = fopen(out, "wb");
+    if (!f)
+    {
+        msg::error("cannot open %s for writing\n", out);
+        return false;
+    }
+
+    // The sizes in the header are fixed once everything is written
+    write_header(f, rate, 0);
+
+    int const thread_count = lol::clamp((int)std::thread::hardware_concurrency(),
+                                        1, lol::max(1, (int)jobs.size()));
+
+    std::atomic<int> next(0);
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t written = 0;
+
+    auto worker = [&]()
+    {
+        std::unique_ptr<vm> v(new vm());
+        v->load(cart);
+        memcpy(&v->get_ram(), &v->get_rom(), offsetof(memory, code));
+
+        for (;;)
+        {
+            int n = next++;
+            if (n >= (int)jobs.size())
+                break;
+
+            // Do not render too far ahead of the writer, so that memory
+            // usage remains bounded on long songs.
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return n < (int)written + 2 * thread_count; });
+            }
+
+            render(*v, jobs[n], rate, q);
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                jobs[n].done = true;
+            }
+            cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; ++i)
+        threads.push_back(std::thread(worker));
+
+    // Stream results to disk in order, as soon as they are ready
+    uint32_t total = 0;
+    for (size_t n = 0; n < jobs.size(); ++n)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return jobs[n].done; });
+        }
+
+        fwrite(jobs[n].pcm.data(), 2, jobs[n].pcm.size(), f);
+        total += (uint32_t)jobs[n].pcm.size();
+        std::vector<int16_t>().swap(jobs[n].pcm);
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            written = n + 1;
+        }
+        cv.notify_all();
+    }
+
+    for (auto &th : threads)
+        th.join();
+
+    fseek(f, 0, SEEK_SET);
+    write_header(f, rate, total);
+    fclose(f);
+
+    float const seconds = t.poll();
+    msg::info("rendered %d chunks, %.2fs of audio in %.2fs (%.1f× realtime, %d threads)\n",
+              (int)jobs.size(), (float)total / rate, seconds,
+              (float)total / rate / lol::max(seconds, 1e-6f), thread_count);
+
+    return true;
+}
+
+static void test_throughput()
+{
+    // Render a synthetic SFX for every instrument and effect combination,
+    // plus one row for SFX instruments (played from SFX 0).
+    std::unique_ptr<vm> v(new vm());
+    memory &ram = v->get_ram();
+
+    for (int j = 0; j < 32; ++j)
+    {
+        ram.sfx[0].notes[j][0] = (uint8_t)(24 + j % 12);
+        ram.sfx[0].notes[j][1] = (uint8_t)(5 << 1);
+    }
+    ram.sfx[0].speed = 1;
+    ram.sfx[0].loop_start = 0;
+    ram.sfx[0].loop_end = 32;
+
+    printf("samples/s  fx0    fx1    fx2    fx3    fx4    fx5    fx6    fx7  (M)\n");
+    for (int ins = 0; ins < 9; ++ins)
+    {
+        printf(ins < 8 ? "ins%d    " : "sfx%d    ", ins & 7);
+        for (int fx = 0; fx < 8; ++fx)
+        {
+            bool const custom = ins == 8;
+            for (int j = 0; j < 32; ++j)
+            {
+                int const key = 24 + (j * 7) % 24;
+                int const n = custom ? 0 : ins;
+                ram.sfx[8].notes[j][0] = (uint8_t)(key | (n << 6));
+                ram.sfx[8].notes[j][1] = (uint8_t)((n >> 2) | (5 << 1) | (fx << 4)
+                                                   | (custom ? 0x80 : 0));
+            }
+            ram.sfx[8].speed = 16;
+            ram.sfx[8].loop_start = ram.sfx[8].loop_end = 0;
+
+            wav_job job;
+            job.sfx[0] = 8;
+            job.samples = sfx_samples(ram, 8, SYNTH_RATE);
+
+            lol::timer t;
+            int64_t total = 0;
+            for (int pass = 0; pass < 4; ++pass)
+            {
+                render(*v, job, SYNTH_RATE, resampler::quality::fast);
+                total += job.pcm.size();
+            }
+            float const seconds = t.poll();
+            printf(" %6.1f", total / lol::max(seconds, 1e-6f) * 1e-6f);
+        }
+        printf("\n");
+    }
+}
+
+void audiobench(char const *cart)
+{
+    std::unique_ptr<vm> v(new vm());
+    v->load(cart);
+    memcpy(&v->get_ram(), &v->get_rom(), offsetof(memory, code));
+
+    struct { int rate; resampler::quality q; } const settings[] =
+    {
+        { 22050, resampler::quality::fast },
+        { 44100, resampler::quality::fast },
+        { 44100, resampler::quality::medium },
+        { 44100, resampler::quality::best },
+        { 48000, resampler::quality::fast },
+        { 48000, resampler::quality::medium },
+        { 48000, resampler::quality::best },
+    };
+
+    for (auto const &s : settings)
+    {
+        lol::timer t;
+        int64_t total = 0;
+        for (auto &job : get_jobs(v->get_rom(), -1, -1, s.rate))
+        {
+            render(*v, job, s.rate, s.q);
+            total += job.pcm.size();
+            std::vector<int16_t>().swap(job.pcm);
+        }
+        float const seconds = t.poll();
+        float const audio_seconds = (float)total / s.rate;
+
+        printf("%5d Hz %-6s  %7.3f ms CPU per second of audio\n",
+               s.rate, s.rate == SYNTH_RATE ? "native" : resampler::name(s.q),
+               1000.f * seconds / lol::max(audio_seconds, 1e-6f));
+    }
+
+    printf("\n");
+    test_throughput();
+}
+
+// FNV-1a hash of rendered samples
+static uint64_t pcm_hash(std::vector<int16_t> const &pcm)
+{
+    uint64_t ret = 0xcbf29ce484222325ull;
+    for (int16_t x : pcm)
+    {
+        ret = (ret ^ (uint8_t)x) * 0x100000001b3ull;
+        ret = (ret ^ (uint8_t)(x >> 8)) * 0x100000001b3ull;
+    }
+    return ret;
+}
+
+static double pcm_rms(std::vector<int16_t> const &pcm)
+{
+    double sum = 0.0;
+    for (int16_t x : pcm)
+        sum += (double)x * x;
+    return pcm.empty() ? 0.0 : std::sqrt(sum / pcm.size());
+}
+
+// One line of the golden file: the native synth output must match
+// exactly, while the resampled output is only compared within a
+// tolerance because it depends on float rounding.
+struct golden_entry
+{
+    int samples = 0;
+    uint64_t hash = 0;
+    double rms = 0.0;
+};
+
+int audiotest(std::vector<char const *> const &carts, char const *golden, bool update)
+{
+    std::map<std::string, golden_entry> expected, actual;
+
+    if (golden && !update)
+    {
+        FILE *f = fopen(golden, "r");
+        if (!f)
+        {
+            msg::error("cannot open %s for reading\n", golden);
+            return -1;
+        }
+
+        char name[256];
+        golden_entry e;
+        unsigned long long hash;
+        while (fscanf(f, "%255s %d %llx %lf", name, &e.samples, &hash, &e.rms) == 4)
+        {
+            e.hash = hash;
+            expected[name] = e;
+        }
+        fclose(f);
+    }
+
+    int failures = 0, count = 0;
+
+    for (char const *cart : carts)
+    {
+        std::unique_ptr<vm> v(new vm());
+        if (!v->load(cart))
+        {
+            // A cart that fails to load would otherwise yield no jobs
+            printf("FAIL %s: cannot load cartridge\n", cart);
+            ++failures;
+            continue;
+        }
+        memcpy(&v->get_ram(), &v->get_rom(), offsetof(memory, code));
+
+        std::string base = cart;
+        base = base.substr(base.find_last_of("/\\") + 1);
+
+        // Every non-empty SFX on its own, then every song pattern
+        std::vector<std::pair<std::string, wav_job>> jobs;
+        for (auto &job : get_jobs(v->get_rom(), -1, -1, SYNTH_RATE))
+            jobs.push_back(std::make_pair(lol::format("%s:sfx%d", base.c_str(), job.sfx[0]), job));
+        for (int n = 0; n < 64; ++n)
+        {
+            auto music = get_jobs(v->get_rom(), -1, n, SYNTH_RATE);
+            if (music.size())
+                jobs.push_back(std::make_pair(lol::format("%s:pat%d", base.c_str(), n), music[0]));
+        }
+
+        for (auto &j : jobs)
+        {
+            golden_entry e;
+
+            // Native rate: no resampling, output is bit-exact
+            render(*v, j.second, SYNTH_RATE, resampler::quality::fast);
+            e.samples = (int)j.second.pcm.size();
+            e.hash = pcm_hash(j.second.pcm);
+
+            // 48 kHz through the best filter
+            wav_job job48 = j.second;
+            job48.samples = (int)((int64_t)job48.samples * 48000 / SYNTH_RATE);
+            render(*v, job48, 48000, resampler::quality::best);
+            e.rms = pcm_rms(job48.pcm);
+
+            // Rendering the same job again must give the same output,
+            // whatever was rendered before it on this VM
+            wav_job again = job48;
+            render(*v, again, 48000, resampler::quality::best);
+            if (again.pcm != job48.pcm)
+            {
+                printf("FAIL %s: 48000 Hz output depends on the previous job\n",
+                       j.first.c_str());
+                ++failures;
+            }
+
+            actual[j.first] = e;
+            ++count;
+
+            if (golden && !update)
+            {
+                auto it = expected.find(j.first);
+                if (it == expected.end())
+                {
+                    printf("FAIL %s: no golden data\n", j.first.c_str());
+                    ++failures;
+                    continue;
+                }
+
+                bool const exact = it->second.samples == e.samples
+                                && it->second.hash == e.hash;
+                bool const close = lol::abs(it->second.rms - e.rms)
+                                     <= 0.5 + 1e-3 * it->second.rms;
+                if (!exact || !close)
+                {
+                    printf("FAIL %s:%s%s\n", j.first.c_str(),
+                           exact ? "" : " 22050 Hz output differs",
+                           close ? "" : " 48000 Hz output out of tolerance");
+                    ++failures;
+                }
+            }
+        }
+    }
+
+    // Entries that are no longer rendered at all are failures, too
+    if (golden && !update)
+    {
+        for (auto const &kv : expected)
+        {
+            if (actual.find(kv.first) != actual.end())
+                continue;
+            printf("FAIL %s: not rendered\n", kv.first.c_str());
+            ++failures;
+            ++count;
+        }
+    }
+
+    if (golden && update)
+    {
+        FILE *f = fopen(golden, "w");
+        if (!f)
+        {
+            msg::error("cannot open %s for writing\n", golden);
+            return -1;
+        }
+        for (auto const &kv : actual)
+            fprintf(f, "%s %d %016llx %.3f\n", kv.first.c_str(), kv.second.samples,
+                    (unsigned long long)kv.second.hash, kv.second.rms);
+        fclose(f);
+        msg::info("wrote %d entries to %s\n", (int)actual.size(), golden);
+    }
+    else if (golden)
+    {
+        printf("%d tests - %d passed, %d failed.\n", count, count - failures, failures);
+    }
+
+    return failures;
+}
+
+} // namespace z8
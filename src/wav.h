@@ -0,0 +1,44 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2019 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include <vector>
+
+#include "resampler.h"
+
+// The WAV exporter
+// ————————————————
+// Renders cartridge audio offline through the VM synthesiser, as fast
+// as the CPU allows, and streams the result to a WAV file.
+
+namespace z8
+{
+
+// Render SFX “sfx”, or the song starting at pattern “music”. If both
+// are negative, every non-empty SFX is rendered, one after the other.
+bool towav(char const *cart, char const *out, int sfx, int music,
+           int rate, resampler::quality q);
+
+// Report the CPU cost of rendering a cartridge’s SFX at several output
+// rates and resampler settings, then synth throughput per instrument
+// and effect.
+void audiobench(char const *cart);
+
+// Render every SFX and song pattern of “carts” and compare the output
+// with the golden file, or write it if “update” is true. Returns the
+// number of mismatches, or -1 on error.
+int audiotest(std::vector<char const *> const &carts, char const *golden, bool update);
+
+} // namespace z8
@@ -28,6 +28,13 @@
 #include "dither.h"
 #include "minify.h"
 #include "compress.h"
+#include "wav.h"
+#include "p8bench.h"
+#include "pxa.h"
+#include "cache.h"
+#include "archive.h"
+#include "batch.h"
+#include "budget.h"
 
 enum class mode
 {
@@ -40,12 +47,18 @@ enum class mode
     dither   = 135,
     minify   = 136,
     compress = 137,
+    audiobench = 138,
+    audiotest = 139,
 
     tolua  = 140,
     topng  = 141,
     top8   = 143,
     tobin  = 144,
     todata = 145,
+    towav  = 146,
+    p8bench = 147,
+    codebench = 148,
+    torom  = 149,
 
     out     = 'o',
     data    = 150,
@@ -53,14 +66,41 @@ enum class mode
     error_diffusion = 152,
     raw     = 153,
     skip    = 154,
+    sfx     = 155,
+    music   = 156,
+    rate    = 157,
+    resampler = 158,
+    golden  = 159,
+    update  = 160,
+    pxa     = 161,
+    effort  = 162,
+    cache   = 163,
+    archive = 164,
+    batch   = 165,
+    search  = 166,
+    video   = 167,
+    blue_noise = 168,
+    carry_error = 169,
 };
 
 static void usage()
 {
-    printf("Usage: z8tool [--tolua|--topng|--top8|--tobin|--todata] [--data <file>] <cart> [-o <file>]\n");
+    printf("Usage: z8tool [--tolua|--topng|--top8|--torom|--tobin|--todata] [--data <file>] <cart> [-o <file>]\n");
+    printf("       z8tool [--topng|--torom|--tobin] [--pxa [--effort <0-15>]] <cart> [-o <file>]\n");
+    printf("       z8tool [--tolua|--topng|--top8|--torom|--tobin|--todata] --batch <dir>\n"
+           "              <cart|dir|pattern|@listfile>...\n");
+    printf("       z8tool --towav [--sfx <num>|--music <num>] [--rate <hz>]\n"
+           "                      [--resampler fast|medium|best] <cart> -o <file>\n");
+    printf("       z8tool --archive <dir> -o <file>\n");
+    printf("       z8tool --audiobench <cart>\n");
+    printf("       z8tool --p8bench <cart>...\n");
+    printf("       z8tool --codebench <cart>...\n");
+    printf("       z8tool --audiotest [--golden <file> [--update]] <cart>...\n");
     printf("       z8tool --dither [--hicolor] [--error-diffusion] <image> [-o <file>]\n");
+    printf("       z8tool --dither --video [--hicolor] [--error-diffusion [--carry-error]]\n"
+           "                      [--blue-noise] <y4m|rgb24|-> [-o <file>]\n");
     printf("       z8tool --minify\n");
-    printf("       z8tool --compress [--raw <num>] [--skip <num>]\n");
+    printf("       z8tool --compress [--search] [--raw <num>] [--skip <num>]\n");
     printf("       z8tool --run <cart>\n");
     printf("       z8tool --inspect <cart>\n");
     printf("       z8tool --headless <cart>\n");
@@ -68,6 +108,7 @@ static void usage()
     printf("       z8tool --telnet <cart>\n");
 #endif
     printf("       z8tool --splore <image>\n");
+    printf("Options: --cache <dir>  keep parsed carts in <dir> (default: $ZEPTO8_CACHE)\n");
 }
 
 int main(int argc, char **argv)
@@ -81,18 +122,39 @@ int main(int argc, char **argv)
     opt.add_opt(int(mode::minify),   "minify",   false);
     opt.add_opt(int(mode::compress), "compress", false);
     opt.add_opt(int(mode::inspect),  "inspect",  true);
+    opt.add_opt(int(mode::audiobench), "audiobench", true);
+    opt.add_opt(int(mode::audiotest), "audiotest", false);
+    opt.add_opt(int(mode::p8bench),  "p8bench",  false);
+    opt.add_opt(int(mode::codebench), "codebench", false);
     opt.add_opt(int(mode::headless), "headless", true);
     opt.add_opt(int(mode::tolua),    "tolua",    false);
     opt.add_opt(int(mode::topng),    "topng",    false);
     opt.add_opt(int(mode::top8),     "top8",     false);
+    opt.add_opt(int(mode::torom),    "torom",    false);
     opt.add_opt(int(mode::tobin),    "tobin",    false);
     opt.add_opt(int(mode::todata),   "todata",   false);
+    opt.add_opt(int(mode::towav),    "towav",    false);
     opt.add_opt(int(mode::out),      "out",      true);
     opt.add_opt(int(mode::data),     "data",     true);
     opt.add_opt(int(mode::hicolor),  "hicolor",  false);
     opt.add_opt(int(mode::raw),      "raw",      true);
     opt.add_opt(int(mode::skip),     "skip",     true);
+    opt.add_opt(int(mode::sfx),      "sfx",      true);
+    opt.add_opt(int(mode::music),    "music",    true);
+    opt.add_opt(int(mode::rate),     "rate",     true);
+    opt.add_opt(int(mode::resampler), "resampler", true);
+    opt.add_opt(int(mode::golden),   "golden",   true);
+    opt.add_opt(int(mode::update),   "update",   false);
+    opt.add_opt(int(mode::pxa),      "pxa",      false);
+    opt.add_opt(int(mode::effort),   "effort",   true);
+    opt.add_opt(int(mode::cache),    "cache",    true);
+    opt.add_opt(int(mode::archive),  "archive",  true);
+    opt.add_opt(int(mode::batch),    "batch",    true);
+    opt.add_opt(int(mode::search),   "search",   false);
     opt.add_opt(int(mode::error_diffusion), "error-diffusion", false);
+    opt.add_opt(int(mode::video),    "video",    false);
+    opt.add_opt(int(mode::blue_noise), "blue-noise", false);
+    opt.add_opt(int(mode::carry_error), "carry-error", false);
 #if HAVE_UNISTD_H
     opt.add_opt(int(mode::telnet),   "telnet",   true);
 #endif
@@ -102,9 +164,19 @@ int main(int argc, char **argv)
     char const *data = nullptr;
     char const *in = nullptr;
     char const *out = nullptr;
+    char const *golden = nullptr;
+    char const *batch = nullptr;
     size_t raw = 0, skip = 0;
+    int sfx = -1, music = -1, rate = 22050;
+    z8::resampler::quality quality = z8::resampler::quality::medium;
     bool hicolor = false;
+    bool update = false;
+    bool search = false;
+    z8::cart::code_format format = z8::cart::code_format::legacy;
+    int effort = 8;
     bool error_diffusion = false;
+    bool video = false;
+    z8::dither_options dither_opts;
 
     for (;;)
     {
@@ -120,7 +192,9 @@ int main(int argc, char **argv)
         case (int)mode::run:
         case (int)mode::headless:
         case (int)mode::inspect:
+        case (int)mode::audiobench:
         case (int)mode::dither:
+        case (int)mode::archive:
         case (int)mode::telnet:
         case (int)mode::splore:
             run_mode = mode(c);
@@ -131,8 +205,13 @@ int main(int argc, char **argv)
         case (int)mode::tolua:
         case (int)mode::topng:
         case (int)mode::top8:
+        case (int)mode::torom:
         case (int)mode::tobin:
         case (int)mode::todata:
+        case (int)mode::towav:
+        case (int)mode::audiotest:
+        case (int)mode::p8bench:
+        case (int)mode::codebench:
             run_mode = mode(c);
             break;
         case (int)mode::data:
@@ -150,9 +229,53 @@ int main(int argc, char **argv)
         case (int)mode::skip:
             skip = atoi(opt.arg);
             break;
+        case (int)mode::sfx:
+            sfx = atoi(opt.arg);
+            break;
+        case (int)mode::music:
+            music = atoi(opt.arg);
+            break;
+        case (int)mode::rate:
+            rate = lol::clamp(atoi(opt.arg), 4000, 192000);
+            break;
+        case (int)mode::resampler:
+            quality = !strcmp(opt.arg, "fast") ? z8::resampler::quality::fast
+                    : !strcmp(opt.arg, "best") ? z8::resampler::quality::best
+                    : z8::resampler::quality::medium;
+            break;
+        case (int)mode::golden:
+            golden = opt.arg;
+            break;
+        case (int)mode::update:
+            update = true;
+            break;
+        case (int)mode::pxa:
+            format = z8::cart::code_format::pxa;
+            break;
+        case (int)mode::effort:
+            effort = lol::clamp(atoi(opt.arg), 0, 15);
+            break;
         case (int)mode::error_diffusion:
             error_diffusion = true;
             break;
+        case (int)mode::video:
+            video = true;
+            break;
+        case (int)mode::blue_noise:
+            dither_opts.blue_noise = true;
+            break;
+        case (int)mode::carry_error:
+            dither_opts.carry_error = true;
+            break;
+        case (int)mode::cache:
+            z8::cart_cache::set_dir(opt.arg);
+            break;
+        case (int)mode::batch:
+            batch = opt.arg;
+            break;
+        case (int)mode::search:
+            search = true;
+            break;
         default:
             return EXIT_FAILURE;
         }
@@ -161,8 +284,22 @@ int main(int argc, char **argv)
     if (!in)
         in = argv[opt.index];
 
-    if (run_mode == mode::tolua || run_mode == mode::top8 ||
-        run_mode == mode::tobin || run_mode == mode::topng ||
+    if (batch && (run_mode == mode::tolua || run_mode == mode::top8 ||
+                  run_mode == mode::torom || run_mode == mode::tobin ||
+                  run_mode == mode::topng || run_mode == mode::todata))
+    {
+        z8::batch_format to = run_mode == mode::tolua ? z8::batch_format::lua
+                            : run_mode == mode::top8 ? z8::batch_format::p8
+                            : run_mode == mode::torom ? z8::batch_format::rom
+                            : run_mode == mode::tobin ? z8::batch_format::bin
+                            : run_mode == mode::topng ? z8::batch_format::png
+                            : z8::batch_format::data;
+        std::vector<char const *> carts(argv + opt.index, argv + argc);
+        if (z8::batch(carts, batch, to, format, effort) != 0)
+            return EXIT_FAILURE;
+    }
+    else if (run_mode == mode::tolua || run_mode == mode::top8 ||
+        run_mode == mode::torom || run_mode == mode::tobin || run_mode == mode::topng ||
         run_mode == mode::todata || run_mode == mode::inspect)
     {
         z8::cart cart;
@@ -194,18 +331,28 @@ int main(int argc, char **argv)
         }
         else if (run_mode == mode::top8)
         {
-            printf("%s", cart.get_p8().c_str());
+            cart.write_p8(stdout);
         }
-        else if (run_mode == mode::tobin)
+        else if (run_mode == mode::torom || run_mode == mode::tobin)
         {
-            auto const &bin = cart.get_bin();
-            fwrite(&bin, 1, sizeof(bin), stdout);
+            auto const &bin = run_mode == mode::torom ? cart.get_p8_rom(format, effort)
+                                                      : cart.get_bin(format, effort);
+            if (bin.empty())
+                return EXIT_FAILURE;
+            FILE *f = out ? fopen(out, "wb") : stdout;
+            if (!f)
+                return EXIT_FAILURE;
+            bool ok = fwrite(bin.data(), 1, bin.size(), f) == bin.size();
+            if (out)
+                ok = fclose(f) == 0 && ok;
+            if (!ok)
+                return EXIT_FAILURE;
         }
         else if (run_mode == mode::topng)
         {
             if (!out)
                 return EXIT_FAILURE;
-            cart.get_png().save(out);
+            cart.get_png(format, effort).save(out);
         }
         else if (run_mode == mode::todata)
         {
@@ -213,8 +360,12 @@ int main(int argc, char **argv)
         }
         else if (run_mode == mode::inspect)
         {
-            printf("Code size: %d\n", (int)cart.get_p8().size());
-            printf("Compressed code size: %d\n", (int)cart.get_compressed_code().size());
+            z8::budget budget;
+            if (budget.analyze(cart.get_code()))
+                printf("%s", budget.report().c_str());
+            else
+                lol::msg::error("cannot analyse code: %s\n", budget.get_error().c_str());
+            printf("PXA compressed code size: %d\n", (int)z8::pxa_compress(cart.get_code(), effort).size());
         }
     }
     else if (run_mode == mode::run || run_mode == mode::headless)
@@ -233,6 +384,45 @@ int main(int argc, char **argv)
             }
         }
     }
+    else if (run_mode == mode::towav)
+    {
+        if (!z8::towav(in, out, sfx, music, rate, quality))
+            return EXIT_FAILURE;
+    }
+    else if (run_mode == mode::archive)
+    {
+        if (!out || !z8::cart_archive::build(in, out))
+            return EXIT_FAILURE;
+    }
+    else if (run_mode == mode::audiobench)
+    {
+        z8::audiobench(in);
+    }
+    else if (run_mode == mode::audiotest)
+    {
+        std::vector<char const *> carts(argv + opt.index, argv + argc);
+        if (z8::audiotest(carts, golden, update) != 0)
+            return EXIT_FAILURE;
+    }
+    else if (run_mode == mode::p8bench)
+    {
+        std::vector<char const *> carts(argv + opt.index, argv + argc);
+        if (z8::p8bench(carts) != 0)
+            return EXIT_FAILURE;
+    }
+    else if (run_mode == mode::codebench)
+    {
+        std::vector<char const *> carts(argv + opt.index, argv + argc);
+        if (z8::codebench(carts) != 0)
+            return EXIT_FAILURE;
+    }
+    else if (run_mode == mode::dither && video)
+    {
+        dither_opts.hicolor = hicolor;
+        dither_opts.error_diffusion = error_diffusion;
+        if (!z8::dither_video(in, out, dither_opts))
+            return EXIT_FAILURE;
+    }
     else if (run_mode == mode::dither)
     {
         z8::dither(in, out, hicolor, error_diffusion);
@@ -241,17 +431,49 @@ int main(int argc, char **argv)
     {
         auto input = std::string{ std::istreambuf_iterator<char>(std::cin),
                                   std::istreambuf_iterator<char>() };
-        std::cout << z8::minify(input) << '\n';
+        lol::timer t;
+        auto output = z8::minify(input);
+        float const elapsed = t.get();
+        lol::msg::info("minified %d bytes to %d bytes (%.1f%%) in %.2f ms\n",
+                       (int)input.length(), (int)output.length(),
+                       100.f * output.length() / lol::max(input.length(), size_t(1)),
+                       elapsed * 1e3f);
+        std::cout << output << '\n';
     }
     else if (run_mode == mode::compress)
     {
-        std::vector<uint8_t> input;
-        for (uint8_t ch : std::vector<char>{ std::istreambuf_iterator<char>(std::cin),
-                                             std::istreambuf_iterator<char>() })
-        input.push_back(ch);
+        std::vector<uint8_t> output;
 
-        // Compress input buffer
-        std::vector<uint8_t> output = z8::compress(input);
+        if (search)
+        {
+            // The search needs the whole input at once
+            std::vector<uint8_t> input{ std::istreambuf_iterator<char>(std::cin),
+                                        std::istreambuf_iterator<char>() };
+            output = z8::compress_search(input, skip);
+        }
+        else
+        {
+            // Stream the input; raw output is streamed too, since it is
+            // only truncated, whereas encode59() needs all the data.
+            size_t remaining = raw;
+            z8::compressor::sink out = [&](uint8_t const *data, size_t size)
+            {
+                if (raw > 0)
+                {
+                    size = std::min(size, remaining);
+                    fwrite(data, 1, size, stdout);
+                    remaining -= size;
+                }
+                else
+                    output.insert(output.end(), data, data + size);
+            };
+
+            z8::compressor c;
+            if (!c.write_fd(fileno(stdin), out) || !c.finish(out))
+                return EXIT_FAILURE;
+            if (raw > 0)
+                return EXIT_SUCCESS;
+        }
 
         // Output result, encoded according to user-provided flags
         if (raw > 0)
@@ -262,7 +484,22 @@ int main(int argc, char **argv)
         {
             if (skip > 0)
                 output.erase(output.begin(), output.begin() + std::min(skip, output.size()));
-            std::cout << z8::encode59(output) << '\n';
+            std::string const encoded = z8::encode59(output);
+
+            // Make sure the string decodes back to the data, except for
+            // trailing zero bytes, which may be lost or added
+            auto decoded = z8::decode59(encoded);
+            bool ok = true;
+            for (size_t i = output.size(); i < decoded.size(); ++i)
+                ok = ok && decoded[i] == 0;
+            decoded.resize(output.size());
+            if (!ok || decoded != output)
+            {
+                lol::msg::error("base 59 string does not decode back to the data\n");
+                return EXIT_FAILURE;
+            }
+
+            std::cout << encoded << '\n';
         }
     }
     else if (run_mode == mode::splore)